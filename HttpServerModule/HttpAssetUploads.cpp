@@ -0,0 +1,314 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpAssetUploads.h"
+
+#include "Profiler.h"
+
+#include "boost/lexical_cast.hpp"
+
+#include <QMutexLocker>
+#include <QFile>
+#include <QDir>
+#include <QUrl>
+#include <QStringList>
+#include <QTemporaryFile>
+
+#include <algorithm>
+
+namespace
+{
+
+const QString cAssetsPrefix = "/assets/";
+
+/// Bytes written to the temporary file at a time
+const size_t cWriteSize = 64 * 1024;
+/// Seconds after which an upload that receives nothing is abandoned
+const double cIdleSeconds = 600.0;
+
+/// Parses a Content-Range header of the form bytes first-last/total, or bytes */total for a query.
+bool ParseContentRange(const std::string &header, qint64 &first, qint64 &last, qint64 &total, bool &query)
+{
+    const QByteArray range = QByteArray(header.c_str()).trimmed();
+    if (!range.startsWith("bytes "))
+        return false;
+    const int slash = range.indexOf('/');
+    if (slash < 0)
+        return false;
+
+    bool ok = false;
+    total = range.mid(slash + 1).trimmed().toLongLong(&ok);
+    if (!ok || total < 0)
+        return false;
+
+    const QByteArray span = range.mid(6, slash - 6).trimmed();
+    query = (span == "*");
+    if (query)
+        return true;
+    const int dash = span.indexOf('-');
+    if (dash <= 0)
+        return false;
+    bool firstOk = false;
+    bool lastOk = false;
+    first = span.left(dash).toLongLong(&firstOk);
+    last = span.mid(dash + 1).toLongLong(&lastOk);
+    return firstOk && lastOk && first >= 0 && first <= last && last < total;
+}
+
+/// Returns whether an asset name stays inside the storage it is joined to: a relative path without . or ..
+/// segments, backslashes or drive letters.
+bool IsSafeAssetName(const QString &name)
+{
+    if (name.isEmpty() || name.startsWith('/') || name.contains('\\') || name.contains(':') || QDir::isAbsolutePath(name))
+        return false;
+    const QStringList segments = name.split('/');
+    for(int i = 0; i < segments.size(); ++i)
+        if (segments[i].isEmpty() || segments[i] == "." || segments[i] == "..")
+            return false;
+    return true;
+}
+
+void ReplyStatus(HttpRequest::ConnectionPtr connection, websocketpp::http::status_code::value status, const char *message)
+{
+    connection->set_status(status);
+    connection->set_body(message);
+    connection->replace_header("Content-Type", "text/plain");
+}
+
+}
+
+HttpAssetUploads::HttpAssetUploads() :
+    enabled_(false),
+    maxSize_(1024 * 1024 * 1024),
+    maxChunkSize_(8 * 1024 * 1024),
+    bytesReceived_(0)
+{
+}
+
+HttpAssetUploads::~HttpAssetUploads()
+{
+    Clear();
+}
+
+void HttpAssetUploads::SetEnabled(bool enabled)
+{
+    QMutexLocker lock(&mutex_);
+    enabled_ = enabled;
+}
+
+bool HttpAssetUploads::IsEnabled() const
+{
+    QMutexLocker lock(&mutex_);
+    return enabled_;
+}
+
+void HttpAssetUploads::SetMaxSize(u64 bytes)
+{
+    QMutexLocker lock(&mutex_);
+    maxSize_ = bytes;
+}
+
+void HttpAssetUploads::SetMaxChunkSize(uint bytes)
+{
+    QMutexLocker lock(&mutex_);
+    maxChunkSize_ = std::max(bytes, 1u);
+}
+
+uint HttpAssetUploads::MaxChunkSize() const
+{
+    QMutexLocker lock(&mutex_);
+    return maxChunkSize_;
+}
+
+HttpAssetUploads::Outcome HttpAssetUploads::WriteChunk(HttpRequest::ConnectionPtr connection, HttpVerb verb, const std::string &resource)
+{
+    if (verb != HttpPut || !IsEnabled())
+        return NotAnUpload;
+    const QString path = QUrl(QString::fromUtf8(resource.c_str())).path();
+    if (!path.startsWith(cAssetsPrefix))
+        return NotAnUpload;
+
+    PROFILE(HttpAssetUploads_WriteChunk);
+
+    const QString name = path.mid(cAssetsPrefix.size());
+    if (!IsSafeAssetName(name))
+    {
+        ReplyStatus(connection, websocketpp::http::status_code::bad_request, "Invalid asset name");
+        return Replied;
+    }
+
+    // A request without Content-Range uploads the whole asset at once
+    const std::string &body = connection->get_request_body();
+    qint64 first = 0;
+    qint64 last = (qint64)body.size() - 1;
+    qint64 total = (qint64)body.size();
+    bool query = false;
+    const std::string contentRange = connection->get_request_header("Content-Range");
+    if ((!contentRange.empty() && !ParseContentRange(contentRange, first, last, total, query)) ||
+        (query && !body.empty()) || (!query && last - first + 1 != (qint64)body.size()) || total == 0)
+    {
+        ReplyStatus(connection, websocketpp::http::status_code::bad_request, "Invalid Content-Range or empty asset");
+        return Replied;
+    }
+
+    QMutexLocker lock(&mutex_);
+    if (body.size() > maxChunkSize_ || (u64)total > maxSize_)
+    {
+        ReplyStatus(connection, websocketpp::http::status_code::request_entity_too_large,
+            body.size() > maxChunkSize_ ? "Chunk too large" : "Asset too large");
+        return Replied;
+    }
+
+    const kNet::tick_t now = kNet::Clock::Tick();
+    QHash<QString, Upload>::iterator i = uploads_.find(name);
+    if (i != uploads_.end() && i->total != total && !i->writing)
+    {
+        // An upload of a different size starts over
+        QFile::remove(i->filePath);
+        uploads_.erase(i);
+        i = uploads_.end();
+    }
+    if (i == uploads_.end())
+    {
+        if (query)
+        {
+            ReplyIncomplete(connection, 0);
+            return Replied;
+        }
+        RemoveIdle(now);
+        // Each upload gets a file of its own, created exclusively under an unpredictable name, so that no other
+        // process can plant it and a later upload of the same name never touches a file that has been taken
+        QTemporaryFile tempFile(QDir::temp().filePath("tundra-upload-XXXXXX.part"));
+        tempFile.setAutoRemove(false);
+        if (!tempFile.open())
+        {
+            ReplyStatus(connection, websocketpp::http::status_code::internal_server_error, "Could not create the upload file");
+            return Replied;
+        }
+        Upload upload;
+        upload.filePath = tempFile.fileName();
+        upload.total = total;
+        upload.received = 0;
+        upload.writing = false;
+        upload.updated = now;
+        i = uploads_.insert(name, upload);
+    }
+
+    if (i->writing)
+    {
+        ReplyStatus(connection, websocketpp::http::status_code::conflict, "Another chunk of the upload is being written");
+        return Replied;
+    }
+    if (query)
+    {
+        if (i->received >= i->total)
+            return Completed;
+        ReplyIncomplete(connection, i->received);
+        return Replied;
+    }
+    // A chunk after a gap is not written; the client resumes from the end of what has been received
+    if (first > i->received)
+    {
+        ReplyIncomplete(connection, i->received);
+        return Replied;
+    }
+
+    // The file is written without holding the lock, so that other uploads proceed meanwhile
+    i->writing = true;
+    const QString filePath = i->filePath;
+    lock.unlock();
+
+    QFile file(filePath);
+    bool ok = file.open(QIODevice::ReadWrite) && file.seek(first);
+    for(size_t offset = 0; ok && offset < body.size(); offset += cWriteSize)
+    {
+        const qint64 size = (qint64)std::min(cWriteSize, body.size() - offset);
+        ok = (file.write(body.data() + offset, size) == size);
+    }
+    ok = file.flush() && ok;
+    file.close();
+
+    lock.relock();
+    i = uploads_.find(name);
+    if (i == uploads_.end())
+    {
+        // Cleared meanwhile
+        QFile::remove(filePath);
+        ReplyStatus(connection, websocketpp::http::status_code::service_unavailable, "Upload cancelled");
+        return Replied;
+    }
+    i->writing = false;
+    if (!ok)
+    {
+        QFile::remove(filePath);
+        uploads_.erase(i);
+        ReplyStatus(connection, websocketpp::http::status_code::internal_server_error, "Could not write the upload");
+        return Replied;
+    }
+
+    i->received = std::max(i->received, last + 1);
+    i->updated = now;
+    bytesReceived_ += body.size();
+    if (i->received >= i->total)
+        return Completed;
+    ReplyIncomplete(connection, i->received);
+    return Replied;
+}
+
+void HttpAssetUploads::ReplyIncomplete(HttpRequest::ConnectionPtr connection, qint64 received)
+{
+    // 308 Resume Incomplete, as in the resumable upload protocols that browsers' upload libraries speak
+    connection->set_status((websocketpp::http::status_code::value)308);
+    if (received > 0)
+        connection->replace_header("Range", "bytes=0-" + boost::lexical_cast<std::string>(received - 1));
+}
+
+QString HttpAssetUploads::TakeCompleted(const QString &name)
+{
+    QMutexLocker lock(&mutex_);
+    QHash<QString, Upload>::iterator i = uploads_.find(name);
+    if (i == uploads_.end() || i->writing || i->received < i->total)
+        return QString();
+    const QString filePath = i->filePath;
+    uploads_.erase(i);
+    return filePath;
+}
+
+void HttpAssetUploads::RemoveIdle(kNet::tick_t now)
+{
+    for(QHash<QString, Upload>::iterator i = uploads_.begin(); i != uploads_.end();)
+    {
+        if (!i->writing && kNet::Clock::TimespanToSecondsD(i->updated, now) > cIdleSeconds)
+        {
+            QFile::remove(i->filePath);
+            i = uploads_.erase(i);
+        }
+        else
+            ++i;
+    }
+}
+
+void HttpAssetUploads::Clear()
+{
+    QMutexLocker lock(&mutex_);
+    for(QHash<QString, Upload>::iterator i = uploads_.begin(); i != uploads_.end(); ++i)
+        QFile::remove(i->filePath);
+    uploads_.clear();
+}
+
+uint HttpAssetUploads::NumUploads() const
+{
+    QMutexLocker lock(&mutex_);
+    return (uint)uploads_.size();
+}
+
+u64 HttpAssetUploads::BytesReceived() const
+{
+    QMutexLocker lock(&mutex_);
+    return bytesReceived_;
+}
+
+void HttpAssetUploads::ResetStatistics()
+{
+    QMutexLocker lock(&mutex_);
+    bytesReceived_ = 0;
+}
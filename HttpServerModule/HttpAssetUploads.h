@@ -0,0 +1,89 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+#include "HttpRouter.h"
+
+#include <QMutex>
+#include <QHash>
+#include <QString>
+
+#include "kNet/Clock.h"
+
+/// Resumable asset uploads to PUT /assets/<name>, written to temporary files chunk by chunk.
+/** A large asset is uploaded as a series of PUT requests with Content-Range: bytes first-last/total headers,
+    each carrying one chunk of at most the chunk size, so no request body is larger than that. The chunks are
+    written to a temporary file as they arrive. A request without a body whose Content-Range has an asterisk
+    in place of the range asks how much has been received. Both it and a chunk that does not complete the
+    upload are answered with 308 and a Range header listing the bytes received so far, from which the client
+    resumes after an interruption.
+    Each upload is written to a temporary file of its own with a unique name. Asset names must be relative paths
+    without . or .. segments, backslashes or colons.
+    Once the last byte has been received, the request is left to the PUT /assets/*name route of the main thread,
+    which takes the file with TakeCompleted() and registers it with the asset API. Uploads that receive nothing
+    for ten minutes are abandoned. Can be used from any thread. */
+class HTTP_SERVER_MODULE_API HttpAssetUploads
+{
+public:
+    enum Outcome
+    {
+        /// Not an asset upload request
+        NotAnUpload,
+        /// The request has been answered
+        Replied,
+        /// The upload is complete and should be routed to the main thread
+        Completed
+    };
+
+    HttpAssetUploads();
+    ~HttpAssetUploads();
+
+    /// Sets whether uploads are accepted. Disabled by default, in which case no request is taken for an upload.
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const;
+    /// Sets the largest asset size that is accepted.
+    void SetMaxSize(u64 bytes);
+    /// Sets the largest request body of an upload.
+    void SetMaxChunkSize(uint bytes);
+    uint MaxChunkSize() const;
+
+    /// Writes the chunk of a PUT /assets/<name> request into the temporary file of its upload.
+    Outcome WriteChunk(HttpRequest::ConnectionPtr connection, HttpVerb verb, const std::string &resource);
+
+    /// Takes the temporary file of a completed upload, which the caller removes. Returns an empty string if the upload is not complete.
+    QString TakeCompleted(const QString &name);
+
+    /// Removes all uploads and their temporary files.
+    void Clear();
+
+    uint NumUploads() const;
+    /// Bytes written to temporary files since the last reset.
+    u64 BytesReceived() const;
+    void ResetStatistics();
+
+private:
+    struct Upload
+    {
+        QString filePath;
+        qint64 total;
+        /// Bytes received from the start; chunks are written in order
+        qint64 received;
+        /// Set while a chunk is being written, so that a concurrent request for the same upload is refused
+        bool writing;
+        kNet::tick_t updated;
+    };
+
+    /// Replies 308 with the range received so far.
+    static void ReplyIncomplete(HttpRequest::ConnectionPtr connection, qint64 received);
+    /// Removes the uploads that have not received anything for a while. Called with the mutex held.
+    void RemoveIdle(kNet::tick_t now);
+
+    mutable QMutex mutex_;
+    bool enabled_;
+    QHash<QString, Upload> uploads_;
+    u64 maxSize_;
+    uint maxChunkSize_;
+    u64 bytesReceived_;
+};
@@ -0,0 +1,349 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpChangeFeed.h"
+#include "SceneJsonWriter.h"
+
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+
+#include <QDomDocument>
+#include <QDomElement>
+
+#include <algorithm>
+
+namespace
+{
+
+const char *EventNames[] =
+{
+    "attributeChanged",
+    "attributeAdded",
+    "attributeRemoved",
+    "componentAdded",
+    "componentRemoved",
+    "entityCreated",
+    "entityRemoved"
+};
+
+}
+
+HttpChangeFeed::HttpChangeFeed(uint maxRecords, Compaction compaction) :
+    sequence_(0),
+    truncated_(0),
+    maxRecords_(std::max(maxRecords, 1u)),
+    compaction_(compaction),
+    compactedChanges_(0),
+    droppedRecords_(0)
+{
+}
+
+void HttpChangeFeed::SetScene(Scene *scene)
+{
+    if (scene == scene_)
+        return;
+
+    if (scene_)
+        disconnect(scene_, 0, this, 0);
+
+    scene_ = scene;
+    Truncate();
+
+    if (scene)
+    {
+        connect(scene, SIGNAL(AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeAdded(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeAdded(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentAdded(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentAdded(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentRemoved(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentRemoved(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityCreated(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityCreated(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityRemoved(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityRemoved(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(SceneCleared(Scene*)), this, SLOT(OnSceneCleared()));
+    }
+}
+
+void HttpChangeFeed::SetMaxRecords(uint maxRecords)
+{
+    maxRecords_ = std::max(maxRecords, 1u);
+    while(records_.size() > maxRecords_)
+    {
+        RecordMap::iterator oldest = records_.begin();
+        if (latest_.value(oldest->second.key) == oldest->first)
+            latest_.remove(oldest->second.key);
+        truncated_ = oldest->first;
+        records_.erase(oldest);
+        ++droppedRecords_;
+    }
+}
+
+void HttpChangeFeed::Truncate()
+{
+    records_.clear();
+    latest_.clear();
+    truncated_ = sequence_;
+}
+
+void HttpChangeFeed::AddChange(ChangeEvent event, Entity *entity, IComponent *comp, IAttribute *attribute)
+{
+    if (!entity)
+        return;
+
+    Record record;
+    record.event = event;
+    record.entity = entity->Id();
+    record.key = QByteArray::number(record.entity);
+    if (comp)
+    {
+        record.componentType = comp->TypeName();
+        record.componentName = comp->Name();
+        record.component = comp->shared_from_this();
+        record.key += '/' + record.componentType.toUtf8() + '/' + record.componentName.toUtf8();
+    }
+    if (attribute)
+    {
+        record.attributeId = attribute->Id();
+        record.attributeName = attribute->Name();
+        record.key += '/' + record.attributeId.toUtf8();
+    }
+
+    QHash<QByteArray, u64>::iterator previous = latest_.find(record.key);
+    if (compaction_ == RingCompaction && previous != latest_.end())
+    {
+        RecordMap::iterator replaced = records_.find(previous.value());
+        if (replaced != records_.end())
+        {
+            // A value change after an addition is still an addition for whoever has not seen the addition
+            if (event == AttributeChangedEvent && replaced->second.event == AttributeAddedEvent)
+                record.event = AttributeAddedEvent;
+            records_.erase(replaced);
+            ++compactedChanges_;
+        }
+    }
+
+    records_[++sequence_] = record;
+    latest_[record.key] = sequence_;
+    SetMaxRecords(maxRecords_);
+}
+
+bool HttpChangeFeed::AttributeValue(const Record &record, QString &value)
+{
+    ComponentPtr comp = record.component.lock();
+    IAttribute *attribute = comp ? comp->AttributeById(record.attributeId) : 0;
+    if (!attribute)
+        return false;
+    value = attribute->ToString();
+    return true;
+}
+
+bool HttpChangeFeed::Matches(const HttpChangeFilter &filter, const Record &record)
+{
+    if (filter.IsEmpty() || filter.entities.contains(record.entity))
+        return true;
+    if (!record.componentType.isEmpty() && filter.componentTypes.contains(record.componentType))
+        return true;
+    if (!record.attributeId.isEmpty() && (filter.attributes.contains(record.attributeId) || filter.attributes.contains(record.attributeName)))
+        return true;
+    return false;
+}
+
+void HttpChangeFeed::Compact(u64 since, const HttpChangeFilter *filter, std::vector<Change> &changes) const
+{
+    PROFILE(HttpChangeFeed_Compact);
+
+    // First pass: the latest change of each item, whether the item was added in the range,
+    // and the removals that make the earlier changes of their entities and components moot
+    const RecordMap::const_iterator first = records_.upper_bound(since);
+    QHash<QByteArray, u64> latestInRange;
+    QHash<QByteArray, u64> removals;
+    QHash<QByteArray, bool> added;
+    for(RecordMap::const_iterator i = first; i != records_.end(); ++i)
+    {
+        const Record &record = i->second;
+        latestInRange[record.key] = i->first;
+        if (record.event == AttributeAddedEvent)
+            added[record.key] = true;
+        else if (record.event == EntityRemovedEvent || record.event == ComponentRemovedEvent)
+            removals[record.key] = i->first;
+    }
+
+    for(RecordMap::const_iterator i = first; i != records_.end(); ++i)
+    {
+        const Record &record = i->second;
+        if (latestInRange.value(record.key) != i->first || (filter && !Matches(*filter, record)))
+            continue;
+
+        // Changes inside an entity or component that is removed later in the range are left out
+        const QByteArray entityKey = QByteArray::number(record.entity);
+        if (record.key != entityKey && removals.value(entityKey) > i->first)
+            continue;
+        if (!record.attributeId.isEmpty())
+        {
+            const QByteArray componentKey = record.key.left(record.key.size() - record.attributeId.toUtf8().size() - 1);
+            if (removals.value(componentKey) > i->first)
+                continue;
+        }
+
+        Change change;
+        change.sequence = i->first;
+        change.record = &record;
+        change.event = record.event;
+        change.hasValue = (record.event == AttributeChangedEvent || record.event == AttributeAddedEvent);
+        if (change.hasValue)
+        {
+            if (!AttributeValue(record, change.value))
+                continue; // The component is gone; its removal is written instead
+            if (added.contains(record.key))
+                change.event = AttributeAddedEvent;
+        }
+        changes.push_back(change);
+    }
+}
+
+void HttpChangeFeed::WriteJson(QByteArray &out, const Change &change)
+{
+    const Record &record = *change.record;
+    SceneJsonWriter writer(out);
+    out += "{\"sequence\":" + QByteArray::number(change.sequence) + ",\"event\":\"" + EventNames[change.event] + "\",\"entity\":" + QByteArray::number(record.entity);
+    if (!record.componentType.isEmpty())
+    {
+        out += ",\"component\":";
+        writer.WriteString(record.componentType);
+        out += ",\"componentName\":";
+        writer.WriteString(record.componentName);
+    }
+    if (!record.attributeId.isEmpty())
+    {
+        out += ",\"attribute\":";
+        writer.WriteString(record.attributeId);
+        if (change.hasValue)
+        {
+            out += ",\"value\":";
+            writer.WriteString(change.value);
+        }
+    }
+    out += '}';
+}
+
+QByteArray HttpChangeFeed::Serialize(u64 since, HttpServer::ContentFormat format) const
+{
+    std::vector<Change> changes;
+    Compact(since, 0, changes);
+
+    if (format == HttpServer::JsonFormat)
+    {
+        QByteArray out = "{\"sequence\":" + QByteArray::number(sequence_) + ",\"since\":" + QByteArray::number(since) + ",\"changes\":[";
+        for(size_t i = 0; i < changes.size(); ++i)
+        {
+            if (i > 0)
+                out += ',';
+            WriteJson(out, changes[i]);
+        }
+        out += "]}";
+        return out;
+    }
+
+    QDomDocument doc("Changes");
+    QDomElement root = doc.createElement("changes");
+    root.setAttribute("sequence", QString::number(sequence_));
+    root.setAttribute("since", QString::number(since));
+    doc.appendChild(root);
+    for(size_t i = 0; i < changes.size(); ++i)
+    {
+        const Record &record = *changes[i].record;
+        QDomElement change = doc.createElement("change");
+        change.setAttribute("sequence", QString::number(changes[i].sequence));
+        change.setAttribute("event", EventNames[changes[i].event]);
+        change.setAttribute("entity", QString::number(record.entity));
+        if (!record.componentType.isEmpty())
+        {
+            change.setAttribute("component", record.componentType);
+            change.setAttribute("componentName", record.componentName);
+        }
+        if (!record.attributeId.isEmpty())
+        {
+            change.setAttribute("attribute", record.attributeId);
+            if (changes[i].hasValue)
+                change.setAttribute("value", changes[i].value);
+        }
+        root.appendChild(change);
+    }
+    return doc.toByteArray();
+}
+
+QByteArray HttpChangeFeed::SerializeEvents(u64 since, const HttpChangeFilter &filter, uint maxBytes, u64 &lastSequence, uint &numEvents) const
+{
+    std::vector<Change> changes;
+    Compact(since, &filter, changes);
+
+    QByteArray out;
+    numEvents = 0;
+    lastSequence = sequence_;
+    for(size_t i = 0; i < changes.size(); ++i)
+    {
+        QByteArray event = "id: " + QByteArray::number(changes[i].sequence) + "\nevent: " + EventNames[changes[i].event] + "\ndata: ";
+        WriteJson(event, changes[i]);
+        event += "\n\n";
+        // The rest is sent in the next reply, starting from the last event sent
+        if (numEvents > 0 && (uint)(out.size() + event.size()) > maxBytes)
+        {
+            lastSequence = changes[i - 1].sequence;
+            return out;
+        }
+        out += event;
+        ++numEvents;
+    }
+
+    // Move the client past the changes that did not match its filters
+    if (changes.empty() || changes.back().sequence != sequence_)
+        out += "id: " + QByteArray::number(sequence_) + "\n\n";
+    return out;
+}
+
+void HttpChangeFeed::OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeChangedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpChangeFeed::OnAttributeAdded(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeAddedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpChangeFeed::OnAttributeRemoved(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeRemovedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpChangeFeed::OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    AddChange(ComponentAddedEvent, entity, comp, 0);
+}
+
+void HttpChangeFeed::OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    AddChange(ComponentRemovedEvent, entity, comp, 0);
+}
+
+void HttpChangeFeed::OnEntityCreated(Entity *entity, AttributeChange::Type /*change*/)
+{
+    AddChange(EntityCreatedEvent, entity, 0, 0);
+}
+
+void HttpChangeFeed::OnEntityRemoved(Entity *entity, AttributeChange::Type /*change*/)
+{
+    AddChange(EntityRemovedEvent, entity, 0, 0);
+}
+
+void HttpChangeFeed::OnSceneCleared()
+{
+    Truncate();
+}
@@ -0,0 +1,159 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QSet>
+
+#include <map>
+#include <vector>
+
+class IAttribute;
+
+/// Entities, component types and attribute ids or names whose changes are of interest. An empty filter matches every change.
+struct HTTP_SERVER_MODULE_API HttpChangeFilter
+{
+    QSet<entity_id_t> entities;
+    QSet<QString> componentTypes;
+    QSet<QString> attributes;
+
+    bool IsEmpty() const { return entities.isEmpty() && componentTypes.isEmpty() && attributes.isEmpty(); }
+};
+
+/// Bounded log of scene changes for GET /scene/changes?since=N.
+/** Every entity, component and attribute addition, change and removal of the tracked scene gets a record
+    with the next sequence number. The log keeps at most a given number of records; when it is full the
+    oldest are dropped, and clients asking for changes since a dropped sequence are told to reload the
+    scene. Attribute values are not stored but read when the changes are written, so the memory used
+    depends only on the number of records.
+
+    With ring compaction, a new change of an entity, component or attribute replaces its previous record
+    instead of adding another, so frequently changing attributes do not push other changes out of the
+    log. Either way, the changes written for a request are compacted: each item appears once, with its
+    latest change, and the changes of entities and components removed later are left out.
+
+    The changes can also be written as Server-Sent Events for text/event-stream clients, with the sequence
+    numbers as event ids. */
+class HTTP_SERVER_MODULE_API HttpChangeFeed : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Compaction
+    {
+        /// Every change has its own record
+        NoCompaction,
+        /// A change replaces the previous record of the same item
+        RingCompaction
+    };
+
+    /// @param maxRecords Maximum number of change records kept.
+    HttpChangeFeed(uint maxRecords, Compaction compaction);
+
+    /// Starts tracking the given scene if it is not already tracked. Changes of a previously tracked scene are dropped.
+    void SetScene(Scene *scene);
+
+    /// Sets the maximum number of records, dropping the oldest ones if there are more.
+    void SetMaxRecords(uint maxRecords);
+    void SetCompaction(Compaction compaction) { compaction_ = compaction; }
+
+    /// Sequence number of the latest change, 0 if there have been none.
+    u64 Sequence() const { return sequence_; }
+    /// Returns whether the changes after the given sequence number are all still in the log.
+    bool IsAvailable(u64 since) const { return since >= truncated_ && since <= sequence_; }
+    /// Returns whether there are changes after the given sequence number.
+    bool HasChangesSince(u64 since) const { return since < sequence_; }
+
+    /// Writes the compacted changes after the given sequence number. The log must cover them; see IsAvailable().
+    QByteArray Serialize(u64 since, HttpServer::ContentFormat format) const;
+    /// Writes the compacted changes after the given sequence number that match the filter as Server-Sent Events.
+    /** Events are written until the next one would exceed maxBytes, but at least one. lastSequence is set
+        to the sequence number the client has reached, which is the latest one if all events fit. */
+    QByteArray SerializeEvents(u64 since, const HttpChangeFilter &filter, uint maxBytes, u64 &lastSequence, uint &numEvents) const;
+
+    uint NumRecords() const { return (uint)records_.size(); }
+    /// Changes that replaced an earlier record of the same item
+    uint CompactedChanges() const { return compactedChanges_; }
+    /// Records dropped because the log was full
+    uint DroppedRecords() const { return droppedRecords_; }
+
+private slots:
+    void OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnAttributeAdded(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnAttributeRemoved(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnEntityCreated(Entity *entity, AttributeChange::Type change);
+    void OnEntityRemoved(Entity *entity, AttributeChange::Type change);
+    void OnSceneCleared();
+
+private:
+    enum ChangeEvent
+    {
+        AttributeChangedEvent,
+        AttributeAddedEvent,
+        AttributeRemovedEvent,
+        ComponentAddedEvent,
+        ComponentRemovedEvent,
+        EntityCreatedEvent,
+        EntityRemovedEvent
+    };
+
+    struct Record
+    {
+        ChangeEvent event;
+        entity_id_t entity;
+        QString componentType;
+        QString componentName;
+        QString attributeId;
+        QString attributeName;
+        ComponentWeakPtr component;
+        /// Identifies the changed item, for compaction
+        QByteArray key;
+    };
+
+    typedef std::map<u64, Record> RecordMap;
+
+    /// Change to write, with the event and attribute value it is written with
+    struct Change
+    {
+        u64 sequence;
+        const Record *record;
+        ChangeEvent event;
+        bool hasValue;
+        QString value;
+    };
+
+    void AddChange(ChangeEvent event, Entity *entity, IComponent *comp, IAttribute *attribute);
+    /// Drops all records; clients must reload the scene.
+    void Truncate();
+    /// Collects the compacted changes after the given sequence number, in order.
+    void Compact(u64 since, const HttpChangeFilter *filter, std::vector<Change> &changes) const;
+    static bool Matches(const HttpChangeFilter &filter, const Record &record);
+    static void WriteJson(QByteArray &out, const Change &change);
+    /// Reads the current value of the attribute of a record. Returns false if the attribute is gone.
+    static bool AttributeValue(const Record &record, QString &value);
+
+    QPointer<Scene> scene_;
+    /// Records by sequence number
+    RecordMap records_;
+    /// Sequence number of the latest record of each item
+    QHash<QByteArray, u64> latest_;
+    u64 sequence_;
+    /// Latest sequence number whose changes are no longer known
+    u64 truncated_;
+    uint maxRecords_;
+    Compaction compaction_;
+
+    uint compactedChanges_;
+    uint droppedRecords_;
+};
@@ -0,0 +1,135 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpCompression.h"
+
+#include "CoreTypes.h"
+
+#include <QString>
+#include <QStringList>
+
+namespace
+{
+
+/// CRC-32 lookup table, built when the module is loaded so that compression threads only read it
+struct Crc32Table
+{
+    Crc32Table()
+    {
+        for(u32 i = 0; i < 256; ++i)
+        {
+            u32 c = i;
+            for(int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+
+    u32 entries[256];
+};
+
+const Crc32Table crcTable;
+
+u32 Crc32(const QByteArray &data)
+{
+    u32 crc = 0xffffffffu;
+    const uchar *bytes = reinterpret_cast<const uchar*>(data.constData());
+    for(int i = 0; i < data.size(); ++i)
+        crc = crcTable.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+void AppendLittleEndian(QByteArray &out, u32 value)
+{
+    out += (char)(value & 0xff);
+    out += (char)((value >> 8) & 0xff);
+    out += (char)((value >> 16) & 0xff);
+    out += (char)((value >> 24) & 0xff);
+}
+
+}
+
+namespace HttpCompression
+{
+
+Encoding Negotiate(const std::string &acceptEncoding)
+{
+    if (acceptEncoding.empty())
+        return Identity;
+
+    // Each coding is 1 if listed as acceptable, -1 if listed with q=0 and 0 if not listed. A coding listed by name
+    // overrides *, so "gzip;q=0, *" still refuses gzip.
+    int gzip = 0, deflate = 0, any = 0;
+    const QStringList codings = QString::fromStdString(acceptEncoding).split(',', QString::SkipEmptyParts);
+    for(int i = 0; i < codings.size(); ++i)
+    {
+        const QStringList parts = codings[i].split(';');
+        const QString coding = parts[0].trimmed().toLower();
+
+        // A coding with q=0 is explicitly not acceptable
+        int acceptable = 1;
+        for(int j = 1; j < parts.size(); ++j)
+        {
+            const QString param = parts[j].trimmed();
+            if (param.startsWith("q=") && param.mid(2).toFloat() <= 0.f)
+                acceptable = -1;
+        }
+
+        if (coding == "gzip" || coding == "x-gzip")
+            gzip = (gzip < 0 ? -1 : acceptable);
+        else if (coding == "deflate")
+            deflate = (deflate < 0 ? -1 : acceptable);
+        else if (coding == "*")
+            any = (any < 0 ? -1 : acceptable);
+    }
+    if (gzip > 0 || (gzip == 0 && any > 0))
+        return Gzip;
+    if (deflate > 0 || (deflate == 0 && any > 0))
+        return Deflate;
+    return Identity;
+}
+
+const char *EncodingName(Encoding encoding)
+{
+    switch(encoding)
+    {
+    case Gzip: return "gzip";
+    case Deflate: return "deflate";
+    default: return "identity";
+    }
+}
+
+QByteArray EncodedETag(const QByteArray &etag, Encoding encoding)
+{
+    if (encoding == Identity || etag.isEmpty())
+        return etag;
+    QByteArray encoded = etag;
+    const int suffixPos = encoded.endsWith('"') ? encoded.size() - 1 : encoded.size();
+    encoded.insert(suffixPos, QByteArray("-") + EncodingName(encoding));
+    return encoded;
+}
+
+QByteArray Compress(const QByteArray &data, Encoding encoding)
+{
+    if (encoding == Identity)
+        return data;
+
+    // qCompress output is a 4-byte big-endian length followed by a zlib stream, which is what HTTP calls deflate
+    const QByteArray zlib = qCompress(data, 6);
+    // On failure, a null array tells the caller to send the data uncompressed
+    if (zlib.size() < 4 + 2 + 4)
+        return QByteArray();
+    if (encoding == Deflate)
+        return zlib.mid(4);
+
+    // Gzip wraps the raw deflate data, without the zlib header and Adler-32 trailer, in its own header and trailer
+    QByteArray gzip;
+    gzip.reserve(zlib.size() + 18);
+    static const char header[] = { '\x1f', '\x8b', '\x08', 0, 0, 0, 0, 0, 0, '\xff' };
+    gzip.append(header, sizeof(header));
+    gzip.append(zlib.constData() + 6, zlib.size() - 6 - 4);
+    AppendLittleEndian(gzip, Crc32(data));
+    AppendLittleEndian(gzip, (u32)data.size());
+    return gzip;
+}
+
+}
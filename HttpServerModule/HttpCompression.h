@@ -0,0 +1,34 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+
+#include <QByteArray>
+
+#include <string>
+
+/// HTTP content coding of reply bodies, using the zlib compression built into Qt.
+namespace HttpCompression
+{
+    enum Encoding
+    {
+        Identity,
+        Gzip,
+        Deflate
+    };
+
+    /// Picks the encoding to use from the value of an Accept-Encoding request header. Gzip is preferred over deflate.
+    HTTP_SERVER_MODULE_API Encoding Negotiate(const std::string &acceptEncoding);
+
+    /// Returns the Content-Encoding header value of an encoding.
+    HTTP_SERVER_MODULE_API const char *EncodingName(Encoding encoding);
+
+    /// Returns the ETag of a representation sent with the given encoding: the quoted identity ETag with "-gzip" or
+    /// "-deflate" appended inside the quotes, so that caches tell the encoded bytes from the identity ones.
+    HTTP_SERVER_MODULE_API QByteArray EncodedETag(const QByteArray &etag, Encoding encoding);
+
+    /// Compresses data with the given encoding: a gzip member for Gzip, a zlib stream for Deflate.
+    /** Returns a null byte array if the data could not be compressed; the data should then be sent as is. */
+    HTTP_SERVER_MODULE_API QByteArray Compress(const QByteArray &data, Encoding encoding);
+}
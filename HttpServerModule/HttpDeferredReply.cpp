@@ -0,0 +1,101 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpDeferredReply.h"
+
+HttpDeferredReply::HttpDeferredReply(HttpServer *server, HttpServer::ConnectionPtr connection, float timeoutSeconds) :
+    QObject(server),
+    server_(server),
+    connection_(connection),
+    timeoutTicks_((kNet::tick_t)(timeoutSeconds * kNet::Clock::TicksPerSec())),
+    completed_(false),
+    timedOut_(false)
+{
+    deadline_ = kNet::Clock::Tick() + timeoutTicks_;
+}
+
+QString HttpDeferredReply::Path() const
+{
+    return QString::fromUtf8(connection_->get_resource().c_str());
+}
+
+QString HttpDeferredReply::Verb() const
+{
+    return QString::fromStdString(connection_->get_request().get_method());
+}
+
+QString HttpDeferredReply::Header(const QString &name) const
+{
+    return QString::fromUtf8(connection_->get_request_header(name.toStdString()).c_str());
+}
+
+QByteArray HttpDeferredReply::Body() const
+{
+    const std::string &body = connection_->get_request_body();
+    return QByteArray(body.data(), (int)body.size());
+}
+
+void HttpDeferredReply::SetHeader(const QString &name, const QString &value)
+{
+    if (!completed_)
+        connection_->replace_header(name.toStdString(), value.toUtf8().constData());
+}
+
+bool HttpDeferredReply::Reply(const QString &body, const QString &contentType, int status)
+{
+    return ReplyData(body.toUtf8(), contentType, status);
+}
+
+bool HttpDeferredReply::ReplyData(const QByteArray &body, const QString &contentType, int status)
+{
+    if (completed_)
+        return false;
+    server_->SetHttpRequestReply(connection_, body, contentType.toUtf8().constData(), (websocketpp::http::status_code::value)status);
+    Send();
+    return true;
+}
+
+bool HttpDeferredReply::ReplyStatus(int status)
+{
+    if (completed_)
+        return false;
+    server_->SetHttpRequestStatus(connection_, (websocketpp::http::status_code::value)status);
+    Send();
+    return true;
+}
+
+void HttpDeferredReply::Send()
+{
+    completed_ = true;
+    SendResponse();
+    emit Completed();
+    deleteLater();
+}
+
+void HttpDeferredReply::SendResponse()
+{
+    // The server records the reply in its request metrics; the client may have gone away meanwhile
+    server_->SendDeferredReply(connection_);
+}
+
+bool HttpDeferredReply::CheckTimeout(kNet::tick_t now)
+{
+    if (timedOut_)
+    {
+        // Kept for another timeout period so that a late reply finds the handle still there
+        if (!kNet::Clock::IsNewer(now, deadline_ + timeoutTicks_))
+            return false;
+        deleteLater();
+        return true;
+    }
+    if (completed_)
+        return true;
+    if (!kNet::Clock::IsNewer(now, deadline_))
+        return false;
+
+    server_->SetHttpRequestReply(connection_, "Gateway Timeout", "text/plain", websocketpp::http::status_code::gateway_timeout);
+    timedOut_ = true;
+    completed_ = true;
+    SendResponse();
+    emit TimedOut();
+    return false;
+}
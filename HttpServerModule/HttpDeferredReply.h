@@ -0,0 +1,68 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+
+#include "kNet/Clock.h"
+
+/// Handle to a request whose reply is sent later, possibly several frames after the request was received.
+/** Created with HttpServer::DeferReply(), or given to scripts by deferred script routes. The handler keeps
+    the handle and completes the request with one of the Reply functions from any later frame in the main
+    thread. A request that is not completed within its timeout is answered with 504 Gateway Timeout and
+    TimedOut is emitted; replying after that has no effect. A completed handle deletes itself, and a timed
+    out one is deleted once the timeout has passed a second time, so handlers must not keep it longer. */
+class HTTP_SERVER_MODULE_API HttpDeferredReply : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// The reply must already have been deferred with defer_http_response().
+    HttpDeferredReply(HttpServer *server, HttpServer::ConnectionPtr connection, float timeoutSeconds);
+
+    HttpServer::ConnectionPtr Connection() const { return connection_; }
+
+    /// Replies 504 Gateway Timeout if the timeout has passed. Returns whether the handle can be forgotten.
+    bool CheckTimeout(kNet::tick_t now);
+
+public slots:
+    QString Path() const;
+    QString Verb() const;
+    QString Header(const QString &name) const;
+    QByteArray Body() const;
+
+    void SetHeader(const QString &name, const QString &value);
+
+    /// Sends a text reply encoded as UTF-8. Returns false if the request has already been completed or has timed out.
+    bool Reply(const QString &body, const QString &contentType, int status = 200);
+    /// Sends a binary reply.
+    bool ReplyData(const QByteArray &body, const QString &contentType, int status = 200);
+    /// Sends a reply without a body.
+    bool ReplyStatus(int status);
+
+    bool IsCompleted() const { return completed_; }
+    bool IsTimedOut() const { return timedOut_; }
+
+signals:
+    /// The reply has been sent.
+    void Completed();
+    /// The request was not completed in time and has been answered with 504 Gateway Timeout.
+    void TimedOut();
+
+private:
+    /// Sends the reply, marks the request completed and deletes the handle.
+    void Send();
+    void SendResponse();
+
+    HttpServer *server_;
+    HttpServer::ConnectionPtr connection_;
+    kNet::tick_t deadline_;
+    kNet::tick_t timeoutTicks_;
+    bool completed_;
+    bool timedOut_;
+};
@@ -0,0 +1,133 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpEntityIdBlocks.h"
+
+#include "Scene.h"
+
+#include <QUuid>
+
+#include <iterator>
+
+namespace
+{
+
+/// Replicated ids end below the unacked ids that clients give to the entities they create before the server answers
+const entity_id_t cReplicatedTop = 0x3fffffff;
+const entity_id_t cReplicatedBottom = 1;
+const entity_id_t cLocalTop = 0xffffffff;
+const entity_id_t cLocalBottom = 0x80000000;
+
+/// Seconds after which an unused block is released
+const double cExpirySeconds = 600.0;
+/// Ranges looked at before giving up, when entities are found in them
+const int cMaxAttempts = 16;
+
+}
+
+entity_id_t HttpEntityIdBlock::Take(Scene *scene)
+{
+    used = kNet::Clock::Tick();
+    while(remaining > 0)
+    {
+        const entity_id_t id = next++;
+        --remaining;
+        if (!scene->HasEntity(id))
+            return id;
+    }
+    return 0;
+}
+
+uint HttpEntityIdBlock::Available(Scene *scene) const
+{
+    if (remaining == 0)
+        return 0;
+    const Scene::EntityMap &entities = scene->Entities();
+    const uint taken = (uint)std::distance(entities.lower_bound(next), entities.upper_bound(next + remaining - 1));
+    return remaining - taken;
+}
+
+HttpEntityIdBlocks::HttpEntityIdBlocks() :
+    replicatedTop_(cReplicatedTop),
+    localTop_(cLocalTop)
+{
+}
+
+const HttpEntityIdBlock *HttpEntityIdBlocks::Reserve(Scene *scene, uint count, bool local)
+{
+    Prepare(scene);
+    if (count == 0 || count > cMaxBlockSize)
+        return 0;
+
+    entity_id_t &top = local ? localTop_ : replicatedTop_;
+    const entity_id_t bottom = local ? cLocalBottom : cReplicatedBottom;
+    const Scene::EntityMap &entities = scene->Entities();
+    for(int attempt = 0; attempt < cMaxAttempts && top >= bottom && top - bottom + 1 >= count; ++attempt)
+    {
+        // An entity already in the range, such as one created with an explicit id, moves the block below it.
+        // The highest entity id at or below the top is found in the ordered entity map.
+        const entity_id_t first = top - count + 1;
+        Scene::EntityMap::const_iterator highest = entities.upper_bound(top);
+        if (highest != entities.begin() && (--highest)->first >= first)
+        {
+            top = highest->first - 1;
+            continue;
+        }
+
+        // A random UUID, without braces and dashes
+        const QString token = QUuid::createUuid().toString().remove('{').remove('}').remove('-');
+        HttpEntityIdBlock &block = blocks_[token];
+        block.token = token;
+        block.local = local;
+        block.first = first;
+        block.last = top;
+        block.next = first;
+        block.remaining = count;
+        block.used = kNet::Clock::Tick();
+        top = first - 1;
+        return &block;
+    }
+    return 0;
+}
+
+HttpEntityIdBlock *HttpEntityIdBlocks::Find(Scene *scene, const QString &token)
+{
+    Prepare(scene);
+    std::map<QString, HttpEntityIdBlock>::iterator i = blocks_.find(token);
+    if (i == blocks_.end())
+        return 0;
+    i->second.used = kNet::Clock::Tick();
+    return &i->second;
+}
+
+bool HttpEntityIdBlocks::Release(Scene *scene, const QString &token)
+{
+    Prepare(scene);
+    return blocks_.erase(token) > 0;
+}
+
+void HttpEntityIdBlocks::Clear()
+{
+    blocks_.clear();
+    scene_.reset();
+    replicatedTop_ = cReplicatedTop;
+    localTop_ = cLocalTop;
+}
+
+void HttpEntityIdBlocks::Prepare(Scene *scene)
+{
+    if (scene_.lock().get() != scene)
+    {
+        Clear();
+        if (scene)
+            scene_ = scene->shared_from_this();
+    }
+
+    const kNet::tick_t now = kNet::Clock::Tick();
+    for(std::map<QString, HttpEntityIdBlock>::iterator i = blocks_.begin(); i != blocks_.end();)
+    {
+        if (kNet::Clock::TimespanToSecondsD(i->second.used, now) > cExpirySeconds)
+            blocks_.erase(i++);
+        else
+            ++i;
+    }
+}
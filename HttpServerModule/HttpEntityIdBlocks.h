@@ -0,0 +1,72 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+#include "SceneFwd.h"
+
+#include "kNet/Clock.h"
+
+#include <QString>
+
+#include <map>
+
+/// Contiguous range of entity ids reserved for a client.
+struct HTTP_SERVER_MODULE_API HttpEntityIdBlock
+{
+    /// Unguessable token that names the block; only the client that reserved it knows it
+    QString token;
+    bool local;
+    entity_id_t first;
+    entity_id_t last;
+    /// Next id to hand out, and the number of ids from it to the end of the block
+    entity_id_t next;
+    uint remaining;
+    /// Tick when the block was last used
+    kNet::tick_t used;
+
+    /// Takes the next id that has no entity in the scene, or returns 0 when the block is used up.
+    /** Ids taken meanwhile by entities created with an explicit id are skipped. */
+    entity_id_t Take(Scene *scene);
+    /// Returns the number of ids that Take() can still hand out, that is the remaining ids that have no entity.
+    uint Available(Scene *scene) const;
+};
+
+/// Entity id blocks reserved for clients that create many entities over the SceneAPI REST interface.
+/** Blocks are reserved from the top of the replicated id range, below the unacked ids at 0x40000000, and from
+    the top of the local id range, counting down. The scene hands out ids counting up from the bottom of the
+    ranges, so the ids of entities created from blocks do not interleave with those created in the world.
+    Reserving a block looks up the highest entity below the top of the range in the scene's ordered entity map;
+    after that, taking an id is a single HasEntity lookup instead of the scene's search for a free id. Blocks are
+    named by random tokens rather than sequential numbers, so that a client can only use the blocks it reserved. Blocks that go unused for ten minutes are
+    released, and their remaining ids are not handed out again. All blocks are forgotten when the active
+    scene changes. Main thread only. */
+class HTTP_SERVER_MODULE_API HttpEntityIdBlocks
+{
+public:
+    HttpEntityIdBlocks();
+
+    /// Reserves a block of count ids in the scene. Returns null if no free range of that size is found.
+    const HttpEntityIdBlock *Reserve(Scene *scene, uint count, bool local);
+    /// Returns a block of the scene by its token and marks it used, or null if there is no such block.
+    HttpEntityIdBlock *Find(Scene *scene, const QString &token);
+    /// Releases a block. Returns false if there is no such block.
+    bool Release(Scene *scene, const QString &token);
+    void Clear();
+
+    uint NumBlocks() const { return (uint)blocks_.size(); }
+
+    /// Largest block that can be reserved.
+    static const uint cMaxBlockSize = 1000000;
+
+private:
+    /// Forgets the blocks of another scene and those that have expired.
+    void Prepare(Scene *scene);
+
+    SceneWeakPtr scene_;
+    std::map<QString, HttpEntityIdBlock> blocks_;
+    /// Highest ids not reserved yet
+    entity_id_t replicatedTop_;
+    entity_id_t localTop_;
+};
@@ -0,0 +1,280 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpEntityIndex.h"
+#include "HttpSceneDeserializer.h"
+
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+
+#include <algorithm>
+
+HttpEntityIndex::HttpEntityIndex(uint maxAttributeIndexes) :
+    maxAttributeIndexes_(maxAttributeIndexes),
+    lookups_(0),
+    indexHits_(0),
+    indexMisses_(0)
+{
+}
+
+void HttpEntityIndex::SetScene(Scene *scene)
+{
+    if (scene == scene_)
+        return;
+
+    if (scene_)
+        disconnect(scene_, 0, this, 0);
+
+    scene_ = scene;
+    Rebuild();
+
+    if (scene)
+    {
+        connect(scene, SIGNAL(AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentAdded(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentAdded(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentRemoved(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentRemoved(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityRemoved(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityRemoved(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(SceneCleared(Scene*)), this, SLOT(OnSceneCleared()));
+    }
+}
+
+void HttpEntityIndex::Rebuild()
+{
+    // Attribute indexes are kept, but emptied and refilled from the new scene
+    byType_.clear();
+    for(QHash<QString, AttributeIndex>::iterator i = attributeIndexes_.begin(); i != attributeIndexes_.end(); ++i)
+    {
+        i->byValue.clear();
+        i->values.clear();
+    }
+    if (!scene_)
+        return;
+
+    PROFILE(HttpEntityIndex_Rebuild);
+    const Scene::EntityMap &entities = scene_->Entities();
+    for(Scene::EntityMap::const_iterator i = entities.begin(); i != entities.end(); ++i)
+    {
+        const Entity::ComponentMap &components = i->second->Components();
+        for(Entity::ComponentMap::const_iterator j = components.begin(); j != components.end(); ++j)
+            AddComponent(i->first, j->second.get());
+    }
+}
+
+void HttpEntityIndex::AddComponent(entity_id_t entityId, IComponent *comp)
+{
+    const QString typeName = comp->TypeName();
+    byType_[typeName].insert(comp, entityId);
+
+    QHash<QString, QStringList>::const_iterator i = indexesOfType_.find(typeName);
+    if (i == indexesOfType_.end())
+        return;
+    for(int j = 0; j < i->size(); ++j)
+        IndexValue(attributeIndexes_[i->at(j)], entityId, comp);
+}
+
+void HttpEntityIndex::RemoveComponent(IComponent *comp)
+{
+    const QString typeName = comp->TypeName();
+    QHash<QString, ComponentSet>::iterator t = byType_.find(typeName);
+    if (t != byType_.end())
+    {
+        t->remove(comp);
+        if (t->isEmpty())
+            byType_.erase(t);
+    }
+
+    QHash<QString, QStringList>::const_iterator i = indexesOfType_.find(typeName);
+    if (i == indexesOfType_.end())
+        return;
+    for(int j = 0; j < i->size(); ++j)
+        UnindexValue(attributeIndexes_[i->at(j)], comp);
+}
+
+IAttribute *HttpEntityIndex::AttributeOf(IComponent *comp, const QString &attribute)
+{
+    return HttpSceneDeserializer::FindAttribute(comp, attribute);
+}
+
+void HttpEntityIndex::IndexValue(AttributeIndex &index, entity_id_t entityId, IComponent *comp)
+{
+    UnindexValue(index, comp);
+    IAttribute *attr = AttributeOf(comp, index.attribute);
+    if (!attr)
+        return;
+    const QString value = attr->ToString();
+    index.byValue[value].insert(comp, entityId);
+    index.values.insert(comp, value);
+}
+
+void HttpEntityIndex::UnindexValue(AttributeIndex &index, IComponent *comp)
+{
+    QHash<IComponent*, QString>::iterator i = index.values.find(comp);
+    if (i == index.values.end())
+        return;
+    QHash<QString, ComponentSet>::iterator v = index.byValue.find(i.value());
+    if (v != index.byValue.end())
+    {
+        v->remove(comp);
+        if (v->isEmpty())
+            index.byValue.erase(v);
+    }
+    index.values.erase(i);
+}
+
+void HttpEntityIndex::AddAttributeIndex(const QString &componentType, const QString &attribute)
+{
+    const QString key = IndexKey(componentType, attribute);
+    if (attributeIndexes_.contains(key))
+        return;
+
+    PROFILE(HttpEntityIndex_AddAttributeIndex);
+    AttributeIndex &index = attributeIndexes_[key];
+    index.componentType = componentType;
+    index.attribute = attribute;
+    indexesOfType_[componentType].push_back(key);
+
+    const ComponentSet components = byType_.value(componentType);
+    for(ComponentSet::const_iterator i = components.begin(); i != components.end(); ++i)
+        IndexValue(index, i.value(), i.key());
+}
+
+bool HttpEntityIndex::EnsureAttributeIndex(const QString &componentType, const QString &attribute)
+{
+    if (attributeIndexes_.contains(IndexKey(componentType, attribute)))
+        return true;
+    if ((uint)attributeIndexes_.size() >= maxAttributeIndexes_)
+        return false;
+    AddAttributeIndex(componentType, attribute);
+    return true;
+}
+
+std::vector<entity_id_t> HttpEntityIndex::Find(const QString &componentType, const AttributeFilter &attributes)
+{
+    PROFILE(HttpEntityIndex_Find);
+    ++lookups_;
+
+    std::vector<entity_id_t> ids;
+    if (!scene_)
+        return ids;
+
+    // Create the missing indexes first, so that no index is added while candidate sets are being referred to
+    std::vector<AttributeIndex*> indexes(attributes.size(), (AttributeIndex*)0);
+    for(int i = 0; i < attributes.size(); ++i)
+        EnsureAttributeIndex(componentType, attributes[i].first);
+    for(int i = 0; i < attributes.size(); ++i)
+    {
+        QHash<QString, AttributeIndex>::iterator index = attributeIndexes_.find(IndexKey(componentType, attributes[i].first));
+        if (index != attributeIndexes_.end())
+            indexes[i] = &index.value();
+    }
+
+    // Start from the smallest candidate set: the components of the type, or those having one of the filtered values
+    static const ComponentSet noComponents;
+    QHash<QString, ComponentSet>::const_iterator t = byType_.find(componentType);
+    const ComponentSet *candidates = (t != byType_.end() ? &t.value() : &noComponents);
+    for(int i = 0; i < attributes.size(); ++i)
+    {
+        AttributeIndex *index = indexes[i];
+        if (!index)
+        {
+            ++indexMisses_;
+            continue;
+        }
+        ++indexHits_;
+        QHash<QString, ComponentSet>::const_iterator v = index->byValue.find(attributes[i].second);
+        const ComponentSet *matching = (v != index->byValue.end() ? &v.value() : &noComponents);
+        if (matching->size() < candidates->size())
+            candidates = matching;
+    }
+
+    // Verify every candidate against the scene, as changes made without signaling are not indexed
+    for(ComponentSet::const_iterator i = candidates->begin(); i != candidates->end(); ++i)
+    {
+        EntityPtr entity = scene_->EntityById(i.value());
+        if (!entity)
+            continue;
+        Entity::ComponentVector comps = entity->ComponentsOfType(componentType);
+        for(size_t j = 0; j < comps.size(); ++j)
+        {
+            if (comps[j].get() != i.key())
+                continue;
+            bool match = true;
+            for(int k = 0; k < attributes.size() && match; ++k)
+            {
+                IAttribute *attr = AttributeOf(comps[j].get(), attributes[k].first);
+                match = attr && attr->ToString() == attributes[k].second;
+            }
+            if (match)
+                ids.push_back(i.value());
+            break;
+        }
+    }
+
+    // An entity may have several matching components of the type
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+size_t HttpEntityIndex::MemoryUsage() const
+{
+    // Rough estimate: a hash node is the key and value plus about two pointers of overhead
+    const size_t nodeOverhead = 2 * sizeof(void*);
+    size_t bytes = 0;
+    for(QHash<QString, ComponentSet>::const_iterator i = byType_.begin(); i != byType_.end(); ++i)
+        bytes += i.key().size() * sizeof(QChar) + i->size() * (sizeof(IComponent*) + sizeof(entity_id_t) + nodeOverhead);
+    for(QHash<QString, AttributeIndex>::const_iterator i = attributeIndexes_.begin(); i != attributeIndexes_.end(); ++i)
+    {
+        for(QHash<QString, ComponentSet>::const_iterator v = i->byValue.begin(); v != i->byValue.end(); ++v)
+            bytes += v.key().size() * sizeof(QChar) + v->size() * (sizeof(IComponent*) + sizeof(entity_id_t) + nodeOverhead);
+        // The value strings of the reverse map are shared with the keys above
+        bytes += i->values.size() * (sizeof(IComponent*) + sizeof(QString) + nodeOverhead);
+    }
+    return bytes;
+}
+
+void HttpEntityIndex::OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    QHash<QString, QStringList>::const_iterator i = indexesOfType_.find(comp->TypeName());
+    if (i == indexesOfType_.end() || !comp->ParentEntity())
+        return;
+    for(int j = 0; j < i->size(); ++j)
+    {
+        AttributeIndex &index = attributeIndexes_[i->at(j)];
+        if (attribute->Id() == index.attribute || attribute->Name() == index.attribute)
+            IndexValue(index, comp->ParentEntity()->Id(), comp);
+    }
+}
+
+void HttpEntityIndex::OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    AddComponent(entity->Id(), comp);
+}
+
+void HttpEntityIndex::OnComponentRemoved(Entity * /*entity*/, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    RemoveComponent(comp);
+}
+
+void HttpEntityIndex::OnEntityRemoved(Entity *entity, AttributeChange::Type /*change*/)
+{
+    const Entity::ComponentMap &components = entity->Components();
+    for(Entity::ComponentMap::const_iterator i = components.begin(); i != components.end(); ++i)
+        RemoveComponent(i->second.get());
+}
+
+void HttpEntityIndex::OnSceneCleared()
+{
+    byType_.clear();
+    for(QHash<QString, AttributeIndex>::iterator i = attributeIndexes_.begin(); i != attributeIndexes_.end(); ++i)
+    {
+        i->byValue.clear();
+        i->values.clear();
+    }
+}
@@ -0,0 +1,99 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+#include <vector>
+
+class IAttribute;
+
+/// Hash indexes on component type and attribute value for the filters of GET /entities.
+/** The component type index covers every component of the tracked scene. Attribute value indexes are
+    created for a component type and attribute id or name when a query first filters by them, up to a
+    maximum number, and can also be created up front with AddAttributeIndex(). Filters on attributes that
+    are not indexed are checked one candidate at a time. All indexes are kept up to date from the scene's
+    signals; as changes made with AttributeChange::Disconnected are not signaled, every candidate is
+    verified against the scene before it is returned. */
+class HTTP_SERVER_MODULE_API HttpEntityIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// Attribute id or name and the value it must have in IAttribute::ToString() form
+    typedef QList<QPair<QString, QString> > AttributeFilter;
+
+    /// @param maxAttributeIndexes Maximum number of attribute value indexes created on demand.
+    explicit HttpEntityIndex(uint maxAttributeIndexes);
+
+    /// Starts tracking the given scene if it is not already tracked, indexing all of its components.
+    void SetScene(Scene *scene);
+
+    /// Creates an index on the attribute of the given component type if there is none yet.
+    void AddAttributeIndex(const QString &componentType, const QString &attribute);
+    /// Sets the maximum number of attribute value indexes created on demand.
+    void SetMaxAttributeIndexes(uint maxIndexes) { maxAttributeIndexes_ = maxIndexes; }
+
+    /// Returns the entities that have a component of the given type whose attributes have all of the given values, in id order.
+    std::vector<entity_id_t> Find(const QString &componentType, const AttributeFilter &attributes);
+
+    int NumAttributeIndexes() const { return attributeIndexes_.size(); }
+    /// Estimated memory used by the indexes in bytes.
+    size_t MemoryUsage() const;
+    uint Lookups() const { return lookups_; }
+    /// Attribute filters answered from an index
+    uint IndexHits() const { return indexHits_; }
+    /// Attribute filters that had to be checked candidate by candidate
+    uint IndexMisses() const { return indexMisses_; }
+
+private slots:
+    void OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnEntityRemoved(Entity *entity, AttributeChange::Type change);
+    void OnSceneCleared();
+
+private:
+    /// Components with their entity ids; the ids are used instead of dereferencing the components
+    typedef QHash<IComponent*, entity_id_t> ComponentSet;
+
+    struct AttributeIndex
+    {
+        QString componentType;
+        QString attribute;
+        QHash<QString, ComponentSet> byValue;
+        QHash<IComponent*, QString> values;
+    };
+
+    void Rebuild();
+    void AddComponent(entity_id_t entityId, IComponent *comp);
+    void RemoveComponent(IComponent *comp);
+    void IndexValue(AttributeIndex &index, entity_id_t entityId, IComponent *comp);
+    void UnindexValue(AttributeIndex &index, IComponent *comp);
+    /// Creates the index on demand if the maximum number of indexes allows. Returns whether the index exists.
+    bool EnsureAttributeIndex(const QString &componentType, const QString &attribute);
+    static IAttribute *AttributeOf(IComponent *comp, const QString &attribute);
+    static QString IndexKey(const QString &componentType, const QString &attribute) { return componentType + '.' + attribute; }
+
+    QPointer<Scene> scene_;
+    QHash<QString, ComponentSet> byType_;
+    /// Attribute indexes by "componentType.attribute"
+    QHash<QString, AttributeIndex> attributeIndexes_;
+    /// Attribute indexes of each component type, for the change handlers
+    QHash<QString, QStringList> indexesOfType_;
+    uint maxAttributeIndexes_;
+
+    uint lookups_;
+    uint indexHits_;
+    uint indexMisses_;
+};
@@ -0,0 +1,192 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpEntityStream.h"
+#include "SceneJsonWriter.h"
+
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "LoggingFunctions.h"
+
+#include "kNet/DataSerializer.h"
+#include "kNet/NetException.h"
+
+#include <QDomDocument>
+#include <QDomElement>
+
+namespace
+{
+    /// Space first tried for an entity in the binary format, and the most it may take with its children
+    const size_t cMinEntityBytes = 64 * 1024;
+    const size_t cMaxEntityBytes = 16 * 1024 * 1024;
+}
+
+HttpEntityStream::HttpEntityStream(HttpServer::ConnectionPtr connection, const SceneWeakPtr &scene, const std::vector<entity_id_t> &ids,
+    HttpServer::ContentFormat format, uint childDepth) :
+    connection_(connection),
+    scene_(scene),
+    ids_(ids),
+    next_(0),
+    format_(format),
+    childDepth_(childDepth),
+    first_(true),
+    finished_(false),
+    body_(new std::string()),
+    entitiesWritten_(0)
+{
+    if (format_ == HttpServer::JsonFormat)
+        *body_ += "{\"entities\":[";
+    else if (format_ == HttpServer::BinaryFormat)
+        body_->assign(sizeof(u32), '\0'); // Entity count, filled in when finished
+    else
+        *body_ += "<!DOCTYPE Scene>\n<scene>\n";
+}
+
+const char *HttpEntityStream::ContentType() const
+{
+    switch(format_)
+    {
+    case HttpServer::JsonFormat: return "application/json";
+    case HttpServer::BinaryFormat: return "application/octet-stream";
+    default: return "application/xml";
+    }
+}
+
+bool HttpEntityStream::Process(uint maxEntities)
+{
+    if (finished_)
+        return true;
+
+    ScenePtr scene = scene_.lock();
+    if (scene)
+    {
+        for(uint count = 0; count < maxEntities && next_ < ids_.size(); ++next_)
+        {
+            EntityPtr entity = scene->EntityById(ids_[next_]);
+            if (!entity)
+                continue;
+            WriteEntity(entity.get());
+            ++count;
+        }
+    }
+    else
+        next_ = ids_.size(); // Scene is gone, finish what has been written so far
+
+    if (next_ >= ids_.size())
+    {
+        if (format_ == HttpServer::JsonFormat)
+            *body_ += "]}";
+        else if (format_ == HttpServer::BinaryFormat)
+        {
+            kNet::DataSerializer header(&(*body_)[0], sizeof(u32));
+            header.Add<u32>(entitiesWritten_);
+        }
+        else
+            *body_ += "</scene>\n";
+        finished_ = true;
+    }
+    return finished_;
+}
+
+void HttpEntityStream::WriteEntity(const Entity *entity)
+{
+    // Each entity is serialized on its own and appended to the reply, so the list is never copied whole
+    if (format_ == HttpServer::JsonFormat)
+    {
+        if (!first_)
+            *body_ += ',';
+        QByteArray entityJson;
+        SceneJsonWriter writer(entityJson);
+        if (!fields_.IsEmpty())
+            writer.SetFieldSelection(&fields_);
+        writer.WriteEntityTree(entity, childDepth_);
+        body_->append(entityJson.constData(), entityJson.size());
+    }
+    else if (format_ == HttpServer::BinaryFormat)
+        WriteBinary(entity);
+    else if (!fields_.IsEmpty() || (childDepth_ > 0 && childDepth_ != SceneJsonWriter::cAllChildren))
+    {
+        QDomDocument doc;
+        AppendXmlEntity(doc, doc, entity, childDepth_, fields_.IsEmpty() ? 0 : &fields_);
+        const QByteArray entityXml = doc.toByteArray();
+        body_->append(entityXml.constData(), entityXml.size());
+    }
+    else
+    {
+        // Splice the entity element without the document type declaration of its own document
+        QByteArray entityXml = entity->SerializeToXMLString(true, true, childDepth_ > 0);
+        int start = entityXml.indexOf("<entity");
+        if (start >= 0)
+            body_->append(entityXml.constData() + start, entityXml.size() - start);
+    }
+    first_ = false;
+}
+
+void HttpEntityStream::AppendXmlEntity(QDomDocument &doc, QDomNode &parent, const Entity *entity, uint childDepth, const HttpFieldSelection *fields)
+{
+    QDomElement entityElem = doc.createElement("entity");
+    entityElem.setAttribute("id", QString::number(entity->Id()));
+    entityElem.setAttribute("sync", entity->IsReplicated() ? "true" : "false");
+    if (entity->IsTemporary())
+        entityElem.setAttribute("temporary", "true");
+    parent.appendChild(entityElem);
+
+    const Entity::ComponentMap &components = entity->Components();
+    for(Entity::ComponentMap::const_iterator i = components.begin(); i != components.end(); ++i)
+    {
+        const IComponent *component = i->second.get();
+        if (fields && !fields->SelectsComponent(component->TypeName()))
+            continue;
+        component->SerializeTo(doc, entityElem, true);
+        if (!fields)
+            continue;
+
+        // Drop the attributes that were not asked for from the element just written
+        QDomElement compElem = entityElem.lastChildElement("component");
+        QDomElement attrElem = compElem.firstChildElement("attribute");
+        while(!attrElem.isNull())
+        {
+            QDomElement next = attrElem.nextSiblingElement("attribute");
+            if (!fields->SelectsAttribute(component->TypeName(), attrElem.attribute("id"), attrElem.attribute("name")))
+                compElem.removeChild(attrElem);
+            attrElem = next;
+        }
+    }
+
+    // Children are nested in their parent's element, as in Entity::SerializeToXML()
+    if (childDepth > 0)
+    {
+        for(size_t i = 0; i < entity->NumChildren(); ++i)
+        {
+            EntityPtr child = entity->Child(i);
+            if (child)
+                AppendXmlEntity(doc, entityElem, child.get(), childDepth == SceneJsonWriter::cAllChildren ? childDepth : childDepth - 1, fields);
+        }
+    }
+}
+
+void HttpEntityStream::WriteBinary(const Entity *entity)
+{
+    // The size of an entity is not known before it has been written, so the entity is serialized straight after the
+    // body written so far, into space that grows until it fits, and the unused space is cut off again. Nothing but
+    // the body itself is kept between entities.
+    const size_t start = body_->size();
+    for(size_t size = cMinEntityBytes; size <= cMaxEntityBytes; size *= 4)
+    {
+        body_->resize(start + size);
+        try
+        {
+            kNet::DataSerializer dst(&(*body_)[start], size);
+            entity->SerializeToBinary(dst, true, true, childDepth_ > 0);
+            body_->resize(start + dst.BytesFilled());
+            ++entitiesWritten_;
+            return;
+        }
+        catch(const kNet::NetException &)
+        {
+        }
+    }
+    body_->resize(start);
+    LogError("HttpEntityStream: entity " + QString::number(entity->Id()) + " is larger than " +
+        QString::number(cMaxEntityBytes / (1024 * 1024)) + " MB in the binary format, leaving it out");
+}
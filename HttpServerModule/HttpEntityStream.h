@@ -0,0 +1,71 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServer.h"
+#include "HttpSceneData.h"
+
+#include <QByteArray>
+#include <QString>
+#include <QDomDocument>
+#include <QDomNode>
+
+#include <vector>
+
+/// Serializes a list of entities into a deferred HTTP reply a slice at a time, so that large lists do not stall a frame.
+/** Entities removed while the list is being written are skipped. In the binary format the reply is a TBIN
+    document, as written by Scene::SaveSceneBinary: the entity count followed by the entities.
+    The body is written straight into the reply buffer that is handed to the server, one entity at a time. It is held
+    in memory whole until the reply is sent, as the websocketpp library sends a deferred reply in one piece. */
+class HTTP_SERVER_MODULE_API HttpEntityStream
+{
+public:
+    /// @param ids Entities to write, in order.
+    /// @param childDepth Levels of child entities written below each listed entity, SceneJsonWriter::cAllChildren for all.
+    HttpEntityStream(HttpServer::ConnectionPtr connection, const SceneWeakPtr &scene, const std::vector<entity_id_t> &ids,
+        HttpServer::ContentFormat format, uint childDepth);
+
+    /// Writes up to maxEntities more entities. Returns true when the whole list has been written.
+    bool Process(uint maxEntities);
+
+    /// Returns whether the whole list has been written.
+    bool IsFinished() const { return finished_; }
+
+    /// Sets the key and ETag under which the finished reply is stored in the scene cache.
+    void SetCacheKey(const QString &key, const QByteArray &etag) { cacheKey_ = key; etag_ = etag; }
+    const QString &CacheKey() const { return cacheKey_; }
+    const QByteArray &ETag() const { return etag_; }
+
+    /// Limits the components and attributes written for each entity.
+    void SetFieldSelection(const HttpFieldSelection &fields) { fields_ = fields; }
+
+    HttpServer::ConnectionPtr Connection() const { return connection_; }
+    HttpServer::ContentFormat Format() const { return format_; }
+    /// The reply body, which is complete once the whole list has been written.
+    HttpServer::ReplyBuffer Body() const { return body_; }
+    const char *ContentType() const;
+
+    /// Appends an entity element with its children down to the given depth, and with only the selected components and attributes if fields is given.
+    /** Slower than Entity::SerializeToXMLString(), so used only for the XML that it cannot write. */
+    static void AppendXmlEntity(QDomDocument &doc, QDomNode &parent, const Entity *entity, uint childDepth, const HttpFieldSelection *fields);
+
+private:
+    void WriteEntity(const Entity *entity);
+    /// Appends the binary serialization of an entity. Entities larger than 16 MB with their children are left out.
+    void WriteBinary(const Entity *entity);
+
+    HttpServer::ConnectionPtr connection_;
+    SceneWeakPtr scene_;
+    std::vector<entity_id_t> ids_;
+    size_t next_;
+    HttpServer::ContentFormat format_;
+    QString cacheKey_;
+    QByteArray etag_;
+    uint childDepth_;
+    HttpFieldSelection fields_;
+    bool first_;
+    bool finished_;
+    shared_ptr<std::string> body_;
+    /// Number of entities written, for the header of the binary format
+    u32 entitiesWritten_;
+};
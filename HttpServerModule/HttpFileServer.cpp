@@ -0,0 +1,315 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpFileServer.h"
+
+#include "AssetAPI.h"
+#include "Profiler.h"
+
+#include "boost/lexical_cast.hpp"
+
+#include <QMutexLocker>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QLocale>
+#include <QUrl>
+
+#include <algorithm>
+
+namespace
+{
+
+const QString cFilesPrefix = "/files/";
+const QString cAssetsPrefix = "/assets/";
+
+/// Seconds the metadata of a file is used before the file is looked at again
+const double cRevalidateSeconds = 2.0;
+/// Number of files whose metadata is cached
+const int cMaxFiles = 4096;
+/// Most bytes sent in one reply; clients ask for the rest in further ranges
+const qint64 cMaxRangeBytes = 16 * 1024 * 1024;
+
+struct ContentType
+{
+    const char *suffix;
+    const char *type;
+};
+
+const ContentType ContentTypes[] =
+{
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "js", "application/javascript" },
+    { "css", "text/css" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "wasm", "application/wasm" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "svg", "image/svg+xml" },
+    { "ico", "image/x-icon" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { "ogv", "video/ogg" },
+    { "ogg", "audio/ogg" },
+    { "mp3", "audio/mpeg" },
+    { "wav", "audio/wav" }
+};
+
+QString CleanDirectory(const QString &directory)
+{
+    return directory.isEmpty() ? QString() : QDir::cleanPath(QDir(directory).absolutePath());
+}
+
+}
+
+HttpFileServer::HttpFileServer() :
+    replies_(0),
+    rangeReplies_(0),
+    notModifiedReplies_(0)
+{
+}
+
+void HttpFileServer::SetDocumentRoot(const QString &directory)
+{
+    QMutexLocker lock(&mutex_);
+    documentRoot_ = CleanDirectory(directory);
+}
+
+void HttpFileServer::SetAssetCacheDirectory(const QString &directory)
+{
+    QMutexLocker lock(&mutex_);
+    assetCacheDirectory_ = CleanDirectory(directory);
+}
+
+bool HttpFileServer::Serve(HttpRequest::ConnectionPtr connection, HttpVerb verb, const std::string &resource)
+{
+    if (verb != HttpGet && verb != HttpHead)
+        return false;
+
+    const QUrl url(QString::fromUtf8(resource.c_str()));
+    const QString path = url.path();
+    QString root;
+    QString relativePath;
+    {
+        QMutexLocker lock(&mutex_);
+        if (!documentRoot_.isEmpty() && path.startsWith(cFilesPrefix))
+        {
+            root = documentRoot_;
+            relativePath = path.mid(cFilesPrefix.size());
+            if (relativePath.isEmpty() || relativePath.endsWith('/'))
+                relativePath += "index.html";
+        }
+        else if (!assetCacheDirectory_.isEmpty() && path.startsWith(cAssetsPrefix))
+        {
+            // The asset reference is either the rest of the path or the ?ref= query item, percent-encoded
+            root = assetCacheDirectory_;
+            const QString assetRef = url.hasQueryItem("ref") ? url.queryItemValue("ref") : path.mid(cAssetsPrefix.size());
+            if (!assetRef.isEmpty())
+                relativePath = AssetAPI::SanitateAssetRef(assetRef);
+        }
+    }
+    if (root.isEmpty())
+        return false;
+
+    PROFILE(HttpFileServer_Serve);
+
+    // Paths that lead out of the directory with .. are not found
+    const QString filePath = QDir::cleanPath(root + '/' + relativePath);
+    if (relativePath.isEmpty() || !filePath.startsWith(root + '/'))
+        connection->set_status(websocketpp::http::status_code::not_found);
+    else
+        ServeFile(connection, verb, filePath);
+    return true;
+}
+
+HttpFileServer::FileInfo HttpFileServer::LookUp(const QString &filePath)
+{
+    const kNet::tick_t now = kNet::Clock::Tick();
+    {
+        QMutexLocker lock(&mutex_);
+        QHash<QString, FileInfo>::const_iterator i = metadata_.find(filePath);
+        if (i != metadata_.end() && kNet::Clock::TimespanToSecondsD(i->checked, now) < cRevalidateSeconds)
+            return *i;
+    }
+
+    const QFileInfo fileInfo(filePath);
+    FileInfo info;
+    info.exists = fileInfo.isFile() && fileInfo.isReadable();
+    info.size = info.exists ? fileInfo.size() : 0;
+    info.checked = now;
+    if (info.exists)
+    {
+        const QDateTime modified = fileInfo.lastModified().toUTC();
+        info.etag = "\"" + QByteArray::number(info.size, 16) + '-' + QByteArray::number(modified.toTime_t(), 16) + "\"";
+        info.lastModified = QLocale::c().toString(modified, "ddd, dd MMM yyyy hh:mm:ss").toLatin1() + " GMT";
+    }
+
+    QMutexLocker lock(&mutex_);
+    if (metadata_.size() >= cMaxFiles)
+        metadata_.clear();
+    metadata_[filePath] = info;
+    return info;
+}
+
+void HttpFileServer::ServeFile(HttpRequest::ConnectionPtr connection, HttpVerb verb, const QString &filePath)
+{
+    const FileInfo info = LookUp(filePath);
+    if (!info.exists)
+    {
+        connection->set_status(websocketpp::http::status_code::not_found);
+        return;
+    }
+
+    connection->replace_header("ETag", info.etag.constData());
+    connection->replace_header("Last-Modified", info.lastModified.constData());
+    connection->replace_header("Accept-Ranges", "bytes");
+    connection->replace_header("Cache-Control", "no-cache");
+
+    // If-None-Match takes precedence over If-Modified-Since, which browsers send with the Last-Modified value as it was
+    const std::string ifNoneMatch = connection->get_request_header("If-None-Match");
+    const bool notModified = !ifNoneMatch.empty() ? (ifNoneMatch == "*" || ifNoneMatch.find(info.etag.constData()) != std::string::npos) :
+        connection->get_request_header("If-Modified-Since") == info.lastModified.constData();
+    if (notModified)
+    {
+        notModifiedReplies_.ref();
+        connection->set_status(websocketpp::http::status_code::not_modified);
+        return;
+    }
+
+    qint64 first = 0;
+    qint64 last = info.size - 1;
+    RangeResult range = WholeFile;
+    const std::string rangeHeader = connection->get_request_header("Range");
+    const std::string ifRange = connection->get_request_header("If-Range");
+    // A range of a file that has changed since the client got its first part would mix the versions, so the whole file is sent instead
+    if (!rangeHeader.empty() && (ifRange.empty() || ifRange == info.etag.constData() || ifRange == info.lastModified.constData()))
+        range = ParseRange(rangeHeader, info.size, first, last);
+    if (range == UnsatisfiableRange)
+    {
+        connection->replace_header("Content-Range", "bytes */" + boost::lexical_cast<std::string>(info.size));
+        connection->set_status(websocketpp::http::status_code::requested_range_not_satisfiable);
+        return;
+    }
+    // The whole of a large file is never read into one reply. Only a range request may be answered with a
+    // part of the file, so a plain GET is refused and the client has to ask for ranges.
+    if (range == WholeFile && verb == HttpGet && info.size > cMaxRangeBytes)
+    {
+        connection->set_status(websocketpp::http::status_code::request_entity_too_large);
+        return;
+    }
+
+    const qint64 length = last - first + 1;
+    std::string body;
+    if (verb == HttpGet && length > 0)
+    {
+        QFile file(filePath);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            connection->set_status(websocketpp::http::status_code::not_found);
+            return;
+        }
+        // The mapped pages are copied into the body, which websocketpp copies once more into the reply.
+        // Files that cannot be mapped are read.
+        uchar *data = file.map(first, length);
+        if (data)
+        {
+            body.assign((const char*)data, (size_t)length);
+            file.unmap(data);
+        }
+        else
+        {
+            body.resize((size_t)length);
+            if (!file.seek(first) || file.read(&body[0], length) != length)
+            {
+                // The file has been truncated since it was looked at; it is looked at again on the next request
+                QMutexLocker lock(&mutex_);
+                metadata_.remove(filePath);
+                connection->set_status(websocketpp::http::status_code::service_unavailable);
+                connection->replace_header("Retry-After", "1");
+                return;
+            }
+        }
+    }
+
+    connection->set_status(range == SatisfiableRange ? websocketpp::http::status_code::partial_content : websocketpp::http::status_code::ok);
+    connection->set_body(body);
+    // A HEAD reply has no body but tells the size of the one a GET would get
+    connection->replace_header("Content-Length", boost::lexical_cast<std::string>(length));
+    connection->replace_header("Content-Type", ContentTypeOf(filePath));
+    if (range == SatisfiableRange)
+    {
+        connection->replace_header("Content-Range", "bytes " + boost::lexical_cast<std::string>(first) + '-' +
+            boost::lexical_cast<std::string>(last) + '/' + boost::lexical_cast<std::string>(info.size));
+        rangeReplies_.ref();
+    }
+    replies_.ref();
+}
+
+HttpFileServer::RangeResult HttpFileServer::ParseRange(const std::string &header, qint64 size, qint64 &first, qint64 &last)
+{
+    const QByteArray range = QByteArray(header.c_str()).trimmed();
+    if (!range.startsWith("bytes=") || range.contains(','))
+        return WholeFile;
+
+    const int dash = range.indexOf('-');
+    if (dash < 0)
+        return WholeFile;
+    const QByteArray firstText = range.mid(6, dash - 6).trimmed();
+    const QByteArray lastText = range.mid(dash + 1).trimmed();
+    bool firstOk = !firstText.isEmpty();
+    bool lastOk = !lastText.isEmpty();
+    const qint64 firstValue = firstOk ? firstText.toLongLong(&firstOk) : 0;
+    const qint64 lastValue = lastOk ? lastText.toLongLong(&lastOk) : 0;
+
+    if (firstOk)
+    {
+        // bytes=first- or bytes=first-last
+        if (!lastText.isEmpty() && (!lastOk || lastValue < firstValue))
+            return WholeFile;
+        if (firstValue >= size)
+            return UnsatisfiableRange;
+        first = firstValue;
+        last = lastText.isEmpty() ? size - 1 : std::min(lastValue, size - 1);
+    }
+    else if (firstText.isEmpty() && lastOk)
+    {
+        // bytes=-suffix, the last bytes of the file
+        if (lastValue <= 0 || size == 0)
+            return UnsatisfiableRange;
+        first = std::max(size - lastValue, (qint64)0);
+        last = size - 1;
+    }
+    else
+        return WholeFile;
+
+    last = std::min(last, first + cMaxRangeBytes - 1);
+    return SatisfiableRange;
+}
+
+const char *HttpFileServer::ContentTypeOf(const QString &filePath)
+{
+    const QString suffix = QFileInfo(filePath).suffix().toLower();
+    for(size_t i = 0; i < sizeof(ContentTypes) / sizeof(ContentTypes[0]); ++i)
+        if (suffix == ContentTypes[i].suffix)
+            return ContentTypes[i].type;
+    return "application/octet-stream";
+}
+
+void HttpFileServer::ResetStatistics()
+{
+    replies_ = 0;
+    rangeReplies_ = 0;
+    notModifiedReplies_ = 0;
+}
+
+void HttpFileServer::ClearCache()
+{
+    QMutexLocker lock(&mutex_);
+    metadata_.clear();
+}
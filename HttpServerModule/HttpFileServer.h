@@ -0,0 +1,84 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+#include "HttpRouter.h"
+
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QAtomicInt>
+
+#include "kNet/Clock.h"
+
+/// Serves files from a document root under /files/ and from the asset cache under /assets/.
+/** Requests are answered in the thread that reads them, so with I/O threads serving files costs no main thread
+    time. File contents are read through a memory mapping straight into the reply, and single byte ranges are
+    supported with Range and If-Range so that media can be streamed and downloads resumed. No reply carries more
+    than 16 MB: a range is cut to its first 16 MB, and a larger file asked for without a range is refused with
+    413, as websocketpp can not send a body in parts. Replies carry an
+    ETag and Last-Modified, and conditional requests are answered with 304 Not Modified. The size and time of
+    files, including files that do not exist, are cached for a few seconds so that most requests do not touch
+    the file system before reading. Can be used from any thread. */
+class HTTP_SERVER_MODULE_API HttpFileServer
+{
+public:
+    HttpFileServer();
+
+    /// Sets the directory served under /files/. An empty directory disables it.
+    void SetDocumentRoot(const QString &directory);
+    /// Sets the asset cache directory; cached assets are served under /assets/ by their asset reference. An empty directory disables it.
+    void SetAssetCacheDirectory(const QString &directory);
+
+    /// Answers a GET or HEAD request for a file. Returns false if the request is not for a file, leaving it to the routes.
+    bool Serve(HttpRequest::ConnectionPtr connection, HttpVerb verb, const std::string &resource);
+
+    /// Files served, of which partial, and conditional requests answered with 304, since the last reset.
+    uint Replies() const { return (uint)(int)replies_; }
+    uint RangeReplies() const { return (uint)(int)rangeReplies_; }
+    uint NotModifiedReplies() const { return (uint)(int)notModifiedReplies_; }
+    void ResetStatistics();
+    /// Forgets the cached file metadata.
+    void ClearCache();
+
+private:
+    struct FileInfo
+    {
+        bool exists;
+        qint64 size;
+        QByteArray etag;
+        QByteArray lastModified;
+        /// Tick when the file was last looked at
+        kNet::tick_t checked;
+    };
+
+    /// Returns the metadata of a file, from the cache if it has been looked at recently.
+    FileInfo LookUp(const QString &filePath);
+    void ServeFile(HttpRequest::ConnectionPtr connection, HttpVerb verb, const QString &filePath);
+
+    /// Returns the content type by the file name extension.
+    static const char *ContentTypeOf(const QString &filePath);
+
+    enum RangeResult
+    {
+        /// No range, several ranges or a malformed header; the whole file is sent
+        WholeFile,
+        SatisfiableRange,
+        UnsatisfiableRange
+    };
+
+    /// Parses the byte range of a Range header.
+    static RangeResult ParseRange(const std::string &header, qint64 size, qint64 &first, qint64 &last);
+
+    mutable QMutex mutex_;
+    QString documentRoot_;
+    QString assetCacheDirectory_;
+    QHash<QString, FileInfo> metadata_;
+
+    QAtomicInt replies_;
+    QAtomicInt rangeReplies_;
+    QAtomicInt notModifiedReplies_;
+};
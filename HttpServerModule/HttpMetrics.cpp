@@ -0,0 +1,181 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+/// Escapes a label value of the Prometheus text format.
+QByteArray LabelValue(const QString &value)
+{
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return escaped;
+}
+
+/// Converts a camelCase statistic name to a snake_case metric name.
+QByteArray MetricName(const QString &name)
+{
+    QByteArray metric;
+    for(int i = 0; i < name.size(); ++i)
+    {
+        const QChar c = name[i];
+        if (c.isUpper())
+        {
+            metric += '_';
+            metric += c.toLower().toLatin1();
+        }
+        else if (c.isLetterOrNumber())
+            metric += c.toLatin1();
+        else
+            metric += '_';
+    }
+    return metric;
+}
+
+void WriteHeader(QByteArray &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+}
+
+HttpLatencyHistogram::HttpLatencyHistogram() :
+    sum_(0.0),
+    count_(0)
+{
+    for(int i = 0; i <= cNumBuckets; ++i)
+        buckets_[i] = 0;
+}
+
+double HttpLatencyHistogram::Bound(int bucket)
+{
+    return 50e-6 * (double)(1 << bucket);
+}
+
+void HttpLatencyHistogram::Add(double seconds)
+{
+    // The bucket is found from the exponent instead of searching the bounds
+    int bucket = 0;
+    if (seconds > Bound(0))
+        bucket = std::min((int)std::ceil(std::log(seconds / Bound(0)) / std::log(2.0) - 1e-9), (int)cNumBuckets);
+    ++buckets_[bucket];
+    sum_ += seconds;
+    ++count_;
+}
+
+void HttpLatencyHistogram::Write(QByteArray &out, const QByteArray &name, const QByteArray &labels) const
+{
+    const QByteArray separator = labels.isEmpty() ? "" : ",";
+    u64 cumulative = 0;
+    for(int i = 0; i < cNumBuckets; ++i)
+    {
+        cumulative += buckets_[i];
+        out += name + "_bucket{" + labels + separator + "le=\"" + QByteArray::number(Bound(i), 'g', 6) + "\"} " + QByteArray::number(cumulative) + '\n';
+    }
+    out += name + "_bucket{" + labels + separator + "le=\"+Inf\"} " + QByteArray::number(count_) + '\n';
+    out += name + "_sum{" + labels + "} " + QByteArray::number(sum_, 'g', 9) + '\n';
+    out += name + "_count{" + labels + "} " + QByteArray::number(count_) + '\n';
+}
+
+HttpMetrics::HttpMetrics()
+{
+}
+
+HttpMetrics::RouteMetrics *HttpMetrics::Route(const QString &verb, const QString &pattern)
+{
+    return &routes_[std::make_pair(verb, pattern)];
+}
+
+void HttpMetrics::RecordRequest(RouteMetrics *route, double queueSeconds, double handlerSeconds, u64 bytesIn)
+{
+    ++route->requests;
+    route->bytesIn += bytesIn;
+    route->queueDelay.Add(queueSeconds);
+    route->handlerTime.Add(handlerSeconds);
+}
+
+void HttpMetrics::RecordReply(RouteMetrics *route, int status, u64 bytesOut, double replySeconds)
+{
+    ++route->statuses[status];
+    route->bytesOut += bytesOut;
+    route->replyTime.Add(replySeconds);
+}
+
+void HttpMetrics::RecordFrame(double seconds)
+{
+    frameTime_.Add(seconds);
+}
+
+void HttpMetrics::Reset()
+{
+    routes_.clear();
+    frameTime_ = HttpLatencyHistogram();
+}
+
+QByteArray HttpMetrics::Prometheus(const QVariantMap &statistics) const
+{
+    QByteArray out;
+    typedef std::map<std::pair<QString, QString>, RouteMetrics>::const_iterator RouteIterator;
+
+    WriteHeader(out, "tundra_http_requests_total", "counter", "HTTP requests by verb and route.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        out += "tundra_http_requests_total{verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"} " +
+            QByteArray::number(i->second.requests) + '\n';
+
+    WriteHeader(out, "tundra_http_responses_total", "counter", "HTTP replies by verb, route and status code.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+    {
+        const QByteArray labels = "verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"";
+        for(std::map<int, u64>::const_iterator j = i->second.statuses.begin(); j != i->second.statuses.end(); ++j)
+            out += "tundra_http_responses_total{" + labels + ",status=\"" + QByteArray::number(j->first) + "\"} " + QByteArray::number(j->second) + '\n';
+    }
+
+    WriteHeader(out, "tundra_http_request_bytes_total", "counter", "HTTP request body bytes by verb and route.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        out += "tundra_http_request_bytes_total{verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"} " +
+            QByteArray::number(i->second.bytesIn) + '\n';
+
+    WriteHeader(out, "tundra_http_response_bytes_total", "counter", "HTTP reply body bytes by verb and route.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        out += "tundra_http_response_bytes_total{verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"} " +
+            QByteArray::number(i->second.bytesOut) + '\n';
+
+    WriteHeader(out, "tundra_http_queue_delay_seconds", "histogram", "Time from a request being read to its handler being run.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        i->second.queueDelay.Write(out, "tundra_http_queue_delay_seconds", "verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"");
+
+    WriteHeader(out, "tundra_http_handler_seconds", "histogram", "Main thread time spent in request handlers.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        i->second.handlerTime.Write(out, "tundra_http_handler_seconds", "verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"");
+
+    WriteHeader(out, "tundra_http_reply_seconds", "histogram", "Time from a request being read to its reply being sent, including deferred replies.");
+    for(RouteIterator i = routes_.begin(); i != routes_.end(); ++i)
+        i->second.replyTime.Write(out, "tundra_http_reply_seconds", "verb=\"" + LabelValue(i->first.first) + "\",route=\"" + LabelValue(i->first.second) + "\"");
+
+    WriteHeader(out, "tundra_http_frame_seconds", "histogram", "Main thread time spent on HTTP work per frame.");
+    frameTime_.Write(out, "tundra_http_frame_seconds", QByteArray());
+
+    // Server statistics that are plain numbers; their meaning is documented with HttpServer::UpdateStatistics()
+    for(QVariantMap::const_iterator i = statistics.begin(); i != statistics.end(); ++i)
+    {
+        bool ok = false;
+        const double value = i.value().toDouble(&ok);
+        if (!ok || i.value().type() == QVariant::Map || i.value().type() == QVariant::String)
+            continue;
+        const QByteArray name = "tundra_http_" + MetricName(i.key());
+        out += "# TYPE " + name + " gauge\n" + name + ' ' + QByteArray::number(value, 'g', 15) + '\n';
+    }
+    return out;
+}
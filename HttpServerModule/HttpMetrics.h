@@ -0,0 +1,81 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+
+#include <QByteArray>
+#include <QString>
+#include <QVariantMap>
+
+#include <map>
+
+/// Histogram of durations in buckets whose bounds double from 50 microseconds to about 26 seconds.
+class HTTP_SERVER_MODULE_API HttpLatencyHistogram
+{
+public:
+    HttpLatencyHistogram();
+
+    void Add(double seconds);
+    /// Writes the buckets, sum and count in the Prometheus text format, with the given labels inside the braces.
+    void Write(QByteArray &out, const QByteArray &name, const QByteArray &labels) const;
+
+    u64 Count() const { return count_; }
+    double Sum() const { return sum_; }
+
+    static const int cNumBuckets = 20;
+
+private:
+    /// Upper bound of a bucket in seconds.
+    static double Bound(int bucket);
+
+    /// Non-cumulative counts; the last bucket counts what is over the largest bound
+    u64 buckets_[cNumBuckets + 1];
+    double sum_;
+    u64 count_;
+};
+
+/// Request and frame time accounting of the HTTP server, written in the Prometheus text format for GET /metrics.
+/** Requests are counted per verb and route pattern rather than per path, so the number of series stays
+    bounded. For each route, the metrics are the number of requests, the replies by status code, the request
+    and reply body bytes, and histograms of three durations: the queueing delay from the request being read
+    to its handler being run, the time in the handler, and the time from the request being read to the
+    reply being sent, which includes deferred replies. The main thread time spent in HttpServer::Update()
+    is recorded per frame. Used from the main thread only. */
+class HTTP_SERVER_MODULE_API HttpMetrics
+{
+public:
+    struct RouteMetrics
+    {
+        RouteMetrics() : requests(0), bytesIn(0), bytesOut(0) {}
+
+        u64 requests;
+        /// Reply counts by status code
+        std::map<int, u64> statuses;
+        u64 bytesIn;
+        u64 bytesOut;
+        HttpLatencyHistogram queueDelay;
+        HttpLatencyHistogram handlerTime;
+        HttpLatencyHistogram replyTime;
+    };
+
+    HttpMetrics();
+
+    /// Returns the metrics of a route, creating them on first use. The pointer stays valid until Reset().
+    RouteMetrics *Route(const QString &verb, const QString &pattern);
+
+    void RecordRequest(RouteMetrics *route, double queueSeconds, double handlerSeconds, u64 bytesIn);
+    void RecordReply(RouteMetrics *route, int status, u64 bytesOut, double replySeconds);
+    void RecordFrame(double seconds);
+
+    /// Writes all metrics, followed by the numeric server statistics as gauges.
+    QByteArray Prometheus(const QVariantMap &statistics) const;
+
+    void Reset();
+
+private:
+    /// Routes by verb and pattern
+    std::map<std::pair<QString, QString>, RouteMetrics> routes_;
+    HttpLatencyHistogram frameTime_;
+};
@@ -0,0 +1,117 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpRateLimiter.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+
+/// Number of addresses above which full buckets are forgotten, and then the least recently seen ones
+const int cMaxAddresses = 4096;
+
+}
+
+HttpRateLimiter::HttpRateLimiter()
+{
+    for(int i = 0; i < NumRequestClasses; ++i)
+    {
+        limits_[i].rate = 0.f;
+        limits_[i].burst = 0.f;
+        refused_[i] = 0;
+    }
+}
+
+void HttpRateLimiter::SetLimit(RequestClass requestClass, float requestsPerSecond, float burst)
+{
+    QMutexLocker lock(&mutex_);
+    limits_[requestClass].rate = requestsPerSecond;
+    limits_[requestClass].burst = std::max(burst, 1.f);
+    buckets_[requestClass].clear();
+}
+
+float HttpRateLimiter::Admit(const QByteArray &address, RequestClass requestClass)
+{
+    QMutexLocker lock(&mutex_);
+    const Limit &limit = limits_[requestClass];
+    if (limit.rate <= 0.f)
+        return 0.f;
+
+    const kNet::tick_t now = kNet::Clock::Tick();
+    QHash<QByteArray, Bucket> &buckets = buckets_[requestClass];
+    QHash<QByteArray, Bucket>::iterator i = buckets.find(address);
+    if (i == buckets.end())
+    {
+        if (buckets.size() >= cMaxAddresses)
+            Prune(now);
+        Bucket bucket;
+        bucket.tokens = limit.burst;
+        bucket.updated = now;
+        i = buckets.insert(address, bucket);
+    }
+    else
+    {
+        const float elapsed = (float)kNet::Clock::TimespanToSecondsD(i->updated, now);
+        i->tokens = std::min(i->tokens + elapsed * limit.rate, limit.burst);
+        i->updated = now;
+    }
+
+    if (i->tokens >= 1.f)
+    {
+        i->tokens -= 1.f;
+        return 0.f;
+    }
+    ++refused_[requestClass];
+    return (1.f - i->tokens) / limit.rate;
+}
+
+void HttpRateLimiter::Prune(kNet::tick_t now)
+{
+    for(int c = 0; c < NumRequestClasses; ++c)
+    {
+        const Limit &limit = limits_[c];
+        QHash<QByteArray, Bucket> &buckets = buckets_[c];
+        for(QHash<QByteArray, Bucket>::iterator i = buckets.begin(); i != buckets.end();)
+        {
+            const float elapsed = (float)kNet::Clock::TimespanToSecondsD(i->updated, now);
+            if (limit.rate <= 0.f || i->tokens + elapsed * limit.rate >= limit.burst)
+                i = buckets.erase(i);
+            else
+                ++i;
+        }
+
+        // A flood from many distinct addresses keeps every bucket partly empty; then the quarter of the
+        // addresses seen least recently is forgotten, so the memory used stays bounded in any case
+        if (buckets.size() < cMaxAddresses)
+            continue;
+        std::vector<kNet::tick_t> seen;
+        seen.reserve(buckets.size());
+        for(QHash<QByteArray, Bucket>::const_iterator i = buckets.begin(); i != buckets.end(); ++i)
+            seen.push_back(i->updated);
+        std::vector<kNet::tick_t>::iterator cutoff = seen.begin() + seen.size() / 4;
+        std::nth_element(seen.begin(), cutoff, seen.end());
+        for(QHash<QByteArray, Bucket>::iterator i = buckets.begin(); i != buckets.end();)
+        {
+            if (i->updated <= *cutoff)
+                i = buckets.erase(i);
+            else
+                ++i;
+        }
+    }
+}
+
+uint HttpRateLimiter::NumAddresses() const
+{
+    QMutexLocker lock(&mutex_);
+    return (uint)std::max(buckets_[ReadRequest].size(), buckets_[WriteRequest].size());
+}
+
+void HttpRateLimiter::ResetStatistics()
+{
+    QMutexLocker lock(&mutex_);
+    for(int i = 0; i < NumRequestClasses; ++i)
+        refused_[i] = 0;
+}
@@ -0,0 +1,65 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+
+#include <QMutex>
+#include <QHash>
+#include <QByteArray>
+
+#include "kNet/Clock.h"
+
+/// Token bucket rate limits per remote address, separately for reading and writing requests.
+/** Each address has a bucket per request class that holds up to the burst size of tokens and refills at
+    the rate of the class. A request takes a token; a request that finds its bucket empty is refused, and
+    the time until the next token is returned for the Retry-After header. Buckets that have refilled are
+    forgotten when there are many addresses, and if that is not enough, those of the addresses seen least
+    recently, so the memory used stays bounded. Can be used from any thread. */
+class HTTP_SERVER_MODULE_API HttpRateLimiter
+{
+public:
+    enum RequestClass
+    {
+        /// GET, HEAD and OPTIONS
+        ReadRequest,
+        /// POST, PUT, DELETE and PATCH, which change the scene and are replicated to all Tundra clients
+        WriteRequest,
+        NumRequestClasses
+    };
+
+    HttpRateLimiter();
+
+    /// Sets the sustained rate in requests per second and the burst size of a request class. A rate of zero or less disables the limit.
+    void SetLimit(RequestClass requestClass, float requestsPerSecond, float burst);
+
+    /// Takes a token from the bucket of the address. Returns 0 if the request is admitted, otherwise the seconds until it could be.
+    float Admit(const QByteArray &address, RequestClass requestClass);
+
+    /// Requests refused since the last reset.
+    uint Refused(RequestClass requestClass) const { return refused_[requestClass]; }
+    uint NumAddresses() const;
+    void ResetStatistics();
+
+private:
+    struct Bucket
+    {
+        float tokens;
+        kNet::tick_t updated;
+    };
+
+    struct Limit
+    {
+        float rate;
+        float burst;
+    };
+
+    /// Forgets the buckets that are full again, and the least recently used ones if there are still too many.
+    void Prune(kNet::tick_t now);
+
+    mutable QMutex mutex_;
+    QHash<QByteArray, Bucket> buckets_[NumRequestClasses];
+    Limit limits_[NumRequestClasses];
+    uint refused_[NumRequestClasses];
+};
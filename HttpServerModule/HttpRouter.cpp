@@ -0,0 +1,273 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpRouter.h"
+
+#include "Profiler.h"
+
+#include <QByteArray>
+
+QByteArray HttpRequest::Body() const
+{
+    const std::string &body = connection->get_request_body();
+    return QByteArray::fromRawData(body.data(), (int)body.size());
+}
+
+HttpRouter::Node::~Node()
+{
+    for(QHash<QString, Node*>::const_iterator i = literals.begin(); i != literals.end(); ++i)
+        delete i.value();
+    delete parameter;
+    delete wildcard;
+    for(int i = 0; i < NumHttpVerbs; ++i)
+        delete routes[i];
+}
+
+bool HttpRouter::Node::HasRoutes() const
+{
+    for(int i = 0; i < NumHttpVerbs; ++i)
+        if (routes[i])
+            return true;
+    return false;
+}
+
+HttpRouter::HttpRouter() :
+    root_(new Node())
+{
+}
+
+HttpRouter::~HttpRouter()
+{
+    delete root_;
+}
+
+void HttpRouter::Clear()
+{
+    delete root_;
+    root_ = new Node();
+}
+
+HttpVerb HttpRouter::ParseVerb(const std::string &method)
+{
+    for(int i = 0; i < NumHttpVerbs; ++i)
+        if (qstricmp(method.c_str(), VerbName((HttpVerb)i)) == 0)
+            return (HttpVerb)i;
+    return HttpUnknownVerb;
+}
+
+const char *HttpRouter::VerbName(HttpVerb verb)
+{
+    switch(verb)
+    {
+    case HttpGet: return "GET";
+    case HttpHead: return "HEAD";
+    case HttpPost: return "POST";
+    case HttpPut: return "PUT";
+    case HttpDelete: return "DELETE";
+    case HttpPatch: return "PATCH";
+    case HttpOptions: return "OPTIONS";
+    default: return "";
+    }
+}
+
+bool HttpRouter::ParsePattern(const QString &pattern, QStringList &segments, QStringList &paramNames)
+{
+    if (!pattern.startsWith('/'))
+        return false;
+
+    segments = pattern.split('/', QString::SkipEmptyParts);
+    for(int i = 0; i < segments.size(); ++i)
+    {
+        const QChar first = segments[i][0];
+        if (first != ':' && first != '*')
+            continue;
+        // Parameters need a name, and a wildcard can only be the last segment
+        if (segments[i].length() < 2 || (first == '*' && i != segments.size() - 1))
+            return false;
+        paramNames.push_back(segments[i].mid(1));
+    }
+    return true;
+}
+
+bool HttpRouter::AddRoute(HttpVerb verb, const QString &pattern, const Handler &handler)
+{
+    QStringList segments, paramNames;
+    if (verb == HttpUnknownVerb || !handler || !ParsePattern(pattern, segments, paramNames))
+        return false;
+
+    Node *node = root_;
+    for(int i = 0; i < segments.size(); ++i)
+    {
+        Node *&next = (segments[i][0] == ':' ? node->parameter : (segments[i][0] == '*' ? node->wildcard : node->literals[segments[i]]));
+        if (!next)
+            next = new Node();
+        node = next;
+    }
+    if (node->routes[verb])
+        return false;
+
+    Route *route = new Route();
+    route->pattern = pattern;
+    route->handler = handler;
+    route->paramNames = paramNames;
+    node->routes[verb] = route;
+    return true;
+}
+
+bool HttpRouter::RemoveRoute(HttpVerb verb, const QString &pattern)
+{
+    QStringList segments, paramNames;
+    if (verb == HttpUnknownVerb || !ParsePattern(pattern, segments, paramNames))
+        return false;
+
+    Node *node = root_;
+    for(int i = 0; i < segments.size() && node; ++i)
+        node = (segments[i][0] == ':' ? node->parameter : (segments[i][0] == '*' ? node->wildcard : node->literals.value(segments[i])));
+    if (!node || !node->routes[verb])
+        return false;
+
+    delete node->routes[verb];
+    node->routes[verb] = 0;
+    Prune(root_);
+    return true;
+}
+
+void HttpRouter::Prune(Node *node)
+{
+    for(QHash<QString, Node*>::iterator i = node->literals.begin(); i != node->literals.end();)
+    {
+        Prune(i.value());
+        if (i.value()->IsEmpty())
+        {
+            delete i.value();
+            i = node->literals.erase(i);
+        }
+        else
+            ++i;
+    }
+    if (node->parameter)
+    {
+        Prune(node->parameter);
+        if (node->parameter->IsEmpty())
+        {
+            delete node->parameter;
+            node->parameter = 0;
+        }
+    }
+    if (node->wildcard && node->wildcard->IsEmpty())
+    {
+        delete node->wildcard;
+        node->wildcard = 0;
+    }
+}
+
+HttpRouter::Node *HttpRouter::Find(Node *node, const QStringList &segments, int index, QStringList &values)
+{
+    if (index == segments.size())
+        return node->HasRoutes() ? node : 0;
+
+    QHash<QString, Node*>::const_iterator literal = node->literals.find(segments[index]);
+    if (literal != node->literals.end())
+    {
+        Node *found = Find(literal.value(), segments, index + 1, values);
+        if (found)
+            return found;
+    }
+    if (node->parameter)
+    {
+        values.push_back(segments[index]);
+        Node *found = Find(node->parameter, segments, index + 1, values);
+        if (found)
+            return found;
+        values.pop_back();
+    }
+    if (node->wildcard && node->wildcard->HasRoutes())
+    {
+        values.push_back(QStringList(segments.mid(index)).join("/"));
+        return node->wildcard;
+    }
+    return 0;
+}
+
+HttpRouter::MatchResult HttpRouter::Match(HttpRequest &request, Handler &handler, QString &allowedVerbs)
+{
+    PROFILE(HttpRouter_Match);
+
+    QStringList values;
+    Node *node = Find(root_, request.path.split('/', QString::SkipEmptyParts), 0, values);
+    if (!node)
+        return NoRoute;
+
+    Route *route = (request.verb != HttpUnknownVerb ? node->routes[request.verb] : 0);
+    if (!route)
+    {
+        QStringList verbs;
+        for(int i = 0; i < NumHttpVerbs; ++i)
+            if (node->routes[i])
+                verbs.push_back(VerbName((HttpVerb)i));
+        allowedVerbs = verbs.join(", ");
+        return VerbNotAllowed;
+    }
+
+    // Routes of a node may name their parameters differently, so the names come from the matched route
+    for(int i = 0; i < values.size() && i < route->paramNames.size(); ++i)
+        request.params.insert(route->paramNames[i], values[i]);
+    ++route->dispatches;
+    request.route = route->pattern;
+    handler = route->handler;
+    return RouteMatched;
+}
+
+std::vector<std::pair<HttpVerb, HttpRouter::Route*> > HttpRouter::Routes() const
+{
+    std::vector<std::pair<HttpVerb, Route*> > routes;
+    std::vector<const Node*> nodes(1, root_);
+    while(!nodes.empty())
+    {
+        const Node *node = nodes.back();
+        nodes.pop_back();
+        for(int i = 0; i < NumHttpVerbs; ++i)
+            if (node->routes[i])
+                routes.push_back(std::make_pair((HttpVerb)i, node->routes[i]));
+        for(QHash<QString, Node*>::const_iterator i = node->literals.begin(); i != node->literals.end(); ++i)
+            nodes.push_back(i.value());
+        if (node->parameter)
+            nodes.push_back(node->parameter);
+        if (node->wildcard)
+            nodes.push_back(node->wildcard);
+    }
+    return routes;
+}
+
+QVariantMap HttpRouter::Statistics() const
+{
+    QVariantMap stats;
+    std::vector<std::pair<HttpVerb, Route*> > routes = Routes();
+    for(size_t i = 0; i < routes.size(); ++i)
+        stats[QString(VerbName(routes[i].first)) + ' ' + routes[i].second->pattern] = routes[i].second->dispatches;
+    return stats;
+}
+
+void HttpRouter::ResetStatistics()
+{
+    std::vector<std::pair<HttpVerb, Route*> > routes = Routes();
+    for(size_t i = 0; i < routes.size(); ++i)
+        routes[i].second->dispatches = 0;
+}
+
+QVariantMap HttpScriptRoute::ParamMap(const HttpRequest &request)
+{
+    QVariantMap params;
+    for(QHash<QString, QString>::const_iterator i = request.params.begin(); i != request.params.end(); ++i)
+        params[i.key()] = i.value();
+    return params;
+}
+
+void HttpScriptRoute::Dispatch(const HttpRequest &request)
+{
+    emit Requested(request.connection, request.path, ParamMap(request));
+}
+
+void HttpScriptRoute::DispatchDeferred(const HttpRequest &request, HttpDeferredReply *reply)
+{
+    emit DeferredRequested(reply, ParamMap(request));
+}
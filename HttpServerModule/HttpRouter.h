@@ -0,0 +1,191 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QUrl>
+#include <QVariantMap>
+
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/server.hpp>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "boost/function.hpp"
+
+class HttpDeferredReply;
+
+/// HTTP request methods known to HttpRouter
+enum HttpVerb
+{
+    HttpGet = 0,
+    HttpHead,
+    HttpPost,
+    HttpPut,
+    HttpDelete,
+    HttpPatch,
+    HttpOptions,
+    NumHttpVerbs,
+    HttpUnknownVerb = NumHttpVerbs
+};
+
+/// An HTTP request matched to a route, as given to route handlers.
+struct HTTP_SERVER_MODULE_API HttpRequest
+{
+    typedef websocketpp::server<websocketpp::config::asio>::connection_ptr ConnectionPtr;
+
+    HttpRequest() : verb(HttpUnknownVerb) {}
+
+    ConnectionPtr connection;
+    HttpVerb verb;
+    /// Request path without the query
+    QString path;
+    /// The whole request resource, for the query items
+    QUrl url;
+    /// Values of the route's path parameters by name
+    QHash<QString, QString> params;
+    /// Pattern of the matched route
+    QString route;
+
+    /// Returns the value of a path parameter, or an empty string if the route has none by that name.
+    QString Param(const QString &name) const { return params.value(name); }
+    /// Returns the request body. The data is not copied and is valid until the handler returns.
+    QByteArray Body() const;
+};
+
+/// Route table of the HTTP server: a tree of path segments with a handler per verb at each route.
+/** Route patterns are paths whose segments are literals, parameters written as :name, or a final
+    wildcard written as *name that matches the rest of the path. Literal segments take precedence
+    over parameters, and parameters over wildcards, so /scene/batch wins over /scene/:id.
+    The router is not thread-safe; routes are added, removed and matched in the main thread. */
+class HTTP_SERVER_MODULE_API HttpRouter
+{
+public:
+    typedef boost::function<void(const HttpRequest&)> Handler;
+
+    /// Outcome of matching a request
+    enum MatchResult
+    {
+        RouteMatched,
+        NoRoute,
+        /// The path has routes, but none for the request's verb
+        VerbNotAllowed
+    };
+
+    HttpRouter();
+    ~HttpRouter();
+
+    /// Adds a route. Returns false if the pattern is malformed or the verb already has a route with the same path.
+    bool AddRoute(HttpVerb verb, const QString &pattern, const Handler &handler);
+    /// Removes a route. Returns false if there was none.
+    bool RemoveRoute(HttpVerb verb, const QString &pattern);
+    /// Removes all routes.
+    void Clear();
+
+    /// Matches a request to a route, filling in the path parameters of the request.
+    /** If a route matches, its handler is returned in handler. If the path is routed for other verbs
+        only, they are listed in allowedVerbs in the form of an Allow header. */
+    MatchResult Match(HttpRequest &request, Handler &handler, QString &allowedVerbs);
+
+    /// Returns the number of requests dispatched to each route, keyed by verb and pattern.
+    QVariantMap Statistics() const;
+    /// Zeroes the dispatch counters.
+    void ResetStatistics();
+
+    /// Returns the verb of a request method name, or HttpUnknownVerb. Method names are case-insensitive.
+    static HttpVerb ParseVerb(const std::string &method);
+    static HttpVerb ParseVerb(const QString &method) { return ParseVerb(method.toStdString()); }
+    static const char *VerbName(HttpVerb verb);
+
+private:
+    struct Route
+    {
+        Route() : dispatches(0) {}
+
+        QString pattern;
+        Handler handler;
+        /// Names of the parameters and wildcard in the pattern, in path order
+        QStringList paramNames;
+        uint dispatches;
+    };
+
+    struct Node
+    {
+        Node() : parameter(0), wildcard(0)
+        {
+            for(int i = 0; i < NumHttpVerbs; ++i)
+                routes[i] = 0;
+        }
+        ~Node();
+
+        bool HasRoutes() const;
+        bool IsEmpty() const { return !HasRoutes() && literals.isEmpty() && !parameter && !wildcard; }
+
+        QHash<QString, Node*> literals;
+        Node *parameter;
+        Node *wildcard;
+        Route *routes[NumHttpVerbs];
+    };
+
+    /// Splits a pattern into segments and parameter names. Returns false if it is malformed.
+    static bool ParsePattern(const QString &pattern, QStringList &segments, QStringList &paramNames);
+    /// Finds the node of a request path, collecting the values of parameters on the way.
+    static Node *Find(Node *node, const QStringList &segments, int index, QStringList &values);
+    /// Removes the empty nodes below node.
+    static void Prune(Node *node);
+    /// Returns all routes with their verbs.
+    std::vector<std::pair<HttpVerb, Route*> > Routes() const;
+
+    Node *root_;
+
+    HttpRouter(const HttpRouter &);
+    void operator =(const HttpRouter &);
+};
+
+/// Route registered by a script. Emits Requested for every request routed to it.
+/** A deferred route instead emits DeferredRequested with a reply handle, which the script may complete
+    in a later frame. */
+class HTTP_SERVER_MODULE_API HttpScriptRoute : public QObject
+{
+    Q_OBJECT
+
+public:
+    HttpScriptRoute(const QString &verb, const QString &pattern, QObject *parent) : QObject(parent), verb_(verb), pattern_(pattern), deferred_(false) {}
+
+    /// Emits Requested for a request routed here.
+    void Dispatch(const HttpRequest &request);
+    /// Emits DeferredRequested for a request routed here.
+    void DispatchDeferred(const HttpRequest &request, HttpDeferredReply *reply);
+
+public slots:
+    QString Verb() const { return verb_; }
+    QString Pattern() const { return pattern_; }
+
+    /// Sets whether requests are given to the script as deferred reply handles. Off by default.
+    void SetDeferred(bool deferred) { deferred_ = deferred; }
+    bool IsDeferred() const { return deferred_; }
+
+signals:
+    /// A request has been routed here. Reply with HttpServer::SetHttpRequestReply() before returning.
+    /// @param params Values of the route's path parameters by name
+    /// \todo Expose types to scripting
+    void Requested(HttpRequest::ConnectionPtr connection, const QString &path, const QVariantMap &params);
+
+    /// A request has been routed to a deferred route. Complete it with one of the Reply functions of the handle.
+    void DeferredRequested(HttpDeferredReply *reply, const QVariantMap &params);
+
+private:
+    static QVariantMap ParamMap(const HttpRequest &request);
+
+    QString verb_;
+    QString pattern_;
+    bool deferred_;
+};
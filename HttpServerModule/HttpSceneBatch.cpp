@@ -0,0 +1,523 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSceneBatch.h"
+#include "SceneJsonWriter.h"
+
+#include "CoreJsonUtils.h"
+#include "LoggingFunctions.h"
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+#include "EC_DynamicComponent.h"
+
+#include <QDomDocument>
+#include <QDomElement>
+#include <QVariantMap>
+#include <QVariantList>
+
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/NetException.h"
+
+namespace
+{
+    /// Largest binary attribute value kept in a rollback snapshot; larger ones fall back to their string form.
+    const size_t cMaxSnapshotBytes = 16 * 1024 * 1024;
+}
+
+HttpSceneBatch::HttpSceneBatch(Framework *framework, Scene *scene) :
+    framework_(framework),
+    scene_(scene),
+    deserializer_(framework, scene, AttributeChange::Disconnected),
+    committed_(false)
+{
+}
+
+bool HttpSceneBatch::ParseOperation(const QString &action, const QString &target, Operation &op, QString &error)
+{
+    op.actionName = action.toLower();
+    if (op.actionName == "create")
+        op.action = CreateAction;
+    else if (op.actionName == "update")
+        op.action = UpdateAction;
+    else if (op.actionName == "delete")
+        op.action = DeleteAction;
+    else
+    {
+        error = "Unknown batch action \"" + action + "\"";
+        return false;
+    }
+
+    op.target = target;
+    QString path = target;
+    if (path.startsWith('/'))
+        path = path.mid(1);
+    if (path.endsWith('/'))
+        path.chop(1);
+    op.targetParts = path.split('/');
+    if (op.targetParts.isEmpty() || op.targetParts[0] != "entities")
+    {
+        error = "Batch operation target \"" + target + "\" is not under /entities";
+        return false;
+    }
+    return true;
+}
+
+bool HttpSceneBatch::Parse(const QByteArray &body, bool json, QString &error)
+{
+    if (json)
+    {
+        bool ok = false;
+        QVariant root = TundraJson::Parse(body, &ok);
+        if (!ok)
+        {
+            error = "JSON decode error";
+            return false;
+        }
+        const QVariantList list = (root.type() == QVariant::Map ? root.toMap().value("operations").toList() : root.toList());
+        for(int i = 0; i < list.size(); ++i)
+        {
+            const QVariantMap object = list[i].toMap();
+            Operation op;
+            if (!ParseOperation(object.value("action").toString(), object.value("target").toString(), op, error))
+                return false;
+            if (object.contains("entity"))
+                HttpSceneParser::ParseEntity(object.value("entity").toMap(), op.entity);
+            if (object.contains("component"))
+                HttpSceneParser::ParseComponent(object.value("component").toMap(), op.component);
+            if (object.contains("attributes"))
+                HttpSceneParser::ParseAttributes(object.value("attributes"), op.component.attributes);
+            op.value = object.value("value");
+            operations_.push_back(op);
+        }
+    }
+    else
+    {
+        QDomDocument batchDoc("Batch");
+        QString errorMsg;
+        int errorLine, errorColumn;
+        if (!batchDoc.setContent(body, &errorMsg, &errorLine, &errorColumn))
+        {
+            error = "XML decode error " + errorMsg + " at line " + QString::number(errorLine);
+            return false;
+        }
+        QDomElement root = batchDoc.firstChildElement("batch");
+        if (root.isNull())
+        {
+            error = "XML decode error: expected a batch element";
+            return false;
+        }
+
+        QDomElement opElem = root.firstChildElement("operation");
+        while(!opElem.isNull())
+        {
+            Operation op;
+            if (!ParseOperation(opElem.attribute("action"), opElem.attribute("target"), op, error))
+                return false;
+            QDomElement entElem = opElem.firstChildElement("entity");
+            if (!entElem.isNull())
+                HttpSceneParser::ParseEntity(entElem, op.entity);
+            // Attributes either inside a component element or directly inside the operation
+            QDomElement compElem = opElem.firstChildElement("component");
+            HttpSceneParser::ParseComponent(compElem.isNull() ? opElem : compElem, op.component);
+            op.component.element = QDomElement();
+            if (opElem.hasAttribute("value"))
+                op.value = opElem.attribute("value");
+            operations_.push_back(op);
+            opElem = opElem.nextSiblingElement("operation");
+        }
+    }
+
+    if (operations_.isEmpty())
+    {
+        error = "Batch contains no operations";
+        return false;
+    }
+    return true;
+}
+
+bool HttpSceneBatch::Execute()
+{
+    PROFILE(HttpSceneBatch_Execute);
+
+    bool failed = false;
+    for(int i = 0; i < operations_.size(); ++i)
+    {
+        Result result;
+        if (!failed)
+        {
+            failed = !Apply(operations_[i], result);
+            result.ok = !failed;
+        }
+        else
+            result.message = "Not applied";
+        results_.push_back(result);
+    }
+
+    if (failed)
+        Rollback();
+    else
+        Commit();
+    committed_ = !failed;
+    return committed_;
+}
+
+EntityPtr HttpSceneBatch::TargetEntity(const Operation &op, Result &result)
+{
+    bool ok = false;
+    entity_id_t id = op.targetParts.size() > 1 ? op.targetParts[1].toUInt(&ok) : 0;
+    EntityPtr entity = ok ? scene_->EntityById(id) : EntityPtr();
+    if (!entity || deletedEntities_.contains(id))
+    {
+        result.message = "No such entity";
+        return EntityPtr();
+    }
+    result.id = id;
+    return entity;
+}
+
+ComponentPtr HttpSceneBatch::TargetComponent(const Operation &op, Result &result)
+{
+    EntityPtr entity = TargetEntity(op, result);
+    if (!entity)
+        return ComponentPtr();
+    /// \todo Uses only the first component
+    ComponentPtr comp = LiveComponent(entity, op.targetParts[2]);
+    if (!comp)
+    {
+        result.message = "No such component";
+        return ComponentPtr();
+    }
+    return comp;
+}
+
+ComponentPtr HttpSceneBatch::LiveComponent(const EntityPtr &entity, const QString &typeName) const
+{
+    const Entity::ComponentVector components = entity->ComponentsOfType(typeName);
+    for(size_t i = 0; i < components.size(); ++i)
+    {
+        if (components[i] && !deletedComponents_.contains(components[i].get()))
+            return components[i];
+    }
+    return ComponentPtr();
+}
+
+bool HttpSceneBatch::Apply(const Operation &op, Result &result)
+{
+    const int depth = op.targetParts.size();
+    const uint missingBefore = deserializer_.NumMissingAttributes();
+
+    switch(op.action)
+    {
+    case CreateAction:
+        if (depth == 1 || depth == 2)
+        {
+            HttpEntityData data = op.entity;
+            if (depth == 2)
+            {
+                bool ok = false;
+                data.id = op.targetParts[1].toUInt(&ok);
+                if (!ok || data.id == 0 || scene_->HasEntity(data.id))
+                {
+                    result.message = "Entity id is invalid or already in use";
+                    return false;
+                }
+            }
+            EntityPtr entity = deserializer_.CreateEntity(EntityPtr(), data);
+            if (!entity)
+            {
+                result.message = "Could not create entity";
+                return false;
+            }
+            result.id = entity->Id();
+        }
+        else if (depth == 3)
+        {
+            EntityPtr entity = TargetEntity(op, result);
+            if (!entity)
+                return false;
+            // A component deleted earlier in the batch is removed on commit, so a new one is created next to it
+            ComponentPtr comp = LiveComponent(entity, op.targetParts[2]);
+            if (comp)
+                Snapshot(comp);
+            else
+                comp = deserializer_.CreateComponent(entity, op.targetParts[2]);
+            if (!comp)
+            {
+                result.message = "Could not create component";
+                return false;
+            }
+            deserializer_.ApplyAttributes(comp.get(), op.component.attributes);
+        }
+        else
+        {
+            result.message = "Unsupported target for create";
+            return false;
+        }
+        break;
+
+    case UpdateAction:
+        if (depth == 3 || depth == 4)
+        {
+            ComponentPtr comp = TargetComponent(op, result);
+            if (!comp)
+                return false;
+            Snapshot(comp);
+            if (depth == 3)
+                deserializer_.ApplyAttributes(comp.get(), op.component.attributes);
+            else
+            {
+                QList<HttpAttributeData> attributes;
+                HttpAttributeData attr;
+                attr.id = op.targetParts[3];
+                attr.value = op.value;
+                attributes.push_back(attr);
+                deserializer_.ApplyAttributes(comp.get(), attributes);
+            }
+        }
+        else
+        {
+            result.message = "Unsupported target for update";
+            return false;
+        }
+        break;
+
+    case DeleteAction:
+        if (depth == 2)
+        {
+            EntityPtr entity = TargetEntity(op, result);
+            if (!entity)
+                return false;
+            entityDeletions_.push_back(entity->Id());
+            deletedEntities_.insert(entity->Id());
+        }
+        else if (depth == 3)
+        {
+            ComponentPtr comp = TargetComponent(op, result);
+            if (!comp)
+                return false;
+            componentDeletions_.push_back(comp);
+            deletedComponents_.insert(comp.get());
+        }
+        else
+        {
+            result.message = "Unsupported target for delete";
+            return false;
+        }
+        break;
+    }
+
+    if (deserializer_.NumMissingAttributes() != missingBefore)
+    {
+        result.message = "Unknown attribute";
+        return false;
+    }
+    return true;
+}
+
+void HttpSceneBatch::Snapshot(const ComponentPtr &component)
+{
+    if (snapshotted_.contains(component.get()))
+        return;
+    snapshotted_.insert(component.get());
+
+    ComponentSnapshot snapshot;
+    snapshot.component = component;
+    const AttributeVector &attributes = component->Attributes();
+    for(size_t i = 0; i < attributes.size(); ++i)
+    {
+        if (!attributes[i])
+            continue;
+        AttributeSnapshot value;
+        value.id = attributes[i]->Id();
+        for(size_t size = 256; size <= cMaxSnapshotBytes && value.binary.empty(); size *= 4)
+        {
+            std::vector<char> buffer(size);
+            try
+            {
+                kNet::DataSerializer dst(&buffer[0], buffer.size());
+                attributes[i]->ToBinary(dst);
+                buffer.resize(dst.BytesFilled());
+                value.binary.swap(buffer);
+            }
+            catch(const kNet::NetException &)
+            {
+            }
+        }
+        if (value.binary.empty())
+            value.text = attributes[i]->ToString();
+        snapshot.values.push_back(value);
+    }
+    snapshots_.push_back(snapshot);
+}
+
+void HttpSceneBatch::Commit()
+{
+    // Announce new entities and components the way Scene::CreateContentFromXml does
+    const std::vector<EntityWeakPtr> &entities = deserializer_.CreatedEntities();
+    for(size_t i = 0; i < entities.size(); ++i)
+    {
+        EntityPtr entity = entities[i].lock();
+        if (!entity)
+            continue;
+        scene_->EmitEntityCreated(entity.get(), AttributeChange::Default);
+        // A copy, as the slots may add or remove components
+        const Entity::ComponentMap components = entity->Components();
+        for(Entity::ComponentMap::const_iterator j = components.begin(); j != components.end(); ++j)
+            j->second->ComponentChanged(AttributeChange::Default);
+    }
+
+    const std::vector<ComponentWeakPtr> &components = deserializer_.CreatedComponents();
+    for(size_t i = 0; i < components.size(); ++i)
+    {
+        ComponentPtr comp = components[i].lock();
+        if (!comp || !comp->ParentEntity())
+            continue;
+        scene_->EmitComponentAdded(comp->ParentEntity(), comp.get(), AttributeChange::Default);
+        comp->ComponentChanged(AttributeChange::Default);
+    }
+
+    // Slots may remove components and entities, so each attribute is looked up again right before it is signaled
+    const std::vector<HttpAttributeRef> &createdAttributes = deserializer_.CreatedAttributes();
+    for(size_t i = 0; i < createdAttributes.size(); ++i)
+    {
+        IAttribute *attr = createdAttributes[i].Lookup();
+        if (attr)
+            scene_->EmitAttributeAdded(attr->Owner(), attr, AttributeChange::Default);
+    }
+
+    const std::vector<HttpAttributeRef> &attributes = deserializer_.ChangedAttributes();
+    for(size_t i = 0; i < attributes.size(); ++i)
+    {
+        IAttribute *attr = attributes[i].Lookup();
+        if (attr)
+            attr->Changed(AttributeChange::Default);
+    }
+
+    for(size_t i = 0; i < componentDeletions_.size(); ++i)
+    {
+        ComponentPtr comp = componentDeletions_[i].lock();
+        if (comp && comp->ParentEntity())
+            comp->ParentEntity()->RemoveComponent(comp, AttributeChange::Default);
+    }
+    for(size_t i = 0; i < entityDeletions_.size(); ++i)
+        scene_->RemoveEntity(entityDeletions_[i], AttributeChange::Default);
+}
+
+void HttpSceneBatch::Rollback()
+{
+    // Undo in reverse order; nothing here has been signaled
+    for(size_t i = snapshots_.size(); i-- > 0;)
+    {
+        ComponentPtr comp = snapshots_[i].component.lock();
+        if (!comp)
+            continue;
+
+        const QList<AttributeSnapshot> &values = snapshots_[i].values;
+        EC_DynamicComponent *dc = dynamic_cast<EC_DynamicComponent*>(comp.get());
+        if (dc)
+        {
+            QSet<QString> existed;
+            for(int j = 0; j < values.size(); ++j)
+                existed.insert(values[j].id);
+            const AttributeVector attributes = comp->Attributes();
+            for(size_t j = 0; j < attributes.size(); ++j)
+            {
+                if (attributes[j] && !existed.contains(attributes[j]->Id()))
+                    dc->RemoveAttribute(attributes[j]->Id(), AttributeChange::Disconnected);
+            }
+        }
+
+        for(int j = 0; j < values.size(); ++j)
+        {
+            IAttribute *attr = comp->AttributeById(values[j].id);
+            if (!attr)
+                continue;
+            if (values[j].binary.empty())
+                attr->FromString(values[j].text, AttributeChange::Disconnected);
+            else
+            {
+                kNet::DataDeserializer src(&values[j].binary[0], values[j].binary.size());
+                attr->FromBinary(src, AttributeChange::Disconnected);
+            }
+        }
+    }
+
+    const std::vector<ComponentWeakPtr> &components = deserializer_.CreatedComponents();
+    for(size_t i = components.size(); i-- > 0;)
+    {
+        ComponentPtr comp = components[i].lock();
+        if (comp && comp->ParentEntity())
+            comp->ParentEntity()->RemoveComponent(comp, AttributeChange::Disconnected);
+    }
+
+    const std::vector<EntityWeakPtr> &entities = deserializer_.CreatedEntities();
+    for(size_t i = entities.size(); i-- > 0;)
+    {
+        EntityPtr entity = entities[i].lock();
+        if (entity)
+            scene_->RemoveEntity(entity->Id(), AttributeChange::Disconnected);
+    }
+}
+
+QByteArray HttpSceneBatch::ResultStatus(const Result &result) const
+{
+    if (!result.ok)
+        return "error";
+    return committed_ ? "ok" : "rolledBack";
+}
+
+QByteArray HttpSceneBatch::SerializeResults(HttpServer::ContentFormat format) const
+{
+    QByteArray out;
+    if (format == HttpServer::JsonFormat)
+    {
+        SceneJsonWriter writer(out);
+        out += committed_ ? "{\"committed\":true,\"results\":[" : "{\"committed\":false,\"results\":[";
+        for(int i = 0; i < results_.size(); ++i)
+        {
+            if (i > 0)
+                out += ',';
+            out += "{\"index\":" + QByteArray::number(i) + ",\"action\":";
+            writer.WriteString(operations_[i].actionName);
+            out += ",\"target\":";
+            writer.WriteString(operations_[i].target);
+            const QByteArray status = ResultStatus(results_[i]);
+            out += status == "ok" ? ",\"ok\":true" : ",\"ok\":false";
+            out += ",\"status\":\"" + status + '"';
+            if (committed_ && results_[i].id)
+                out += ",\"id\":" + QByteArray::number(results_[i].id);
+            if (!results_[i].message.isEmpty())
+            {
+                out += ",\"message\":";
+                writer.WriteString(results_[i].message);
+            }
+            out += '}';
+        }
+        out += "]}";
+    }
+    else
+    {
+        QDomDocument doc("Batch");
+        QDomElement root = doc.createElement("batch");
+        root.setAttribute("committed", committed_ ? "true" : "false");
+        for(int i = 0; i < results_.size(); ++i)
+        {
+            QDomElement resultElem = doc.createElement("result");
+            resultElem.setAttribute("index", i);
+            resultElem.setAttribute("action", operations_[i].actionName);
+            resultElem.setAttribute("target", operations_[i].target);
+            resultElem.setAttribute("status", QString(ResultStatus(results_[i])));
+            if (committed_ && results_[i].id)
+                resultElem.setAttribute("id", results_[i].id);
+            if (!results_[i].message.isEmpty())
+                resultElem.setAttribute("message", results_[i].message);
+            root.appendChild(resultElem);
+        }
+        doc.appendChild(root);
+        out = doc.toByteArray();
+    }
+    return out;
+}
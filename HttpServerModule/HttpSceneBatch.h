@@ -0,0 +1,116 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+#include "HttpSceneData.h"
+#include "HttpSceneDeserializer.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVariant>
+
+#include <vector>
+
+/// Ordered list of create, update and delete operations applied to a scene as one transaction (POST /scene/batch).
+/** Creations and updates are applied with AttributeChange::Disconnected and deletions are postponed, so that
+    nothing is signaled or replicated before every operation has succeeded. The changes are then announced at
+    once; if any operation fails, everything already applied is undone instead.
+
+    Operations target the same paths as the REST routes:
+    create /entities, /entities/<id> (entity body) or /entities/<id>/<component> (component body),
+    update /entities/<id>/<component> (attributes) or /entities/<id>/<component>/<attribute> (value),
+    delete /entities/<id> or /entities/<id>/<component>.
+
+    XML:  <batch><operation action="update" target="/entities/1/EC_Name/name" value="x"/>...</batch>
+    JSON: {"operations":[{"action":"update","target":"/entities/1/EC_Name/name","value":"x"},...]} */
+class HTTP_SERVER_MODULE_API HttpSceneBatch
+{
+public:
+    HttpSceneBatch(Framework *framework, Scene *scene);
+
+    /// Parses the operations. Returns false and an error message in error if the document is malformed.
+    bool Parse(const QByteArray &body, bool json, QString &error);
+
+    /// Applies all operations. Returns true if the batch was committed, false if it was rolled back.
+    bool Execute();
+
+    /// Returns the per-operation results in the given format.
+    /** Each result has a status: "ok", "error", or "rolledBack" for an operation that succeeded but was undone
+        because another one failed. Entity ids are only reported when the batch was committed. */
+    QByteArray SerializeResults(HttpServer::ContentFormat format) const;
+
+private:
+    enum Action
+    {
+        CreateAction,
+        UpdateAction,
+        DeleteAction
+    };
+
+    struct Operation
+    {
+        Action action;
+        QString actionName;
+        QString target;
+        QStringList targetParts;
+        HttpEntityData entity;
+        HttpComponentData component;
+        QVariant value;
+    };
+
+    struct Result
+    {
+        Result() : ok(false), id(0) {}
+
+        bool ok;
+        entity_id_t id;
+        QString message;
+    };
+
+    /// Value of an attribute before the batch first changed it, in the attribute's binary form so that it is restored
+    /// exactly. The string form is only kept when the value could not be serialized.
+    struct AttributeSnapshot
+    {
+        QString id;
+        std::vector<char> binary;
+        QString text;
+    };
+
+    /// Attribute values of a component before the batch first changed it
+    struct ComponentSnapshot
+    {
+        ComponentWeakPtr component;
+        QList<AttributeSnapshot> values;
+    };
+
+    bool ParseOperation(const QString &action, const QString &target, Operation &op, QString &error);
+    bool Apply(const Operation &op, Result &result);
+    EntityPtr TargetEntity(const Operation &op, Result &result);
+    ComponentPtr TargetComponent(const Operation &op, Result &result);
+    /// Returns the first component of the given type in the entity that is not pending deletion.
+    ComponentPtr LiveComponent(const EntityPtr &entity, const QString &typeName) const;
+    void Snapshot(const ComponentPtr &component);
+    void Commit();
+    void Rollback();
+    /// Returns "ok", "error" or "rolledBack" for an operation that succeeded but was undone.
+    QByteArray ResultStatus(const Result &result) const;
+
+    Framework *framework_;
+    Scene *scene_;
+    HttpSceneDeserializer deserializer_;
+    QList<Operation> operations_;
+    QList<Result> results_;
+    bool committed_;
+
+    std::vector<ComponentSnapshot> snapshots_;
+    QSet<IComponent*> snapshotted_;
+    std::vector<entity_id_t> entityDeletions_;
+    QSet<entity_id_t> deletedEntities_;
+    std::vector<ComponentWeakPtr> componentDeletions_;
+    QSet<IComponent*> deletedComponents_;
+};
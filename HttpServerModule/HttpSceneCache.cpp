@@ -0,0 +1,230 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSceneCache.h"
+
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "LoggingFunctions.h"
+
+#include <QDateTime>
+
+namespace
+{
+
+/// Ends an ETag with a letter for the format, so that the representations of the same version differ.
+const char *FormatSuffix(HttpServer::ContentFormat format)
+{
+    switch(format)
+    {
+    case HttpServer::JsonFormat: return "j\"";
+    case HttpServer::BinaryFormat: return "b\"";
+    default: return "x\"";
+    }
+}
+
+}
+
+const HttpServer::ReplyBuffer &HttpCachedReply::Encoded(HttpCompression::Encoding encoding) const
+{
+    switch(encoding)
+    {
+    case HttpCompression::Gzip: return gzipBody;
+    case HttpCompression::Deflate: return deflateBody;
+    default: return body;
+    }
+}
+
+HttpSceneCache::HttpSceneCache(uint maxEntries) :
+    sceneVersion_(1),
+    baseVersion_(1),
+    maxEntries_(maxEntries),
+    hits_(0),
+    misses_(0)
+{
+    // Distinguishes the ETags of this server run from earlier ones
+    epoch_ = QByteArray::number(QDateTime::currentDateTime().toTime_t(), 36);
+}
+
+void HttpSceneCache::SetScene(Scene *scene)
+{
+    if (scene == scene_)
+        return;
+
+    if (scene_)
+        disconnect(scene_, 0, this, 0);
+
+    scene_ = scene;
+    Clear();
+    entityVersions_.clear();
+    parents_.clear();
+    baseVersion_ = ++sceneVersion_;
+
+    if (scene)
+    {
+        const Scene::EntityMap &entities = scene->Entities();
+        for(Scene::EntityMap::const_iterator i = entities.begin(); i != entities.end(); ++i)
+        {
+            EntityPtr parent = i->second->Parent();
+            if (parent)
+                parents_.insert(i->first, parent->Id());
+        }
+
+        connect(scene, SIGNAL(AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeAdded(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentAdded(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentChanged(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentRemoved(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentChanged(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityCreated(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityCreated(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityRemoved(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityRemoved(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityParentChanged(Entity*, Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityParentChanged(Entity*, Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(SceneCleared(Scene*)), this, SLOT(OnSceneCleared()));
+    }
+}
+
+u64 HttpSceneCache::EntityVersion(entity_id_t id) const
+{
+    return entityVersions_.value(id, baseVersion_);
+}
+
+QByteArray HttpSceneCache::SceneETag(HttpServer::ContentFormat format) const
+{
+    return '"' + epoch_ + "-s" + QByteArray::number(sceneVersion_) + FormatSuffix(format);
+}
+
+QByteArray HttpSceneCache::EntityETag(entity_id_t id, HttpServer::ContentFormat format) const
+{
+    return '"' + epoch_ + "-e" + QByteArray::number(EntityVersion(id)) + FormatSuffix(format);
+}
+
+bool HttpSceneCache::Find(const QString &key, const QByteArray &etag, HttpCachedReply &reply)
+{
+    QHash<QString, Entry>::iterator i = entries_.find(key);
+    if (i == entries_.end() || i->reply.etag != etag)
+    {
+        ++misses_;
+        return false;
+    }
+
+    // Move to the most recently used end
+    lru_.splice(lru_.end(), lru_, i->lruPosition);
+    reply = i->reply;
+    ++hits_;
+    return true;
+}
+
+void HttpSceneCache::Insert(const QString &key, const HttpCachedReply &reply)
+{
+    if (maxEntries_ == 0)
+        return;
+
+    QHash<QString, Entry>::iterator i = entries_.find(key);
+    if (i != entries_.end())
+    {
+        i->reply = reply;
+        lru_.splice(lru_.end(), lru_, i->lruPosition);
+        return;
+    }
+
+    while((uint)entries_.size() >= maxEntries_ && !lru_.empty())
+    {
+        entries_.remove(lru_.front());
+        lru_.pop_front();
+    }
+
+    Entry entry;
+    entry.reply = reply;
+    entry.lruPosition = lru_.insert(lru_.end(), key);
+    entries_.insert(key, entry);
+}
+
+void HttpSceneCache::InsertCompressed(const QString &key, const QByteArray &etag, HttpCompression::Encoding encoding, const HttpServer::ReplyBuffer &body)
+{
+    QHash<QString, Entry>::iterator i = entries_.find(key);
+    if (i == entries_.end() || i->reply.etag != etag)
+        return;
+    if (encoding == HttpCompression::Gzip)
+        i->reply.gzipBody = body;
+    else if (encoding == HttpCompression::Deflate)
+        i->reply.deflateBody = body;
+}
+
+void HttpSceneCache::Clear()
+{
+    entries_.clear();
+    lru_.clear();
+}
+
+void HttpSceneCache::Touch(Entity *entity)
+{
+    ++sceneVersion_;
+    while(entity)
+    {
+        entityVersions_[entity->Id()] = sceneVersion_;
+        entity = entity->Parent().get();
+    }
+}
+
+void HttpSceneCache::Stamp(entity_id_t id)
+{
+    // The recorded parents are followed, as the entities themselves may be gone. Each is stamped once, in case the
+    // records are out of date and form a cycle.
+    while(id && entityVersions_.value(id) != sceneVersion_)
+    {
+        entityVersions_[id] = sceneVersion_;
+        id = parents_.value(id, 0);
+    }
+}
+
+void HttpSceneCache::OnAttributeChanged(IComponent *comp, IAttribute * /*attribute*/, AttributeChange::Type /*change*/)
+{
+    Touch(comp->ParentEntity());
+}
+
+void HttpSceneCache::OnComponentChanged(Entity *entity, IComponent * /*comp*/, AttributeChange::Type /*change*/)
+{
+    Touch(entity);
+}
+
+void HttpSceneCache::OnEntityCreated(Entity *entity, AttributeChange::Type /*change*/)
+{
+    EntityPtr parent = entity->Parent();
+    if (parent)
+        parents_.insert(entity->Id(), parent->Id());
+    Touch(entity);
+}
+
+void HttpSceneCache::OnEntityRemoved(Entity *entity, AttributeChange::Type /*change*/)
+{
+    // The version is kept, so that an entity created later with the same id gets a newer ETag than this one had
+    Touch(entity);
+    parents_.remove(entity->Id());
+}
+
+void HttpSceneCache::OnEntityParentChanged(Entity *entity, Entity *newParent, AttributeChange::Type /*change*/)
+{
+    // The old ancestors lose a descendant and the new ones gain it
+    const entity_id_t oldParentId = parents_.value(entity->Id(), 0);
+    Touch(entity);
+    Stamp(oldParentId);
+    if (newParent)
+        parents_.insert(entity->Id(), newParent->Id());
+    else
+        parents_.remove(entity->Id());
+}
+
+void HttpSceneCache::OnSceneCleared()
+{
+    Clear();
+    entityVersions_.clear();
+    parents_.clear();
+    baseVersion_ = ++sceneVersion_;
+}
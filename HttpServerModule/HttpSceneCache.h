@@ -0,0 +1,115 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+#include "HttpCompression.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#include <list>
+
+class IAttribute;
+
+/// Serialized reply stored in HttpSceneCache.
+struct HTTP_SERVER_MODULE_API HttpCachedReply
+{
+    QByteArray etag;
+    QByteArray contentType;
+    /// Body in the form it is sent, so that a cache hit is not copied before websocketpp copies it
+    HttpServer::ReplyBuffer body;
+    /// Compressed variants of the body, null until first requested
+    HttpServer::ReplyBuffer gzipBody;
+    HttpServer::ReplyBuffer deflateBody;
+
+    /// Returns the compressed variant for an encoding, or the body for Identity.
+    const HttpServer::ReplyBuffer &Encoded(HttpCompression::Encoding encoding) const;
+};
+
+/// Versioned serialization cache of the active scene for the SceneAPI REST routes.
+/** Every change signaled by the scene increments a version counter, and the changed entity and its
+    ancestors are stamped with the new version. An entity that moves to another parent stamps both its old and
+    its new ancestors. ETags are derived from these versions, so an unchanged
+    resource keeps its ETag and its cached serialization stays valid. Changes made with
+    AttributeChange::Disconnected are not signaled and therefore not seen. */
+class HTTP_SERVER_MODULE_API HttpSceneCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// @param maxEntries Maximum number of cached replies; the least recently used are evicted first.
+    explicit HttpSceneCache(uint maxEntries);
+
+    /// Starts tracking the given scene if it is not already tracked. Switching scenes clears the cache.
+    void SetScene(Scene *scene);
+    Scene *TrackedScene() const { return scene_; }
+
+    /// Version of the whole scene; changes whenever anything in the scene changes.
+    u64 SceneVersion() const { return sceneVersion_; }
+    /// Version of an entity; changes whenever the entity or any of its descendants changes.
+    u64 EntityVersion(entity_id_t id) const;
+
+    /// Returns a quoted ETag for the whole scene in the given format.
+    QByteArray SceneETag(HttpServer::ContentFormat format) const;
+    /// Returns a quoted ETag for an entity, or anything inside it, in the given format.
+    QByteArray EntityETag(entity_id_t id, HttpServer::ContentFormat format) const;
+
+    /// Returns the cached reply for key if its ETag equals etag.
+    bool Find(const QString &key, const QByteArray &etag, HttpCachedReply &reply);
+    /// Stores a reply under key, replacing any previous one.
+    void Insert(const QString &key, const HttpCachedReply &reply);
+    /// Stores a compressed variant of the reply under key, provided the reply still has the given ETag.
+    void InsertCompressed(const QString &key, const QByteArray &etag, HttpCompression::Encoding encoding, const HttpServer::ReplyBuffer &body);
+    /// Removes all cached replies.
+    void Clear();
+
+    uint Hits() const { return hits_; }
+    uint Misses() const { return misses_; }
+    int NumEntries() const { return entries_.size(); }
+
+private slots:
+    void OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnComponentChanged(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnEntityCreated(Entity *entity, AttributeChange::Type change);
+    void OnEntityRemoved(Entity *entity, AttributeChange::Type change);
+    void OnEntityParentChanged(Entity *entity, Entity *newParent, AttributeChange::Type change);
+    void OnSceneCleared();
+
+private:
+    /// Stamps the entity and its ancestors with a new version.
+    void Touch(Entity *entity);
+    /// Stamps an entity, known by id as it may already be gone, and its ancestors with the current version.
+    void Stamp(entity_id_t id);
+
+    struct Entry
+    {
+        HttpCachedReply reply;
+        std::list<QString>::iterator lruPosition;
+    };
+
+    QPointer<Scene> scene_;
+    QByteArray epoch_;
+    u64 sceneVersion_;
+    /// Version given to entities that have not changed since the scene started being tracked
+    u64 baseVersion_;
+    /// Versions of the entities changed since the scene started being tracked, including removed ones, so that a
+    /// re-created entity does not fall back to the ETag that it had before it was first changed.
+    QHash<entity_id_t, u64> entityVersions_;
+    /// Parent of each child entity as last seen, for stamping the old ancestors when an entity is re-parented
+    QHash<entity_id_t, entity_id_t> parents_;
+
+    uint maxEntries_;
+    QHash<QString, Entry> entries_;
+    /// Cache keys from the least to the most recently used
+    std::list<QString> lru_;
+
+    uint hits_;
+    uint misses_;
+};
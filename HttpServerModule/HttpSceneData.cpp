@@ -0,0 +1,310 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSceneData.h"
+
+#include "CoreJsonUtils.h"
+#include "CoreStringUtils.h"
+
+#include <QByteArray>
+#include <QStringList>
+#include <QVariantMap>
+#include <QVariantList>
+#include <QDomDocument>
+
+QString HttpAttributeData::ValueString() const
+{
+    switch(value.type())
+    {
+    case QVariant::List:
+    {
+        // Vector types as JSON arrays, eg. [1,2,3]
+        QStringList parts;
+        const QVariantList list = value.toList();
+        for(int i = 0; i < list.size(); ++i)
+            parts << list[i].toString();
+        return parts.join(",");
+    }
+    case QVariant::Bool:
+        return value.toBool() ? "true" : "false";
+    default:
+        return value.toString();
+    }
+}
+
+HttpFieldSelection HttpFieldSelection::Parse(const QString &fields)
+{
+    HttpFieldSelection selection;
+    const QStringList items = fields.split(',', QString::SkipEmptyParts);
+    for(int i = 0; i < items.size(); ++i)
+    {
+        const QString item = items[i].trimmed();
+        const int dot = item.indexOf('.');
+        if (dot < 0)
+        {
+            // The whole component, even if some of its attributes were listed too
+            selection.components[item].clear();
+            selection.components[item].insert(QString());
+        }
+        else
+            selection.components[item.left(dot)].insert(item.mid(dot + 1));
+    }
+    return selection;
+}
+
+bool HttpFieldSelection::SelectsAttribute(const QString &typeName, const QString &id, const QString &name) const
+{
+    if (IsEmpty())
+        return true;
+    QHash<QString, QSet<QString> >::const_iterator i = components.find(typeName);
+    if (i == components.end())
+        return false;
+    return i->contains(QString()) || i->contains(id) || i->contains(name);
+}
+
+namespace
+{
+
+bool JsonBool(const QVariant &value, bool defaultValue)
+{
+    if (!value.isValid())
+        return defaultValue;
+    if (value.type() == QVariant::Bool)
+        return value.toBool();
+    return ParseBool(value.toString(), defaultValue);
+}
+
+}
+
+namespace HttpSceneParser
+{
+
+void ParseEntity(const QDomElement &element, HttpEntityData &entity)
+{
+    /// \todo Partially duplicate code from Scene
+    QString idStr = element.attribute("id");
+    entity.id = !idStr.isEmpty() ? static_cast<entity_id_t>(idStr.toInt()) : 0;
+    entity.sync = ParseBool(element.attribute("sync"), true);
+    entity.temporary = ParseBool(element.attribute("temporary"), false);
+
+    QDomElement compElem = element.firstChildElement("component");
+    while(!compElem.isNull())
+    {
+        entity.components.push_back(HttpComponentData());
+        ParseComponent(compElem, entity.components.back());
+        compElem = compElem.nextSiblingElement("component");
+    }
+
+    QDomElement childElem = element.firstChildElement("entity");
+    while(!childElem.isNull())
+    {
+        entity.children.push_back(HttpEntityData());
+        ParseEntity(childElem, entity.children.back());
+        childElem = childElem.nextSiblingElement("entity");
+    }
+}
+
+void ParseEntity(const QVariantMap &object, HttpEntityData &entity)
+{
+    entity.id = object.value("id").toUInt();
+    entity.sync = JsonBool(object.value("sync"), true);
+    entity.temporary = JsonBool(object.value("temporary"), false);
+
+    const QVariantList components = object.value("components").toList();
+    for(int i = 0; i < components.size(); ++i)
+    {
+        entity.components.push_back(HttpComponentData());
+        ParseComponent(components[i].toMap(), entity.components.back());
+    }
+
+    const QVariantList children = object.value("children").toList();
+    for(int i = 0; i < children.size(); ++i)
+    {
+        entity.children.push_back(HttpEntityData());
+        ParseEntity(children[i].toMap(), entity.children.back());
+    }
+}
+
+void ParseComponent(const QDomElement &element, HttpComponentData &component)
+{
+    component.element = element;
+    component.typeName = element.attribute("type");
+    component.typeId = ParseUInt(element.attribute("typeId"), 0xffffffff);
+    component.name = element.attribute("name");
+    component.sync = ParseBool(element.attribute("sync"), true);
+    component.temporary = ParseBool(element.attribute("temporary"), false);
+
+    QDomElement attrElem = element.firstChildElement("attribute");
+    while(!attrElem.isNull())
+    {
+        HttpAttributeData attr;
+        attr.id = attrElem.attribute("id");
+        attr.name = attrElem.attribute("name");
+        attr.typeName = attrElem.attribute("type");
+        attr.value = attrElem.attribute("value");
+        component.attributes.push_back(attr);
+        attrElem = attrElem.nextSiblingElement("attribute");
+    }
+}
+
+void ParseComponent(const QVariantMap &object, HttpComponentData &component)
+{
+    component.typeName = object.value("type").toString();
+    bool ok = false;
+    component.typeId = object.value("typeId").toUInt(&ok);
+    if (!ok)
+        component.typeId = 0xffffffff;
+    component.name = object.value("name").toString();
+    component.sync = JsonBool(object.value("sync"), true);
+    component.temporary = JsonBool(object.value("temporary"), false);
+    ParseAttributes(object.value("attributes"), component.attributes);
+}
+
+void ParseAttributes(const QVariant &attributes, QList<HttpAttributeData> &dest)
+{
+    if (attributes.type() == QVariant::Map)
+    {
+        // Short form: { "idOrName" : value, ... }
+        const QVariantMap map = attributes.toMap();
+        for(QVariantMap::const_iterator i = map.begin(); i != map.end(); ++i)
+        {
+            HttpAttributeData attr;
+            attr.id = i.key();
+            attr.value = i.value();
+            dest.push_back(attr);
+        }
+    }
+    else
+    {
+        const QVariantList list = attributes.toList();
+        for(int i = 0; i < list.size(); ++i)
+        {
+            const QVariantMap object = list[i].toMap();
+            HttpAttributeData attr;
+            attr.id = object.value("id").toString();
+            attr.name = object.value("name").toString();
+            attr.typeName = object.value("type").toString();
+            attr.value = object.value("value");
+            dest.push_back(attr);
+        }
+    }
+}
+
+bool ParseEntityDocument(const QByteArray &body, bool json, HttpEntityData &entity, QString &error)
+{
+    if (body.isEmpty())
+        return true;
+
+    if (json)
+    {
+        bool ok = false;
+        QVariant root = TundraJson::Parse(body, &ok);
+        if (!ok || root.type() != QVariant::Map)
+        {
+            error = "JSON decode error: expected an entity object";
+            return false;
+        }
+        ParseEntity(root.toMap(), entity);
+        return true;
+    }
+
+    QDomDocument entDoc("Entity");
+    QString errorMsg;
+    int errorLine, errorColumn;
+    if (!entDoc.setContent(body, &errorMsg, &errorLine, &errorColumn))
+    {
+        error = "XML decode error " + errorMsg + " at line " + QString::number(errorLine);
+        return false;
+    }
+    QDomElement root = entDoc.firstChildElement("entity");
+    if (root.isNull())
+    {
+        error = "XML decode error: expected an entity element";
+        return false;
+    }
+    ParseEntity(root, entity);
+    return true;
+}
+
+bool ParseEntityListDocument(const QByteArray &body, bool json, QList<HttpEntityData> &entities, QString &error)
+{
+    if (json)
+    {
+        bool ok = false;
+        QVariant root = TundraJson::Parse(body, &ok);
+        if (ok && root.type() == QVariant::Map)
+            root = root.toMap().value("entities");
+        if (!ok || root.type() != QVariant::List)
+        {
+            error = "JSON decode error: expected an array of entities";
+            return false;
+        }
+        const QVariantList list = root.toList();
+        for(int i = 0; i < list.size(); ++i)
+        {
+            entities.push_back(HttpEntityData());
+            ParseEntity(list[i].toMap(), entities.back());
+        }
+        return true;
+    }
+
+    QDomDocument sceneDoc("Scene");
+    QString errorMsg;
+    int errorLine, errorColumn;
+    if (!sceneDoc.setContent(body, &errorMsg, &errorLine, &errorColumn))
+    {
+        error = "XML decode error " + errorMsg + " at line " + QString::number(errorLine);
+        return false;
+    }
+    QDomElement root = sceneDoc.firstChildElement("scene");
+    if (root.isNull())
+    {
+        error = "XML decode error: expected a scene element";
+        return false;
+    }
+    QDomElement entElem = root.firstChildElement("entity");
+    while(!entElem.isNull())
+    {
+        entities.push_back(HttpEntityData());
+        ParseEntity(entElem, entities.back());
+        entElem = entElem.nextSiblingElement("entity");
+    }
+    return true;
+}
+
+bool ParseComponentDocument(const QByteArray &body, bool json, HttpComponentData &component, QString &error)
+{
+    if (body.isEmpty())
+        return true;
+
+    if (json)
+    {
+        bool ok = false;
+        QVariant root = TundraJson::Parse(body, &ok);
+        if (!ok || root.type() != QVariant::Map)
+        {
+            error = "JSON decode error: expected a component object";
+            return false;
+        }
+        ParseComponent(root.toMap(), component);
+        return true;
+    }
+
+    QDomDocument compDoc("Component");
+    QString errorMsg;
+    int errorLine, errorColumn;
+    if (!compDoc.setContent(body, &errorMsg, &errorLine, &errorColumn))
+    {
+        error = "XML decode error " + errorMsg + " at line " + QString::number(errorLine);
+        return false;
+    }
+    QDomElement root = compDoc.firstChildElement("component");
+    if (root.isNull())
+    {
+        error = "XML decode error: expected a component element";
+        return false;
+    }
+    ParseComponent(root, component);
+    return true;
+}
+
+}
@@ -0,0 +1,99 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "CoreTypes.h"
+
+#include <QString>
+#include <QVariant>
+#include <QList>
+#include <QHash>
+#include <QSet>
+#include <QDomElement>
+
+class QByteArray;
+
+/// Attribute value received in a SceneAPI REST request.
+struct HTTP_SERVER_MODULE_API HttpAttributeData
+{
+    QString id;
+    QString name;
+    /// Type name, only needed when the attribute is created to a dynamic component
+    QString typeName;
+    /// Value as a string (XML) or as a JSON value
+    QVariant value;
+
+    /// Returns the id if given, otherwise the name.
+    const QString &IdOrName() const { return id.isEmpty() ? name : id; }
+    /// Returns the value in the string form accepted by IAttribute::FromString.
+    QString ValueString() const;
+};
+
+/// Component received in a SceneAPI REST request.
+struct HTTP_SERVER_MODULE_API HttpComponentData
+{
+    HttpComponentData() : typeId(0xffffffff), sync(true), temporary(false) {}
+
+    QString typeName;
+    u32 typeId;
+    QString name;
+    bool sync;
+    bool temporary;
+    QList<HttpAttributeData> attributes;
+    /// Source element when parsed from XML. Used to register placeholder component types.
+    QDomElement element;
+};
+
+/// Entity received in a SceneAPI REST request.
+struct HTTP_SERVER_MODULE_API HttpEntityData
+{
+    HttpEntityData() : id(0), sync(true), temporary(false) {}
+
+    entity_id_t id;
+    bool sync;
+    bool temporary;
+    QList<HttpComponentData> components;
+    QList<HttpEntityData> children;
+};
+
+/// Components and attributes to include in a reply, from the fields= query item.
+/** The item is a comma-separated list of component type names, each optionally followed by a dot and an
+    attribute id or name, for example fields=EC_Name,EC_Placeable.transform. A component listed without an
+    attribute is written whole. An empty selection selects everything. */
+struct HTTP_SERVER_MODULE_API HttpFieldSelection
+{
+    /// Parses the value of the fields= query item.
+    static HttpFieldSelection Parse(const QString &fields);
+
+    bool IsEmpty() const { return components.isEmpty(); }
+    bool SelectsComponent(const QString &typeName) const { return IsEmpty() || components.contains(typeName); }
+    bool SelectsAttribute(const QString &typeName, const QString &id, const QString &name) const;
+
+    /// Selected attribute ids or names by component type name; an empty string in the set selects all attributes
+    QHash<QString, QSet<QString> > components;
+};
+
+/// Parsing of SceneAPI REST request bodies into format independent data.
+/** XML bodies use the TXML element layout. JSON bodies use the layout written by SceneJsonWriter,
+    except that a component's attributes may also be given as an object of id or name to value pairs. */
+namespace HttpSceneParser
+{
+    HTTP_SERVER_MODULE_API void ParseEntity(const QDomElement &element, HttpEntityData &entity);
+    HTTP_SERVER_MODULE_API void ParseEntity(const QVariantMap &object, HttpEntityData &entity);
+    HTTP_SERVER_MODULE_API void ParseComponent(const QDomElement &element, HttpComponentData &component);
+    HTTP_SERVER_MODULE_API void ParseComponent(const QVariantMap &object, HttpComponentData &component);
+    HTTP_SERVER_MODULE_API void ParseAttributes(const QVariant &attributes, QList<HttpAttributeData> &dest);
+
+    /// Parses an entity document. An empty body produces an empty entity.
+    /** @return False and an error message in error if the document is malformed, or if its root is not an entity
+        element or JSON object. */
+    HTTP_SERVER_MODULE_API bool ParseEntityDocument(const QByteArray &body, bool json, HttpEntityData &entity, QString &error);
+    /// Parses a list of entities: a JSON array or an object with an "entities" array, or a TXML scene element.
+    /** @return False and an error message in error if the document is malformed. */
+    HTTP_SERVER_MODULE_API bool ParseEntityListDocument(const QByteArray &body, bool json, QList<HttpEntityData> &entities, QString &error);
+    /// Parses a component document. An empty body produces an empty component.
+    /** @return False and an error message in error if the document is malformed, or if its root is not a component
+        element or JSON object. */
+    HTTP_SERVER_MODULE_API bool ParseComponentDocument(const QByteArray &body, bool json, HttpComponentData &component, QString &error);
+}
@@ -0,0 +1,371 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSceneDeserializer.h"
+#include "HttpSceneData.h"
+#include "HttpEntityIdBlocks.h"
+
+#include "Framework.h"
+#include "LoggingFunctions.h"
+#include "SceneAPI.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+#include "EC_DynamicComponent.h"
+#include "Transform.h"
+#include "Math/float2.h"
+#include "Math/float3.h"
+#include "Math/float4.h"
+
+#include <QStringList>
+#include <QVariantList>
+#include <QHash>
+
+namespace
+{
+
+/// Indexes of the attributes of a component type in IComponent::Attributes(), by id and by name.
+struct AttributeIndexes
+{
+    QHash<QString, int> byId;
+    QHash<QString, int> byName;
+};
+
+/// Attribute indexes by component type id, shared by all deserializers. Built on first use of each type.
+/// Dynamic components are left out, as their attributes differ from one component to another.
+/// Main thread only, like the scenes the deserializers apply to; it is not locked.
+QHash<u32, AttributeIndexes> attributeIndexes;
+
+const AttributeIndexes &IndexesOf(IComponent *component)
+{
+    QHash<u32, AttributeIndexes>::const_iterator i = attributeIndexes.find(component->TypeId());
+    if (i != attributeIndexes.end())
+        return *i;
+
+    AttributeIndexes indexes;
+    const AttributeVector &attributes = component->Attributes();
+    for(size_t j = 0; j < attributes.size(); ++j)
+    {
+        if (!attributes[j])
+            continue;
+        indexes.byId.insert(attributes[j]->Id(), (int)j);
+        indexes.byName.insert(attributes[j]->Name(), (int)j);
+    }
+    return *attributeIndexes.insert(component->TypeId(), indexes);
+}
+
+/// Returns the attribute at the index cached for the key, if the component's attribute there still has that id or name.
+/// Placeholder components of the same type may have their attributes in a different order, which this catches.
+IAttribute *CachedAttribute(IComponent *component, const QHash<QString, int> &indexes, const QString &key, bool byId)
+{
+    QHash<QString, int>::const_iterator i = indexes.find(key);
+    if (i == indexes.end())
+        return 0;
+    const AttributeVector &attributes = component->Attributes();
+    IAttribute *attr = *i < (int)attributes.size() ? attributes[*i] : 0;
+    return attr && (byId ? attr->Id() : attr->Name()) == key ? attr : 0;
+}
+
+IAttribute *AttributeById(IComponent *component, const QString &id)
+{
+    IAttribute *attr = 0;
+    if (component->TypeId() != EC_DynamicComponent::TypeIdStatic())
+        attr = CachedAttribute(component, IndexesOf(component).byId, id, true);
+    // Ids that differ in case, or that the type does not have, are looked for the slow way
+    return attr ? attr : component->AttributeById(id);
+}
+
+IAttribute *AttributeByName(IComponent *component, const QString &name)
+{
+    IAttribute *attr = 0;
+    if (component->TypeId() != EC_DynamicComponent::TypeIdStatic())
+        attr = CachedAttribute(component, IndexesOf(component).byName, name, false);
+    return attr ? attr : component->AttributeByName(name);
+}
+
+bool IsNumber(const QVariant &value)
+{
+    switch(value.type())
+    {
+    case QVariant::Double:
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// Reads a JSON array of exactly count numbers.
+bool ToFloats(const QVariant &value, float *out, int count)
+{
+    if (value.type() != QVariant::List)
+        return false;
+    const QVariantList list = value.toList();
+    if (list.size() != count)
+        return false;
+    for(int i = 0; i < count; ++i)
+    {
+        if (!IsNumber(list[i]))
+            return false;
+        out[i] = list[i].toFloat();
+    }
+    return true;
+}
+
+/// Sets a JSON number, boolean, string or array of numbers to an attribute of a matching type, without formatting
+/// it as a string for IAttribute::FromString to parse. Returns false if the value needs to go through its string form.
+bool SetTypedValue(IAttribute *attr, const QVariant &value, AttributeChange::Type change)
+{
+    float f[9];
+    switch(attr->TypeId())
+    {
+    case cAttributeReal:
+        if (!IsNumber(value))
+            return false;
+        static_cast<Attribute<float>*>(attr)->Set(value.toFloat(), change);
+        return true;
+    case cAttributeInt:
+        if (!IsNumber(value))
+            return false;
+        static_cast<Attribute<int>*>(attr)->Set(value.toInt(), change);
+        return true;
+    case cAttributeUInt:
+        if (!IsNumber(value))
+            return false;
+        static_cast<Attribute<uint>*>(attr)->Set(value.toUInt(), change);
+        return true;
+    case cAttributeBool:
+        if (value.type() != QVariant::Bool)
+            return false;
+        static_cast<Attribute<bool>*>(attr)->Set(value.toBool(), change);
+        return true;
+    case cAttributeString:
+        if (value.type() != QVariant::String)
+            return false;
+        static_cast<Attribute<QString>*>(attr)->Set(value.toString(), change);
+        return true;
+    case cAttributeFloat2:
+        if (!ToFloats(value, f, 2))
+            return false;
+        static_cast<Attribute<float2>*>(attr)->Set(float2(f[0], f[1]), change);
+        return true;
+    case cAttributeFloat3:
+        if (!ToFloats(value, f, 3))
+            return false;
+        static_cast<Attribute<float3>*>(attr)->Set(float3(f[0], f[1], f[2]), change);
+        return true;
+    case cAttributeFloat4:
+        if (!ToFloats(value, f, 4))
+            return false;
+        static_cast<Attribute<float4>*>(attr)->Set(float4(f[0], f[1], f[2], f[3]), change);
+        return true;
+    case cAttributeTransform:
+        // Position, rotation and scale, in the order of the string form
+        if (!ToFloats(value, f, 9))
+            return false;
+        static_cast<Attribute<Transform>*>(attr)->Set(Transform(float3(f[0], f[1], f[2]), float3(f[3], f[4], f[5]), float3(f[6], f[7], f[8])), change);
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+HttpSceneDeserializer::HttpSceneDeserializer(Framework *framework, Scene *scene, AttributeChange::Type change) :
+    framework_(framework),
+    scene_(scene),
+    change_(change),
+    idBlock_(0),
+    numMissingAttributes_(0)
+{
+}
+
+EntityPtr HttpSceneDeserializer::CreateEntity(EntityPtr parent, const HttpEntityData &data)
+{
+    /// \todo Partially duplicate code from Scene
+    entity_id_t id = data.id;
+    if (idBlock_)
+    {
+        // Ids in the data are ignored; the block decides whether the entity is local
+        id = idBlock_->Take(scene_);
+        if (!id)
+            return EntityPtr();
+    }
+    else if (id == 0 || scene_->HasEntity(id))
+        id = data.sync ? scene_->NextFreeId() : scene_->NextFreeIdLocal();
+
+    EntityPtr entity;
+    if (!parent)
+        entity = scene_->CreateEntity(id, QStringList(), change_);
+    else
+        entity = parent->CreateChild(id, QStringList(), change_);
+
+    if (entity)
+    {
+        createdEntities_.push_back(entity);
+        newEntities_.insert(entity.get());
+        entity->SetTemporary(data.temporary);
+        CreateComponentsToEntity(entity, data.components);
+
+        for(int i = 0; i < data.children.size(); ++i)
+            CreateEntity(entity, data.children[i]);
+    }
+    return entity;
+}
+
+EntityPtr HttpSceneDeserializer::CreateEntity(entity_id_t id, const HttpEntityData &data)
+{
+    EntityPtr entity = scene_->CreateEntity(id, QStringList(), change_);
+    if (entity)
+    {
+        createdEntities_.push_back(entity);
+        newEntities_.insert(entity.get());
+        entity->SetTemporary(data.temporary);
+        CreateComponentsToEntity(entity, data.components);
+    }
+    return entity;
+}
+
+void HttpSceneDeserializer::CreateComponentsToEntity(EntityPtr entity, const QList<HttpComponentData> &components)
+{
+    /// \todo Duplicate code from Scene
+    SceneAPI* sceneAPI = framework_->Scene();
+    for(int i = 0; i < components.size(); ++i)
+    {
+        const HttpComponentData &compData = components[i];
+        QDomElement compElem = compData.element;
+
+        // If we encounter an unknown component type, now is the time to register a placeholder type for it
+        // The XML holds all needed data for it, while binary and JSON don't
+        if (!compData.typeName.isEmpty() && !sceneAPI->IsComponentTypeRegistered(compData.typeName))
+        {
+            if (compElem.isNull())
+            {
+                LogWarning("HttpServer: Unknown component type " + compData.typeName + ", skipping");
+                continue;
+            }
+            sceneAPI->RegisterPlaceholderComponentType(compElem);
+        }
+
+        const bool existed = !compData.typeName.isEmpty() ? entity->Component(compData.typeName, compData.name).get() != 0 :
+            entity->Component(compData.typeId, compData.name).get() != 0;
+        ComponentPtr newComp = (!compData.typeName.isEmpty() ? entity->GetOrCreateComponent(compData.typeName, compData.name, change_, compData.sync) :
+            entity->GetOrCreateComponent(compData.typeId, compData.name, change_, compData.sync));
+        if (newComp)
+        {
+            if (!existed)
+            {
+                newComponents_.insert(newComp.get());
+                if (!newEntities_.contains(entity.get()))
+                    createdComponents_.push_back(newComp);
+            }
+            newComp->SetTemporary(compData.temporary);
+            // Full XML component data goes through the component's own deserialization
+            if (!compElem.isNull())
+                newComp->DeserializeFrom(compElem, change_);
+            else
+                ApplyAttributes(newComp.get(), compData.attributes);
+        }
+    }
+}
+
+ComponentPtr HttpSceneDeserializer::GetOrCreateComponent(EntityPtr entity, const QString &typeName)
+{
+    ComponentPtr comp = entity->Component(typeName);
+    if (comp)
+        return comp;
+
+    /// \todo Only creates replicated components
+    comp = entity->GetOrCreateComponent(typeName, change_);
+    RecordComponent(entity, comp);
+    return comp;
+}
+
+ComponentPtr HttpSceneDeserializer::CreateComponent(EntityPtr entity, const QString &typeName)
+{
+    /// \todo Only creates replicated components
+    ComponentPtr comp = entity->CreateComponent(typeName, change_);
+    RecordComponent(entity, comp);
+    return comp;
+}
+
+void HttpSceneDeserializer::RecordComponent(EntityPtr entity, const ComponentPtr &component)
+{
+    if (!component)
+        return;
+    newComponents_.insert(component.get());
+    if (!newEntities_.contains(entity.get()))
+        createdComponents_.push_back(component);
+}
+
+HttpAttributeRef HttpSceneDeserializer::MakeRef(IComponent *component, IAttribute *attribute)
+{
+    HttpAttributeRef ref;
+    ref.component = component->shared_from_this();
+    ref.id = attribute->Id();
+    return ref;
+}
+
+IAttribute *HttpAttributeRef::Lookup() const
+{
+    ComponentPtr comp = component.lock();
+    if (!comp || !comp->ParentEntity())
+        return 0;
+    return comp->AttributeById(id);
+}
+
+void HttpSceneDeserializer::ApplyAttributes(IComponent *component, const QList<HttpAttributeData> &attributes)
+{
+    const bool newComponent = newComponents_.contains(component);
+    EC_DynamicComponent *dc = component->TypeId() == EC_DynamicComponent::TypeIdStatic() ? static_cast<EC_DynamicComponent*>(component) : 0;
+
+    for(int i = 0; i < attributes.size(); ++i)
+    {
+        const HttpAttributeData &attrData = attributes[i];
+        IAttribute *attr = FindAttribute(component, attrData.id, attrData.name);
+
+        // If DynamicComponent, can also create attribute
+        if (!attr && dc)
+        {
+            attr = dc->CreateAttribute(attrData.typeName, attrData.IdOrName(), change_);
+            if (attr && !newComponent)
+                createdAttributes_.push_back(MakeRef(component, attr));
+        }
+
+        if (!attr)
+        {
+            LogWarning(component->TypeName() + "::DeserializeFrom: Could not find attribute \"" + attrData.IdOrName() + "\" specified in the request.");
+            ++numMissingAttributes_;
+        }
+        else
+        {
+            if (!SetTypedValue(attr, attrData.value, change_))
+                attr->FromString(attrData.ValueString(), change_);
+            if (!newComponent && !changedSet_.contains(attr))
+            {
+                changedSet_.insert(attr);
+                changedAttributes_.push_back(MakeRef(component, attr));
+            }
+        }
+    }
+}
+
+IAttribute *HttpSceneDeserializer::FindAttribute(IComponent *component, const QString &idOrName)
+{
+    return FindAttribute(component, idOrName, QString());
+}
+
+IAttribute *HttpSceneDeserializer::FindAttribute(IComponent *component, const QString &id, const QString &name)
+{
+    // Prefer lookup by ID if it's specified, but fallback to using attribute human-readable name if not defined
+    if (id.isEmpty())
+        return AttributeByName(component, name);
+    IAttribute *attr = AttributeById(component, id);
+    if (!attr && name.isEmpty())
+        attr = AttributeByName(component, id);
+    return attr;
+}
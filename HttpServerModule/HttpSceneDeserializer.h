@@ -0,0 +1,96 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "FrameworkFwd.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+
+#include <QList>
+#include <QSet>
+#include <QString>
+
+#include <vector>
+
+class IAttribute;
+struct HttpEntityData;
+struct HttpComponentData;
+struct HttpAttributeData;
+struct HttpEntityIdBlock;
+
+/// Attribute changed by HttpSceneDeserializer, held by its component and id so that it can be looked up again after
+/// signal handlers may have removed the component.
+struct HTTP_SERVER_MODULE_API HttpAttributeRef
+{
+    ComponentWeakPtr component;
+    QString id;
+
+    /// Returns the attribute, or null if it, its component or the component's entity is gone.
+    IAttribute *Lookup() const;
+};
+
+/// Applies entities, components and attributes received in SceneAPI REST requests to a scene.
+/** Keeps track of what it has created and changed, so that the caller can announce or undo the changes
+    when they were made with AttributeChange::Disconnected. */
+class HTTP_SERVER_MODULE_API HttpSceneDeserializer
+{
+public:
+    HttpSceneDeserializer(Framework *framework, Scene *scene, AttributeChange::Type change = AttributeChange::Default);
+
+    /// Makes CreateEntity(parent, data) take the ids of the entity and its children from a reserved block.
+    void SetIdBlock(HttpEntityIdBlock *block) { idBlock_ = block; }
+
+    /// Creates an entity and its children. A zero or already taken id in the data is replaced with a free one.
+    /** With an id block set, all ids come from the block, and entities are left out once it is used up. */
+    EntityPtr CreateEntity(EntityPtr parent, const HttpEntityData &data);
+    /// Creates an entity with the given id, without children. The id must be free.
+    EntityPtr CreateEntity(entity_id_t id, const HttpEntityData &data);
+    void CreateComponentsToEntity(EntityPtr entity, const QList<HttpComponentData> &components);
+    /// Gets or creates a component by type name. Returns null if the type is unknown.
+    ComponentPtr GetOrCreateComponent(EntityPtr entity, const QString &typeName);
+    /// Creates a new component by type name even if the entity already has one of the type. Returns null if the type is unknown.
+    ComponentPtr CreateComponent(EntityPtr entity, const QString &typeName);
+    /// Sets attribute values. Attributes missing from a dynamic component are created with the given type.
+    /** Values given as JSON numbers, booleans, strings or arrays of numbers are set straight to attributes of a matching
+        type; other values go through IAttribute::FromString. */
+    void ApplyAttributes(IComponent *component, const QList<HttpAttributeData> &attributes);
+
+    /// Returns the attribute of a component with the given id, or with the given name if it has none with that id.
+    /** Looks the attribute up in a table of attribute indexes by id and name per component type, built on first use
+        of the type, instead of comparing with every attribute of the component. Main thread only. */
+    static IAttribute *FindAttribute(IComponent *component, const QString &idOrName);
+    /// Returns the attribute by id if one is given, otherwise by name. An id is also tried as a name when no name is given.
+    static IAttribute *FindAttribute(IComponent *component, const QString &id, const QString &name);
+
+    /// Entities created, parents before their children.
+    const std::vector<EntityWeakPtr> &CreatedEntities() const { return createdEntities_; }
+    /// Components created to entities that existed before.
+    const std::vector<ComponentWeakPtr> &CreatedComponents() const { return createdComponents_; }
+    /// Attributes set in components that existed before.
+    /** Each attribute is listed once, however many times it was set. */
+    const std::vector<HttpAttributeRef> &ChangedAttributes() const { return changedAttributes_; }
+    /// Attributes created to dynamic components that existed before. These are also in ChangedAttributes().
+    const std::vector<HttpAttributeRef> &CreatedAttributes() const { return createdAttributes_; }
+    /// Number of attributes that could not be found or created.
+    uint NumMissingAttributes() const { return numMissingAttributes_; }
+
+private:
+    Framework *framework_;
+    Scene *scene_;
+    AttributeChange::Type change_;
+    HttpEntityIdBlock *idBlock_;
+
+    std::vector<EntityWeakPtr> createdEntities_;
+    std::vector<ComponentWeakPtr> createdComponents_;
+    void RecordComponent(EntityPtr entity, const ComponentPtr &component);
+    static HttpAttributeRef MakeRef(IComponent *component, IAttribute *attribute);
+
+    std::vector<HttpAttributeRef> changedAttributes_;
+    std::vector<HttpAttributeRef> createdAttributes_;
+    QSet<IAttribute*> changedSet_;
+    /// Entities and components created by this deserializer
+    QSet<Entity*> newEntities_;
+    QSet<IComponent*> newComponents_;
+    uint numMissingAttributes_;
+};
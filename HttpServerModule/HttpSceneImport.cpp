@@ -0,0 +1,356 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSceneImport.h"
+#include "HttpSceneData.h"
+#include "HttpSceneDeserializer.h"
+#include "SceneJsonWriter.h"
+
+#include "CoreJsonUtils.h"
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+
+#include "kNet/Clock.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/NetException.h"
+
+#include <QDomDocument>
+#include <QDomElement>
+
+#include <algorithm>
+
+namespace
+{
+
+/// Deepest nesting of elements or objects accepted in an imported document, so that a crafted document
+/// cannot exhaust the stack of the recursive readers
+const int cMaxNesting = 64;
+
+/// Reads the element at the current start element of the reader, with everything inside it.
+/** Raises an error on the reader if elements are nested deeper than cMaxNesting. */
+QDomElement ReadElement(QXmlStreamReader &xml, QDomDocument &doc, int depth = 1)
+{
+    if (depth > cMaxNesting)
+    {
+        xml.raiseError("Elements nested too deeply");
+        return QDomElement();
+    }
+
+    QDomElement element = doc.createElement(xml.name().toString());
+    const QXmlStreamAttributes attributes = xml.attributes();
+    for(int i = 0; i < attributes.size(); ++i)
+        element.setAttribute(attributes[i].name().toString(), attributes[i].value().toString());
+
+    while(!xml.atEnd())
+    {
+        xml.readNext();
+        if (xml.isStartElement())
+        {
+            const QDomElement child = ReadElement(xml, doc, depth + 1);
+            if (xml.hasError())
+                break;
+            element.appendChild(child);
+        }
+        else if (xml.isEndElement())
+            break;
+        else if (xml.isCharacters() && !xml.isWhitespace())
+            element.appendChild(doc.createTextNode(xml.text().toString()));
+    }
+    return element;
+}
+
+bool IsJsonWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/// Returns the position after the object starting at pos, or -1 if the object does not end or is nested deeper than cMaxNesting.
+int ObjectEnd(const QByteArray &json, int pos)
+{
+    int depth = 0;
+    bool inString = false;
+    for(int i = pos; i < json.size(); ++i)
+    {
+        const char c = json[i];
+        if (inString)
+        {
+            if (c == '\\')
+                ++i;
+            else if (c == '"')
+                inString = false;
+        }
+        else if (c == '"')
+            inString = true;
+        else if ((c == '{' || c == '[') && ++depth > cMaxNesting)
+            return -1;
+        else if ((c == '}' || c == ']') && --depth == 0)
+            return i + 1;
+    }
+    return -1;
+}
+
+const char *StateName(HttpSceneImport::State state)
+{
+    switch(state)
+    {
+    case HttpSceneImport::Running: return "running";
+    case HttpSceneImport::Finished: return "finished";
+    default: return "failed";
+    }
+}
+
+}
+
+HttpSceneImport::HttpSceneImport(uint id, Framework *framework, const SceneWeakPtr &scene, const QByteArray &body, HttpServer::ContentFormat format) :
+    id_(id),
+    framework_(framework),
+    scene_(scene),
+    body_(body),
+    totalBytes_(body.size()),
+    bytesRead_(0),
+    format_(format),
+    state_(Running),
+    pos_(-1),
+    binaryEntitiesLeft_(0),
+    entitiesCreated_(0),
+    entitiesFailed_(0)
+{
+    if (format_ == HttpServer::XmlFormat)
+        xml_.addData(body_);
+}
+
+bool HttpSceneImport::Process(double budgetMs)
+{
+    if (state_ != Running)
+        return true;
+
+    ScenePtr scene = scene_.lock();
+    if (!scene)
+    {
+        Fail("The scene has been removed");
+        return true;
+    }
+
+    PROFILE(HttpSceneImport_Process);
+    const kNet::tick_t startTime = kNet::Clock::Tick();
+    while(CreateNextEntity(scene.get()))
+    {
+        if (kNet::Clock::TimespanToMillisecondsD(startTime, kNet::Clock::Tick()) >= budgetMs)
+            return false;
+    }
+
+    if (state_ == Running)
+        state_ = Finished;
+    // Only the counters are needed from now on
+    bytesRead_ = Position();
+    body_.clear();
+    xml_.clear();
+    return true;
+}
+
+bool HttpSceneImport::CreateNextEntity(Scene *scene)
+{
+    if (format_ == HttpServer::BinaryFormat)
+        return CreateNextBinaryEntity(scene);
+
+    HttpEntityData entity;
+    if (!(format_ == HttpServer::JsonFormat ? NextJsonEntity(entity) : NextXmlEntity(entity)))
+        return false;
+
+    // A deserializer per entity, so that nothing accumulates over the import
+    if (HttpSceneDeserializer(framework_, scene).CreateEntity(EntityPtr(), entity))
+        ++entitiesCreated_;
+    else
+        ++entitiesFailed_;
+    return true;
+}
+
+bool HttpSceneImport::NextXmlEntity(HttpEntityData &entity)
+{
+    while(!xml_.atEnd())
+    {
+        xml_.readNext();
+        if (!xml_.isStartElement())
+            continue;
+        // Entities are read from inside the scene element, or a document may be a single entity
+        if (xml_.name() == QLatin1String("scene"))
+            continue;
+        if (xml_.name() != QLatin1String("entity"))
+        {
+            xml_.skipCurrentElement();
+            continue;
+        }
+
+        QDomDocument doc("Entity");
+        QDomElement element = ReadElement(xml_, doc);
+        if (xml_.hasError())
+            break;
+        HttpSceneParser::ParseEntity(element, entity);
+        return true;
+    }
+
+    if (xml_.hasError())
+        Fail("XML decode error " + xml_.errorString() + " at line " + QString::number(xml_.lineNumber()));
+    return false;
+}
+
+bool HttpSceneImport::FindJsonEntities()
+{
+    // Either { "entities": [ ... ] } or a bare array of entities
+    int pos = 0;
+    while(pos < body_.size() && IsJsonWhitespace(body_[pos]))
+        ++pos;
+    if (pos < body_.size() && body_[pos] == '{')
+    {
+        pos = body_.indexOf("\"entities\"", pos);
+        if (pos >= 0)
+            pos = body_.indexOf('[', pos);
+    }
+    if (pos < 0 || pos >= body_.size() || body_[pos] != '[')
+    {
+        Fail("JSON decode error: expected an entities array");
+        return false;
+    }
+    pos_ = pos + 1;
+    return true;
+}
+
+bool HttpSceneImport::NextJsonEntity(HttpEntityData &entity)
+{
+    if (pos_ < 0 && !FindJsonEntities())
+        return false;
+
+    while(pos_ < body_.size() && (IsJsonWhitespace(body_[pos_]) || body_[pos_] == ','))
+        ++pos_;
+    if (pos_ < body_.size() && body_[pos_] == ']')
+        return false;
+
+    const int end = (pos_ < body_.size() && body_[pos_] == '{' ? ObjectEnd(body_, pos_) : -1);
+    if (end < 0)
+    {
+        Fail("JSON decode error: expected an entity object, nested at most " + QString::number(cMaxNesting) + " levels deep, at offset " + QString::number(pos_));
+        return false;
+    }
+
+    bool ok = false;
+    const QVariant object = TundraJson::Parse(body_.mid(pos_, end - pos_), &ok);
+    if (!ok || object.type() != QVariant::Map)
+    {
+        Fail("JSON decode error: malformed entity object at offset " + QString::number(pos_));
+        return false;
+    }
+    pos_ = end;
+    HttpSceneParser::ParseEntity(object.toMap(), entity);
+    return true;
+}
+
+void HttpSceneImport::SkipBinaryEntity(kNet::DataDeserializer &src, int depth)
+{
+    // Scene::CreateContentFromBinary recurses per level as well, so deeper documents are refused here
+    if (depth > cMaxNesting)
+        throw kNet::NetException("Entities nested too deeply");
+
+    // Mirrors Entity::SerializeToBinary: id, replication flag, then the component count in the low
+    // 16 bits and the child entity count in the high 16 bits, the components and the children
+    src.Read<u32>();
+    src.Read<u8>();
+    const u32 counts = src.Read<u32>();
+    for(u32 i = 0; i < (counts & 0xffff); ++i)
+    {
+        src.Read<u32>();
+        src.ReadString();
+        src.Read<u8>();
+        const u32 size = src.Read<u32>();
+        if (size > src.BytesLeft())
+            throw kNet::NetException("Component extends past the end of the data");
+        src.SkipBytes(size);
+    }
+    for(u32 i = 0; i < (counts >> 16); ++i)
+        SkipBinaryEntity(src, depth + 1);
+}
+
+bool HttpSceneImport::CreateNextBinaryEntity(Scene *scene)
+{
+    QByteArray entityData;
+    try
+    {
+        if (pos_ < 0)
+        {
+            kNet::DataDeserializer header(body_.constData(), body_.size());
+            binaryEntitiesLeft_ = header.Read<u32>();
+            pos_ = (int)header.BytePos();
+        }
+        if (binaryEntitiesLeft_ == 0)
+            return false;
+
+        kNet::DataDeserializer src(body_.constData() + pos_, body_.size() - pos_);
+        SkipBinaryEntity(src);
+
+        // Scene::CreateContentFromBinary takes a whole document, so the entity gets a header of its own
+        entityData.resize(sizeof(u32));
+        kNet::DataSerializer(entityData.data(), sizeof(u32)).Add<u32>(1);
+        entityData.append(body_.constData() + pos_, (int)src.BytePos());
+        pos_ += (int)src.BytePos();
+        --binaryEntitiesLeft_;
+    }
+    catch(const kNet::NetException &e)
+    {
+        Fail("Binary decode error: " + QString(e.what()) + " in the entity at offset " + QString::number(std::max(pos_, 0)));
+        return false;
+    }
+
+    if (!scene->CreateContentFromBinary(entityData.constData(), entityData.size(), true, AttributeChange::Default).isEmpty())
+        ++entitiesCreated_;
+    else
+        ++entitiesFailed_;
+    return true;
+}
+
+void HttpSceneImport::Fail(const QString &error)
+{
+    state_ = Failed;
+    error_ = error;
+}
+
+qint64 HttpSceneImport::Position() const
+{
+    if (state_ != Running && body_.isEmpty())
+        return bytesRead_;
+    // The XML reader counts characters, which equals bytes for the ASCII that TXML mostly is
+    return format_ == HttpServer::XmlFormat ? xml_.characterOffset() : std::max(pos_, 0);
+}
+
+QByteArray HttpSceneImport::Progress(HttpServer::ContentFormat format) const
+{
+    const qint64 bytesRead = Position();
+    QByteArray out;
+    if (format == HttpServer::JsonFormat)
+    {
+        out += "{\"id\":" + QByteArray::number(id_) + ",\"state\":\"" + StateName(state_) + "\"";
+        out += ",\"bytesRead\":" + QByteArray::number(bytesRead) + ",\"totalBytes\":" + QByteArray::number(totalBytes_);
+        out += ",\"entitiesCreated\":" + QByteArray::number(entitiesCreated_) + ",\"entitiesFailed\":" + QByteArray::number(entitiesFailed_);
+        if (!error_.isEmpty())
+        {
+            out += ",\"error\":";
+            SceneJsonWriter(out).WriteString(error_);
+        }
+        out += '}';
+    }
+    else
+    {
+        QDomDocument doc("Import");
+        QDomElement root = doc.createElement("import");
+        root.setAttribute("id", id_);
+        root.setAttribute("state", StateName(state_));
+        root.setAttribute("bytesRead", bytesRead);
+        root.setAttribute("totalBytes", totalBytes_);
+        root.setAttribute("entitiesCreated", entitiesCreated_);
+        root.setAttribute("entitiesFailed", entitiesFailed_);
+        if (!error_.isEmpty())
+            root.setAttribute("error", error_);
+        doc.appendChild(root);
+        out = doc.toByteArray();
+    }
+    return out;
+}
@@ -0,0 +1,85 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+#include "FrameworkFwd.h"
+#include "SceneFwd.h"
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QXmlStreamReader>
+
+struct HttpEntityData;
+
+namespace kNet { class DataDeserializer; }
+
+/// Bulk import of a scene document into the active scene, a few entities per frame.
+/** The document is read incrementally: TXML with QXmlStreamReader, JSON by cutting the objects of the
+    "entities" array out of the text one at a time, and TBIN by measuring each entity before handing it to
+    Scene::CreateContentFromBinary. Only the entity being created is ever parsed into memory, in addition
+    to the request body kept by the import. Entities keep their ids when they are free,
+    otherwise they get new ones. An entity that cannot be created is counted as failed and the import
+    continues; a malformed document stops the import, keeping the entities created so far. So does a document
+    nested more than 64 levels deep, as the entities are parsed recursively. */
+class HTTP_SERVER_MODULE_API HttpSceneImport
+{
+public:
+    enum State
+    {
+        Running,
+        Finished,
+        Failed
+    };
+
+    HttpSceneImport(uint id, Framework *framework, const SceneWeakPtr &scene, const QByteArray &body, HttpServer::ContentFormat format);
+
+    /// Creates entities until the document ends or budgetMs milliseconds have passed. Returns true when the import has ended.
+    bool Process(double budgetMs);
+
+    uint Id() const { return id_; }
+    State ImportState() const { return state_; }
+    uint EntitiesCreated() const { return entitiesCreated_; }
+    uint EntitiesFailed() const { return entitiesFailed_; }
+
+    /// Returns the progress of the import as a JSON or XML document.
+    QByteArray Progress(HttpServer::ContentFormat format) const;
+
+private:
+    /// Creates the next top-level entity. Returns false at the end of the document or on error, which then sets error_.
+    bool CreateNextEntity(Scene *scene);
+    /// Reads the next top-level entity. Returns false at the end of the document or on error, which then sets error_.
+    bool NextXmlEntity(HttpEntityData &entity);
+    bool NextJsonEntity(HttpEntityData &entity);
+    bool CreateNextBinaryEntity(Scene *scene);
+    /// Moves past one entity of a TBIN document and its children. Throws kNet::NetException if the entity is truncated
+    /// or its children are nested too deeply.
+    static void SkipBinaryEntity(kNet::DataDeserializer &src, int depth = 1);
+    /// Positions the JSON reader at the first element of the entities array.
+    bool FindJsonEntities();
+    void Fail(const QString &error);
+    /// Returns the position reached in the body, in bytes.
+    qint64 Position() const;
+
+    uint id_;
+    Framework *framework_;
+    SceneWeakPtr scene_;
+    QByteArray body_;
+    qint64 totalBytes_;
+    /// Position reached when the import ended and the body was released
+    qint64 bytesRead_;
+    HttpServer::ContentFormat format_;
+    State state_;
+
+    QXmlStreamReader xml_;
+    /// Next position to read in a JSON or binary body, or -1 before the first entity has been found
+    int pos_;
+    /// Entities left in a binary body
+    u32 binaryEntitiesLeft_;
+
+    uint entitiesCreated_;
+    uint entitiesFailed_;
+    QString error_;
+};
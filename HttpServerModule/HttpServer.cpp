@@ -10,16 +10,41 @@
 #include "Profiler.h"
 
 #include "SceneAPI.h"
+#include "AssetAPI.h"
+#include "AssetCache.h"
+#include "IAssetStorage.h"
 #include "Scene.h"
 #include "Entity.h"
 #include "EC_DynamicComponent.h"
 #include "QScriptEngineHelpers.h"
 
+#include "HttpSceneData.h"
+#include "HttpSceneDeserializer.h"
+#include "HttpSceneBatch.h"
+#include "SceneJsonWriter.h"
+#include "HttpEntityStream.h"
+#include "HttpSceneCache.h"
+#include "HttpSubscriptionChannel.h"
+#include "HttpSpatialIndex.h"
+#include "HttpEntityIndex.h"
+#include "HttpCompression.h"
+#include "HttpDeferredReply.h"
+#include "HttpSceneImport.h"
+#include "HttpChangeFeed.h"
+#include "HttpRateLimiter.h"
+#include "HttpFileServer.h"
+#include "HttpAssetUploads.h"
+#include "HttpEntityIdBlocks.h"
+
 #include <websocketpp/frame.hpp>
 
+#include "kNet/Clock.h"
+#include "boost/lexical_cast.hpp"
+
 #include <QMutexLocker>
 #include <QByteArray>
 #include <QStringList>
+#include <QSet>
 #include <QVariant>
 #include <QVariantMap>
 #include <QVariantList>
@@ -30,10 +55,12 @@
 #include <QLocale>
 #include <QDebug>
 #include <QUrl>
+#include <QPointer>
 #include <QDomDocument>
 #include <QDomElement>
 
 #include <algorithm>
+#include <cmath>
 
 Q_DECLARE_METATYPE(HttpServer*)
 
@@ -48,720 +75,2287 @@ Q_DECLARE_METATYPE(HttpServer*)
 #define strcasecmp _stricmp
 #endif
 
-HttpServer::HttpServer(Framework *framework, ushort port) :
-    framework_(framework),
-    port_(port)
+namespace
 {
-}
 
-HttpServer::~HttpServer()
+/// Returns the verb name that metrics are recorded under. Unknown methods share one name, so that arbitrary
+/// methods do not each get series of their own.
+QString MetricsVerb(HttpVerb verb)
 {
-    Reset();
+    return verb != HttpUnknownVerb ? QString(HttpRouter::VerbName(verb)) : QString("OTHER");
 }
 
-void HttpServer::Update(float frametime)
+/// Parses a comma-separated list of exactly count finite numbers.
+bool ParseFloats(const QString &str, int count, std::vector<float> &values)
 {
-    if (server_)
+    const QStringList parts = str.split(',');
+    if (parts.size() != count)
+        return false;
+    values.resize(count);
+    for(int i = 0; i < count; ++i)
     {
-        // Update server in main thread so that scenes can be accessed safely in HTTP requests
-        PROFILE(ServerPoll);
-        server_->get_io_service().poll_one();
+        bool ok = false;
+        values[i] = parts[i].trimmed().toFloat(&ok);
+        if (!ok || !(values[i] == values[i]) || values[i] > 1e30f || values[i] < -1e30f)
+            return false;
     }
+    return true;
 }
 
-bool HttpServer::Start()
+/// Parses a comma-separated list of entity ids, leaving out repeated ids.
+bool ParseEntityIds(const QString &str, std::vector<entity_id_t> &ids)
 {
-    Reset();
-    
-    try
-    {
-        server_ = ServerPtr(new websocketpp::server<websocketpp::config::asio>());
-
-        // Initialize ASIO transport
-        server_->init_asio();
-
-        // Register handler callbacks
-        server_->set_http_handler(boost::bind(&HttpServer::OnHttpRequest, this, ::_1));
-
-        // Setup logging
-        server_->get_alog().clear_channels(websocketpp::log::alevel::all);
-        server_->get_elog().clear_channels(websocketpp::log::elevel::all);
-        server_->get_elog().set_channels(websocketpp::log::elevel::rerror);
-        server_->get_elog().set_channels(websocketpp::log::elevel::fatal);
-
-        server_->listen(port_);
-
-        // Start the server accept loop
-        server_->start_accept();
-    } 
-    catch (std::exception &e) 
+    const QStringList parts = str.split(',', QString::SkipEmptyParts);
+    QSet<entity_id_t> seen;
+    ids.reserve(parts.size());
+    for(int i = 0; i < parts.size(); ++i)
     {
-        LogError(QString::fromStdString(e.what()));
-        return false;
+        bool ok = false;
+        const entity_id_t id = parts[i].trimmed().toUInt(&ok);
+        if (!ok)
+            return false;
+        if (!seen.contains(id))
+        {
+            seen.insert(id);
+            ids.push_back(id);
+        }
     }
-    
-    LogInfo("HttpServer started on port " + QString::number(port_));
-    emit ServerStarted();
-    
-    return true;
+    return !ids.empty();
 }
 
-void HttpServer::Stop()
-{    
-    try
+/// Serializes an entity id block, with the ids of the entities created from it by the request if given.
+QByteArray SerializeIdBlock(const HttpEntityIdBlock &block, HttpServer::ContentFormat format, const std::vector<entity_id_t> *created = 0)
+{
+    QByteArray out;
+    if (format == HttpServer::JsonFormat)
     {
-        if (server_)
+        out += "{\"id\":\"" + block.token.toLatin1() + "\",\"local\":" + (block.local ? "true" : "false");
+        out += ",\"first\":" + QByteArray::number(block.first) + ",\"last\":" + QByteArray::number(block.last);
+        out += ",\"next\":" + QByteArray::number(block.next) + ",\"remaining\":" + QByteArray::number(block.remaining);
+        if (created)
         {
-            server_->stop();
-            emit ServerStopped();
+            out += ",\"created\":[";
+            for(size_t i = 0; i < created->size(); ++i)
+            {
+                if (i)
+                    out += ',';
+                out += QByteArray::number((*created)[i]);
+            }
+            out += ']';
         }
+        out += '}';
     }
-    catch (std::exception &e) 
+    else
     {
-        LogError("Error while closing server: " + QString::fromStdString(e.what()));
-        return;
+        QDomDocument doc("IdBlock");
+        QDomElement root = doc.createElement("idblock");
+        root.setAttribute("id", block.token);
+        root.setAttribute("local", block.local ? "true" : "false");
+        root.setAttribute("first", block.first);
+        root.setAttribute("last", block.last);
+        root.setAttribute("next", block.next);
+        root.setAttribute("remaining", block.remaining);
+        for(size_t i = 0; created && i < created->size(); ++i)
+        {
+            QDomElement entElem = doc.createElement("entity");
+            entElem.setAttribute("id", (*created)[i]);
+            root.appendChild(entElem);
+        }
+        doc.appendChild(root);
+        out = doc.toByteArray();
     }
-    
-    LogDebug("Stopped HttpServer"); 
-    
-    Reset();
+    return out;
 }
 
-void HttpServer::Reset()
+/// Counts an entity and its descendants.
+uint CountEntities(const HttpEntityData &data)
 {
-    server_.reset();
+    uint count = 1;
+    for(int i = 0; i < data.children.size(); ++i)
+        count += CountEntities(data.children[i]);
+    return count;
 }
 
-Scene* HttpServer::GetActiveScene()
+/// Returns the address part of the remote endpoint of a connection.
+QByteArray RemoteAddress(HttpServer::ConnectionPtr connection)
 {
-    Scene *scene = framework_->Scene()->MainCameraScene();
-    if (scene)
-        return scene;
-    else
-        return framework_->Scene()->SceneByName("TundraServer").get();
+    // The endpoint is address:port, with IPv6 addresses in brackets
+    const std::string endpoint = connection->get_remote_endpoint();
+    const size_t bracket = endpoint.rfind(']');
+    if (!endpoint.empty() && endpoint[0] == '[' && bracket != std::string::npos)
+        return QByteArray(endpoint.data() + 1, (int)bracket - 1);
+    const size_t colon = endpoint.rfind(':');
+    if (colon != std::string::npos && colon == endpoint.find(':'))
+        return QByteArray(endpoint.data(), (int)colon);
+    return QByteArray(endpoint.data(), (int)endpoint.size());
 }
 
-void HttpServer::OnHttpRequest(ConnectionHandle connection)
-{
-    ConnectionPtr connectionPtr = server_->get_con_from_hdl(connection);
-
-    QString path = QString::fromStdString(connectionPtr->get_resource()).toUtf8();
-    QString verb = QString::fromStdString(connectionPtr->get_request().get_method());
-
-    // Handle SceneAPI REST requests internally, otherwise defer to a signal
-    if (path.startsWith("/entities") || path.startsWith("/scene"))
-        HandleSceneHttpRequest(connectionPtr, path, verb);
-    else
-        emit HttpRequestReceived(connectionPtr, path, verb);
 }
 
-void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QByteArray& replyData, const QString& contentType, websocketpp::http::status_code::value status)
+/// Reply body compressed in the thread pool and sent from the main thread.
+struct HttpCompressTask
 {
-    std::string payload;
-    payload.resize(replyData.size());
-    memcpy((void*)payload.data(), (void*)replyData.data(), replyData.size());
-    
-    connection->set_status(status);
-    connection->set_body(payload);
-    connection->replace_header("Content-Length", QString::number(replyData.size()).toStdString());
-    connection->replace_header("Content-Type", contentType.toStdString());
-}
-
-void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QString& reply, const QString& contentType, websocketpp::http::status_code::value status)
+    HttpServer::ConnectionPtr connection;
+    HttpServer::ReplyBuffer body;
+    QByteArray contentType;
+    HttpCompression::Encoding encoding;
+    QString cacheKey;
+    QByteArray etag;
+};
+
+namespace
 {
-    QByteArray replyData = reply.toUtf8();
-    SetHttpRequestReply(connection, replyData, contentType, status);
-}
 
-void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const char* reply, const QString& contentType, websocketpp::http::status_code::value status)
+/// Compresses the body of a task. If that fails, the body is left as is and the encoding is set to identity.
+void CompressReply(HttpCompressTask &task)
 {
-    QByteArray replyData(reply);
-    SetHttpRequestReply(connection, replyData, contentType, status);
+    // The compressor reads the shared buffer in place
+    const QByteArray compressed = HttpCompression::Compress(QByteArray::fromRawData(task.body->data(), (int)task.body->size()), task.encoding);
+    if (compressed.isNull())
+        task.encoding = HttpCompression::Identity;
+    else
+        task.body = HttpServer::MakeReplyBuffer(compressed);
 }
 
-void HttpServer::SetHttpRequestStatus(ConnectionPtr connection, websocketpp::http::status_code::value status)
-{
-    connection->set_status(websocketpp::http::status_code::not_found);
 }
 
-void HttpServer::HandleSceneHttpRequest(ConnectionPtr connection, const QString& path, const QString& verb)
+/// Compresses a reply body in the thread pool and hands the result back to the main thread.
+class HttpCompressJob : public QRunnable
 {
-    Scene* scene = GetActiveScene();
-    if (!scene)
+public:
+    HttpCompressJob(HttpServer *server, const shared_ptr<HttpCompressTask> &task) : server_(server), task_(task) {}
+
+    void run()
     {
-        SetHttpRequestStatus(connection, websocketpp::http::status_code::not_found);
-        return;
+        CompressReply(*task_);
+        server_->RunInMainThread(boost::bind(&HttpServer::FinishCompressedReply, server_, task_, true));
     }
 
-    QUrl pathUrl(path);
-    QString sanitatedPath = pathUrl.path();
-    if (sanitatedPath.startsWith('/'))
-        sanitatedPath = sanitatedPath.mid(1);
-    if (sanitatedPath.endsWith('/'))
-        sanitatedPath.resize(sanitatedPath.length() - 1);
+private:
+    HttpServer *server_;
+    shared_ptr<HttpCompressTask> task_;
+};
 
-    QStringList pathParts = sanitatedPath.split('/');
+/// Runs the ASIO event loop of the server in a worker thread.
+class HttpIoThread : public QThread
+{
+public:
+    explicit HttpIoThread(HttpServer::ServerPtr server) : server_(server) {}
 
-    // Queries
-    if (verb.compare("GET", Qt::CaseInsensitive) == 0)
+protected:
+    void run()
     {
-        // Whole scene or entity by name
-        if (pathParts.length() == 1)
-        {
-            if (pathUrl.hasQueryItem("name"))
-            {
-                QString name = pathUrl.queryItemValue("name");
-                EntityPtr entity = scene->EntityByName(name);
-                if (entity)
-                {
-                    QByteArray entityXml;
-                    entityXml += entity->SerializeToXMLString(true, true, false);
-                    SetHttpRequestReply(connection, entityXml, "application/xml", websocketpp::http::status_code::ok);
-                    return;
-                }
-            }
-            else
-            {
-                QByteArray sceneXml = scene->SerializeToXmlString(true, true);
-                SetHttpRequestReply(connection, sceneXml, "application/xml", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // Specific entity
-        else if (pathParts.length() == 2)
-        {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                QByteArray entityXml;
-                entityXml += entity->SerializeToXMLString(true, true, false);
-                SetHttpRequestReply(connection, entityXml, "application/xml", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // Specific component in specific entity
-        else if (pathParts.length() == 3)
+        try
         {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Returns only the first component
-                if (comps.size())
-                {
-                    QByteArray componentXml;
-                    QDomDocument componentDoc("Component");
-                    QDomElement empty;
-                    comps[0]->SerializeTo(componentDoc, empty, true);
-                    componentXml = componentDoc.toByteArray();
-                    SetHttpRequestReply(connection, componentXml, "application/xml", websocketpp::http::status_code::ok);
-                    return;
-                }
-            }
+            server_->run();
         }
-        // Specific attribute in specific component in specific entity
-        else if (pathParts.length() == 4)
+        catch (std::exception &e)
         {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Uses only the first component
-                if (comps.size())
-                {
-                    // Try both name & id
-                    IAttribute* attr = comps[0]->AttributeById(pathParts[3]);
-                    if (!attr)
-                        attr = comps[0]->AttributeByName(pathParts[3]);
-
-                    if (attr)
-                    {
-                        SetHttpRequestReply(connection, attr->ToString(), "text/plain", websocketpp::http::status_code::ok);
-                        return;
-                    }
-                }
-            }
+            LogError("HttpServer I/O thread: " + QString::fromStdString(e.what()));
         }
     }
 
-    /// \todo Access control
+private:
+    HttpServer::ServerPtr server_;
+};
+
+HttpServer::HttpServer(Framework *framework, ushort port) :
+    framework_(framework),
+    port_(port),
+    numIoThreads_(0),
+    ioThreaded_(0),
+    stopping_(0),
+    rateLimiter_(new HttpRateLimiter()),
+    fileServer_(new HttpFileServer()),
+    serveAssetCache_(false),
+    assetUploads_(new HttpAssetUploads()),
+    assetsUploaded_(0),
+    queuedRequests_(0),
+    parkedReplies_(0),
+    subscriberConnections_(0),
+    maxInFlight_(512),
+    maxSubscribers_(256),
+    maxChangeWaiters_(1024),
+    overloadRefusals_(0),
+    refusedSubscribers_(0),
+    streamSliceSize_(500),
+    sceneCache_(new HttpSceneCache(1024)),
+    compressMinSize_(1024),
+    compressedReplies_(0),
+    compressedCacheHits_(0),
+    notModifiedReplies_(0),
+    subscriptions_(new HttpSubscriptionChannel(256 * 1024)),
+    spatialIndex_(new HttpSpatialIndex(16.f)),
+    entityIndex_(new HttpEntityIndex(32)),
+    changeFeed_(new HttpChangeFeed(10000, HttpChangeFeed::RingCompaction)),
+    maxChangeWait_(30.f),
+    eventHeartbeat_(15.f),
+    eventStreamMaxBytes_(256 * 1024),
+    eventReplies_(0),
+    eventHeartbeats_(0),
+    frameBudgetMs_(2.f),
+    handlersExecuted_(0),
+    totalHandlersExecuted_(0),
+    backloggedFrames_(0),
+    budgetOverruns_(0),
+    lastDrainMs_(0.f),
+    maxOverrunMs_(0.f),
+    unroutedRequests_(0),
+    replyDeferred_(false),
+    nextImportId_(1),
+    importBudgetMs_(4.f),
+    idBlocks_(new HttpEntityIdBlocks()),
+    idBlockEntities_(0),
+    deferredTimeout_(30.f),
+    deferredTimeouts_(0)
+{
+    RegisterSceneRoutes();
+    router_.AddRoute(HttpGet, "/metrics", boost::bind(&HttpServer::HandleMetrics, this, ::_1));
+}
+
+HttpServer::~HttpServer()
+{
+    Reset();
+    delete sceneCache_;
+    delete subscriptions_;
+    delete spatialIndex_;
+    delete entityIndex_;
+    delete changeFeed_;
+    delete rateLimiter_;
+    delete fileServer_;
+    delete assetUploads_;
+    delete idBlocks_;
+}
+
+void HttpServer::Update(float frametime)
+{
+    if (!server_)
+        return;
+
+    // Update server in main thread so that scenes can be accessed safely in HTTP requests.
+    // Drain ready handlers until either the queue is empty or the frame budget has been used.
+    PROFILE(ServerPoll);
 
-    // Deletions
-    if (verb.compare("DELETE", Qt::CaseInsensitive) == 0)
+    const kNet::tick_t startTime = kNet::Clock::Tick();
+    const double budgetMs = frameBudgetMs_;
+    double elapsedMs = 0.0;
+    uint executed = 0;
+    bool budgetExhausted = false;
+
+    while(RunNextHandler())
     {
-        // Entity by name
-        if (pathParts.length() == 1 && pathUrl.hasQueryItem("name"))
-        {
-            QString name = pathUrl.queryItemValue("name");
-            EntityPtr entity = scene->EntityByName(name);
-            if (entity)
-            {
-                scene->RemoveEntity(entity->Id());
-                SetHttpRequestReply(connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // Specific entity
-        else if (pathParts.length() == 2)
-        {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            if (scene->RemoveEntity(entityId))
-            {
-                SetHttpRequestReply(connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // Specific component in specific entity
-        else if (pathParts.length() == 3)
-        {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Uses only the first component
-                if (comps.size())
-                {
-                    entity->RemoveComponent(comps[0]);
-                    SetHttpRequestReply(connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
-                    return;
-                }
-            }
-        }
-        // Specific attribute in specific component in specific entity (DynamicComponent only)
-        else if (pathParts.length() == 4)
+        ++executed;
+        elapsedMs = kNet::Clock::TimespanToMillisecondsD(startTime, kNet::Clock::Tick());
+        if (budgetMs <= 0.0 || elapsedMs >= budgetMs)
         {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Uses only the first component
-                if (comps.size())
-                {
-                    // Try both name & id
-                    IAttribute* attr = comps[0]->AttributeById(pathParts[3]);
-                    if (!attr)
-                        attr = comps[0]->AttributeByName(pathParts[3]);
-                    EC_DynamicComponent* dc = dynamic_cast<EC_DynamicComponent*>(comps[0].get());
-
-                    if (attr && dc)
-                    {
-                        dc->RemoveAttribute(attr->Id());
-                        SetHttpRequestReply(connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
-                        return;
-                    }
-                }
-            }
+            budgetExhausted = true;
+            break;
         }
+    }
+
+    handlersExecuted_ = executed;
+    totalHandlersExecuted_ += executed;
+    lastDrainMs_ = (float)elapsedMs;
+    // Only work queued to the main thread can be seen to be left; without I/O threads, events still
+    // waiting in the event loop are not known until they are polled
+    if (budgetExhausted && !mainThreadWork_.IsEmpty())
+        ++backloggedFrames_;
+    if (budgetMs > 0.0 && elapsedMs > budgetMs)
+    {
+        ++budgetOverruns_;
+        maxOverrunMs_ = std::max(maxOverrunMs_, (float)(elapsedMs - budgetMs));
+    }
+
+    ProcessEntityStreams();
+    ProcessImports();
+    ProcessChangeWaiters();
+    CheckDeferredReplies();
+    parkedReplies_ = (int)(entityStreams_.size() + deferredReplies_.size());
+    subscriptions_->Flush();
 
-        SetHttpRequestReply(connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+    // Deferred replies whose clients went away are never sent
+    for(std::map<void*, PendingMetrics>::iterator i = pendingMetrics_.begin(); i != pendingMetrics_.end();)
+    {
+        if (i->second.connection.expired())
+            pendingMetrics_.erase(i++);
+        else
+            ++i;
+    }
+    metrics_.RecordFrame(kNet::Clock::TimespanToSecondsD(startTime, kNet::Clock::Tick()));
+}
+
+HttpDeferredReply* HttpServer::DeferReply(ConnectionPtr connection, float timeoutSeconds)
+{
+    websocketpp::lib::error_code ec = DeferHttpResponse(connection);
+    if (ec)
+    {
+        LogError("HttpServer::DeferReply: could not defer reply: " + QString::fromStdString(ec.message()));
+        return 0;
+    }
+
+    HttpDeferredReply* reply = new HttpDeferredReply(this, connection, timeoutSeconds > 0.f ? timeoutSeconds : deferredTimeout_);
+    deferredReplies_.push_back(reply);
+    return reply;
+}
+
+void HttpServer::ProcessImports()
+{
+    if (imports_.empty())
         return;
+
+    // The budget goes to the oldest running import first
+    const kNet::tick_t startTime = kNet::Clock::Tick();
+    uint finished = 0;
+    for(std::list<shared_ptr<HttpSceneImport> >::iterator i = imports_.begin(); i != imports_.end(); ++i)
+    {
+        const double remainingMs = importBudgetMs_ - kNet::Clock::TimespanToMillisecondsD(startTime, kNet::Clock::Tick());
+        if ((*i)->ImportState() == HttpSceneImport::Running && remainingMs > 0.0)
+            (*i)->Process(remainingMs);
+        if ((*i)->ImportState() != HttpSceneImport::Running)
+            ++finished;
     }
 
-    // Modifications
-    if (verb.compare("PUT", Qt::CaseInsensitive) == 0)
+    // Finished imports are kept for a while so that their outcome can be queried
+    const uint maxFinished = 16;
+    for(std::list<shared_ptr<HttpSceneImport> >::iterator i = imports_.begin(); i != imports_.end() && finished > maxFinished;)
     {
-        // Attribute mod inside component by query
-        if (pathParts.length() == 3 && pathUrl.hasQuery())
-        {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Uses only the first component
-                if (comps.size())
-                {
-                    const QList<QPair<QString, QString> >& queryItems = pathUrl.queryItems();
-                    for (QList<QPair<QString, QString> >::const_iterator i = queryItems.begin(); i != queryItems.end(); ++i)
-                    {
-                        IAttribute* attr = comps[0]->AttributeById(i->first);
-                        if (!attr)
-                            attr = comps[0]->AttributeByName(i->first);
-
-                        if (attr)
-                            attr->FromString(i->second, AttributeChange::Default);
-                    }
-
-                    // Reply is the new content of the component
-                    QByteArray componentXml;
-                    QDomDocument componentDoc("Component");
-                    QDomElement empty;
-                    comps[0]->SerializeTo(componentDoc, empty, true);
-                    componentXml = componentDoc.toByteArray();
-                    SetHttpRequestReply(connection, componentXml, "application/xml", websocketpp::http::status_code::ok);
-                    return;
-                }
-            }
-        }
-        // Injection of whole component's data
-        else if (pathParts.length() == 3 && connection->get_request_body().length())
-        {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                Entity::ComponentVector comps = entity->ComponentsOfType(pathParts[2]);
-                /// \todo Uses only the first component
-                if (comps.size())
-                {
-                    QByteArray data(connection->get_request_body().c_str());
-                    QTextStream stream(&data);
-                    stream.setCodec("UTF-8");
-                    QDomDocument comp_doc("Component");
-                    QString errorMsg;
-                    int errorLine, errorColumn;
-                    if (!comp_doc.setContent(stream.readAll(), &errorMsg, &errorLine, &errorColumn))
-                    {
-                        SetHttpRequestReply(connection, QString("XML decode error " + errorMsg + " at line " + QString::number(errorLine)), "text/plain", websocketpp::http::status_code::bad_request);
-                        return;
-                    }
-                    else
-                    {
-                        QDomElement root = comp_doc.firstChildElement("component");
-                        if (!root.isNull())
-                        {
-                            /// \todo Duplicate code from Component, to be more relaxed and not require component type
-                            QDomElement attribute_element = root.firstChildElement("attribute");
-                            while(!attribute_element.isNull())
-                            {
-                                IAttribute* attr = 0;
-                                QString id = attribute_element.attribute("id");
-                                // Prefer lookup by ID if it's specified, but fallback to using attribute human-readable name if not defined
-                                if (id.length())
-                                    attr = comps[0]->AttributeById(id);
-                                else
-                                {
-                                    id = attribute_element.attribute("name");
-                                    attr = comps[0]->AttributeByName(id);
-                                }
-
-                                // If DynamicComponent, can also create attribute
-                                if (!attr)
-                                {
-                                    EC_DynamicComponent* dc = dynamic_cast<EC_DynamicComponent*>(comps[0].get());
-                                    if (dc)
-                                    {
-                                        QString newAttrName = attribute_element.attribute("id");
-                                        if (newAttrName.isEmpty())
-                                            newAttrName = attribute_element.attribute("name");
-                                        attr = dc->CreateAttribute(attribute_element.attribute("type"), newAttrName);
-                                    }
-                                }
-
-                                if (!attr)
-                                    LogWarning(comps[0]->TypeName() + "::DeserializeFrom: Could not find attribute \"" + id + "\" specified in the XML element.");
-                                else
-                                    attr->FromString(attribute_element.attribute("value"), AttributeChange::Default);
-                                attribute_element = attribute_element.nextSiblingElement("attribute");
-                            }
-
-                            // Reply is the new content of the component
-                            QByteArray componentXml;
-                            QDomDocument componentDoc("Component");
-                            QDomElement empty;
-                            comps[0]->SerializeTo(componentDoc, empty, true);
-                            componentXml = componentDoc.toByteArray();
-                            SetHttpRequestReply(connection, componentXml, "application/xml", websocketpp::http::status_code::ok);
-                            return;
-                        }
-                    }
-                }
-            }
-        }
-        // Injection of whole entity's data (removes existing components and child entities)
-        else if (pathParts.length() == 2 && connection->get_request_body().length())
+        if ((*i)->ImportState() != HttpSceneImport::Running)
         {
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                QByteArray data(connection->get_request_body().c_str());
-                QTextStream stream(&data);
-                stream.setCodec("UTF-8");
-                QDomDocument ent_doc("Entity");
-                QString errorMsg;
-                int errorLine, errorColumn;
-                if (!ent_doc.setContent(stream.readAll(), &errorMsg, &errorLine, &errorColumn))
-                {
-                    SetHttpRequestReply(connection, QString("XML decode error " + errorMsg + " at line " + QString::number(errorLine)), "text/plain", websocketpp::http::status_code::bad_request);
-                    return;
-                }
-                else
-                {
-                    QDomElement root = ent_doc.firstChildElement("entity");
-                    if (!root.isNull())
-                    {
-                        entity->RemoveAllComponents();
-                        entity->RemoveAllChildren();
-
-                        CreateComponentsToEntity(entity, root);
-                        QDomElement childEnt_elem = root.firstChildElement("entity");
-                        while (!childEnt_elem.isNull())
-                        {
-                            CreateEntity(entity, childEnt_elem);
-                            childEnt_elem = childEnt_elem.nextSiblingElement("entity");
-                        }
-                        
-                        // Reply is the new content of the entity
-                        QByteArray entityXml;
-                        entityXml += entity->SerializeToXMLString(true, true, false);
-                        SetHttpRequestReply(connection, entityXml, "application/xml", websocketpp::http::status_code::ok);
-                        return;
-                    }
-                }
-            }
+            i = imports_.erase(i);
+            --finished;
         }
+        else
+            ++i;
+    }
+}
 
-        SetHttpRequestReply(connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+void HttpServer::ProcessChangeWaiters()
+{
+    if (changeWaiters_.empty())
         return;
-    }
 
-    // Create new
-    if (verb.compare("POST", Qt::CaseInsensitive) == 0)
+    // Changes are recorded as they happen, so a waiter gets all the changes of the frames it waited
+    const kNet::tick_t now = kNet::Clock::Tick();
+    for(std::list<ChangeWaiter>::iterator i = changeWaiters_.begin(); i != changeWaiters_.end();)
     {
-        // New entity without specifying ID, with or without initial data
-        if (pathParts.length() == 1)
+        const bool ready = changeFeed_->HasChangesSince(i->since) || !changeFeed_->IsAvailable(i->since);
+        const bool expired = kNet::Clock::IsNewer(now, i->deadline);
+        if (!ready && !expired)
+        {
+            ++i;
+            continue;
+        }
+        // Event streams keep waiting while none of the changes match their filters
+        if (i->filter)
         {
-            QByteArray data(connection->get_request_body().c_str());
-            QTextStream stream(&data);
-            stream.setCodec("UTF-8");
-            QDomDocument ent_doc("Entity");
-            if (data.length())
+            if (!ReplyWithEvents(i->connection, i->since, *i->filter, true, expired))
             {
-                QString errorMsg;
-                int errorLine, errorColumn;
-                if (!ent_doc.setContent(stream.readAll(), &errorMsg, &errorLine, &errorColumn))
-                {
-                    SetHttpRequestReply(connection, QString("XML decode error " + errorMsg + " at line " + QString::number(errorLine)), "text/plain", websocketpp::http::status_code::bad_request);
-                    return;
-                }
+                ++i;
+                continue;
             }
+        }
+        else
+            ReplyWithChanges(i->connection, i->since, i->format, true);
+        i = changeWaiters_.erase(i);
+    }
+}
 
-            QDomElement ent_elem = ent_doc.firstChildElement("entity");
+void HttpServer::SetChangeFeedSize(uint maxRecords)
+{
+    changeFeed_->SetMaxRecords(maxRecords);
+}
 
-            const bool replicated = ParseBool(ent_elem.attribute("sync"), true);
-            const bool temporary = ParseBool(ent_elem.attribute("temporary"), false);
+void HttpServer::SetChangeFeedCompaction(bool compact)
+{
+    changeFeed_->SetCompaction(compact ? HttpChangeFeed::RingCompaction : HttpChangeFeed::NoCompaction);
+}
 
-            entity_id_t id = replicated ? scene->NextFreeId() : scene->NextFreeIdLocal();
+void HttpServer::SetMaxChangeWait(float seconds)
+{
+    maxChangeWait_ = std::max(seconds, 0.f);
+}
 
-            EntityPtr entity = scene->CreateEntity(id);
-            if (entity)
-            {
-                entity->SetTemporary(temporary);
-                CreateComponentsToEntity(entity, ent_elem);
-                // Reply is the new content of the entity
-                QByteArray entityXml;
-                entityXml += entity->SerializeToXMLString(true, true, false);
-                SetHttpRequestReply(connection, entityXml, "application/xml", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // New entity, with or without initial data
-        else if (pathParts.length() == 2)
-        {
-            QByteArray data(connection->get_request_body().c_str());
-            QTextStream stream(&data);
-            stream.setCodec("UTF-8");
-            QDomDocument ent_doc("Entity");
-            if (data.length())
-            {
-                QString errorMsg;
-                int errorLine, errorColumn;
-                if (!ent_doc.setContent(stream.readAll(), &errorMsg, &errorLine, &errorColumn))
-                {
-                    SetHttpRequestReply(connection, QString("XML decode error " + errorMsg + " at line " + QString::number(errorLine)), "text/plain", websocketpp::http::status_code::bad_request);
-                    return;
-                }
-            }
+void HttpServer::SetEventStreamHeartbeat(float seconds)
+{
+    eventHeartbeat_ = std::max(seconds, 0.f);
+}
 
-            QDomElement ent_elem = ent_doc.firstChildElement("entity");
+void HttpServer::SetEventStreamMaxBytes(uint bytes)
+{
+    eventStreamMaxBytes_ = bytes;
+}
 
-            const bool replicated = ParseBool(ent_elem.attribute("sync"), true);
-            const bool temporary = ParseBool(ent_elem.attribute("temporary"), false);
+void HttpServer::SetRateLimits(float readsPerSecond, float writesPerSecond)
+{
+    rateLimiter_->SetLimit(HttpRateLimiter::ReadRequest, readsPerSecond, 2.f * readsPerSecond);
+    rateLimiter_->SetLimit(HttpRateLimiter::WriteRequest, writesPerSecond, 2.f * writesPerSecond);
+}
 
-            bool ok = false;
-            entity_id_t id = pathParts[1].toUInt(&ok);
-            if (id == 0 || scene->HasEntity(id))
-                id = replicated ? scene->NextFreeId() : scene->NextFreeIdLocal();
+void HttpServer::SetMaxInFlightRequests(uint maxRequests)
+{
+    maxInFlight_ = maxRequests;
+}
 
-            EntityPtr entity = scene->CreateEntity(id);
-            if (entity)
-            {
-                entity->SetTemporary(temporary);
-                CreateComponentsToEntity(entity, ent_elem);
-                // Reply is the new content of the entity
-                QByteArray entityXml;
-                entityXml += entity->SerializeToXMLString(true, true, false);
-                SetHttpRequestReply(connection, entityXml, "application/xml", websocketpp::http::status_code::ok);
-                return;
-            }
-        }
-        // New component, with or without initial data
-        else if (pathParts.length() == 3)
-        {
-            QByteArray data(connection->get_request_body().c_str());
-            QTextStream stream(&data);
-            stream.setCodec("UTF-8");
-            QDomDocument comp_doc("Component");
-            if (data.length())
-            {
-                QString errorMsg;
-                int errorLine, errorColumn;
-                if (!comp_doc.setContent(stream.readAll(), &errorMsg, &errorLine, &errorColumn))
-                {
-                    SetHttpRequestReply(connection, QString("XML decode error " + errorMsg + " at line " + QString::number(errorLine)), "text/plain", websocketpp::http::status_code::bad_request);
-                    return;
-                }
-            }
+void HttpServer::SetMaxSubscribers(uint maxSubscribers)
+{
+    maxSubscribers_ = maxSubscribers;
+}
 
-            bool ok = false;
-            entity_id_t entityId = pathParts[1].toUInt(&ok);
-            EntityPtr entity = scene->EntityById(entityId);
-            if (entity)
-            {
-                /// \todo Only creates replicated components
-                ComponentPtr comp = entity->GetOrCreateComponent(pathParts[2]);
-                if (comp)
-                {
-                    QDomElement root = comp_doc.firstChildElement("component");
-                    if (!root.isNull())
-                    {
-                        /// \todo Duplicate code from Component, to be more relaxed and not require component type
-                        QDomElement attribute_element = root.firstChildElement("attribute");
-                        while(!attribute_element.isNull())
-                        {
-                            IAttribute* attr = 0;
-                            QString id = attribute_element.attribute("id");
-                            // Prefer lookup by ID if it's specified, but fallback to using attribute human-readable name if not defined
-                            if (id.length())
-                                attr = comp->AttributeById(id);
-                            else
-                            {
-                                id = attribute_element.attribute("name");
-                                attr = comp->AttributeByName(id);
-                            }
-                            // If DynamicComponent, can also create attribute
-                            if (!attr)
-                            {
-                                EC_DynamicComponent* dc = dynamic_cast<EC_DynamicComponent*>(comp.get());
-                                if (dc)
-                                {
-                                    QString newAttrName = attribute_element.attribute("id");
-                                    if (newAttrName.isEmpty())
-                                        newAttrName = attribute_element.attribute("name");
-                                    attr = dc->CreateAttribute(attribute_element.attribute("type"), newAttrName);
-                                }
-                            }
-
-                            if (!attr)
-                                LogWarning(comp->TypeName() + "::DeserializeFrom: Could not find attribute \"" + id + "\" specified in the XML element.");
-                            else
-                                attr->FromString(attribute_element.attribute("value"), AttributeChange::Default);
-                            attribute_element = attribute_element.nextSiblingElement("attribute");
-                        }
-                    }
-
-                    // Reply is the new content of the component
-                    QByteArray componentXml;
-                    QDomDocument componentDoc("Component");
-                    QDomElement empty;
-                    comp->SerializeTo(componentDoc, empty, true);
-                    componentXml = componentDoc.toByteArray();
-                    SetHttpRequestReply(connection, componentXml, "application/xml", websocketpp::http::status_code::ok);
-                    return;
-                }
-            }
+void HttpServer::SetMaxChangeWaiters(uint maxWaiters)
+{
+    maxChangeWaiters_ = maxWaiters;
+}
 
-        }
+void HttpServer::SetDocumentRoot(const QString& directory)
+{
+    fileServer_->SetDocumentRoot(directory);
+}
 
+void HttpServer::SetServeAssetCache(bool serve)
+{
+    serveAssetCache_ = serve;
+}
 
-        SetHttpRequestReply(connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+void HttpServer::SetAssetUploads(bool enabled)
+{
+    if (enabled == assetUploads_->IsEnabled())
         return;
-    }
+    assetUploads_->SetEnabled(enabled);
+    if (enabled)
+        router_.AddRoute(HttpPut, "/assets/*name", boost::bind(&HttpServer::HandlePutAsset, this, ::_1));
+    else
+        router_.RemoveRoute(HttpPut, "/assets/*name");
+}
 
-    // If we got here, request illegal or otherwise failed
-    SetHttpRequestStatus(connection, websocketpp::http::status_code::not_found);
+void HttpServer::SetUploadLimits(u64 maxAssetSize, uint maxChunkSize)
+{
+    assetUploads_->SetMaxSize(maxAssetSize);
+    assetUploads_->SetMaxChunkSize(maxChunkSize);
 }
 
-void HttpServer::CreateEntity(EntityPtr parent, const QDomElement& ent_elem)
+void HttpServer::SetImportBudget(float milliseconds)
 {
-    /// \todo Partially duplicate code from Scene
-    Scene* scene = GetActiveScene();
+    importBudgetMs_ = milliseconds;
+}
 
-    const bool replicated = ParseBool(ent_elem.attribute("sync"), true);
-    const bool temporary = ParseBool(ent_elem.attribute("temporary"), false);
+void HttpServer::SetDeferredReplyTimeout(float seconds)
+{
+    if (seconds > 0.f)
+        deferredTimeout_ = seconds;
+}
 
-    QString id_str = ent_elem.attribute("id");
-    entity_id_t id = !id_str.isEmpty() ? static_cast<entity_id_t>(id_str.toInt()) : 0;
-    if (id == 0 || scene->HasEntity(id))
-        id = replicated ? scene->NextFreeId() : scene->NextFreeIdLocal();
-    
-    EntityPtr entity;
-    if (!parent)
-        entity = scene->CreateEntity(id);
-    else
-        entity = parent->CreateChild(id);
+void HttpServer::CheckDeferredReplies()
+{
+    if (deferredReplies_.empty())
+        return;
 
-    if (entity)
+    const kNet::tick_t now = kNet::Clock::Tick();
+    for(std::list<QPointer<HttpDeferredReply> >::iterator i = deferredReplies_.begin(); i != deferredReplies_.end();)
     {
-        entity->SetTemporary(temporary);
-        CreateComponentsToEntity(entity, ent_elem);
-
-        QDomElement childEnt_elem = ent_elem.firstChildElement("entity");
-        while (!childEnt_elem.isNull())
+        HttpDeferredReply* reply = *i;
+        const bool timedOut = reply && reply->IsTimedOut();
+        if (!reply || reply->CheckTimeout(now))
         {
-            CreateEntity(entity, childEnt_elem);
-            childEnt_elem = childEnt_elem.nextSiblingElement("entity");
+            i = deferredReplies_.erase(i);
+            continue;
         }
+        if (!timedOut && reply->IsTimedOut())
+            ++deferredTimeouts_;
+        ++i;
     }
 }
 
-void HttpServer::CreateComponentsToEntity(EntityPtr entity, const QDomElement& root)
+void HttpServer::ProcessEntityStreams()
 {
-    /// \todo Duplicate code from Scene
-    QDomElement comp_elem = root.firstChildElement("component");
-    while(!comp_elem.isNull())
-    {
-        const QString typeName = comp_elem.attribute("type");
-        const u32 typeId = ParseUInt(comp_elem.attribute("typeId"), 0xffffffff);
-        const QString name = comp_elem.attribute("name");
-        const bool compReplicated = ParseBool(comp_elem.attribute("sync"), true);
-        const bool temporary = ParseBool(comp_elem.attribute("temporary"), false);
+    if (entityStreams_.empty())
+        return;
 
-        // If we encounter an unknown component type, now is the time to register a placeholder type for it
-        // The XML holds all needed data for it, while binary doesn't
-        SceneAPI* sceneAPI = framework_->Scene();
-        if (!sceneAPI->IsComponentTypeRegistered(typeName))
-            sceneAPI->RegisterPlaceholderComponentType(comp_elem);
-            
-        ComponentPtr new_comp = (!typeName.isEmpty() ? entity->GetOrCreateComponent(typeName, name, AttributeChange::Default, compReplicated) :
-            entity->GetOrCreateComponent(typeId, name, AttributeChange::Default, compReplicated));
-        if (new_comp)
+    PROFILE(HttpServer_ProcessEntityStreams);
+    for(std::list<shared_ptr<HttpEntityStream> >::iterator i = entityStreams_.begin(); i != entityStreams_.end();)
+    {
+        HttpEntityStream *stream = i->get();
+        if (!stream->Process(streamSliceSize_))
         {
-            new_comp->SetTemporary(temporary);
-            new_comp->DeserializeFrom(comp_elem, AttributeChange::Default);
+            ++i;
+            continue;
         }
 
-        comp_elem = comp_elem.nextSiblingElement("component");
+        const ReplyBuffer body = stream->Body();
+        StoreStreamInCache(*stream, body);
+        SetCompressibleReply(stream->Connection(), body, stream->ContentType(), true, stream->CacheKey(), stream->ETag());
+        i = entityStreams_.erase(i);
+    }
+}
+
+bool HttpServer::RunNextHandler()
+{
+    // Work posted by the I/O threads or by compression jobs. Without I/O threads the event loop itself is polled here too.
+    MainThreadWork work;
+    if (!mainThreadWork_.TryPop(work))
+        return !ioThreaded_ && server_->get_io_service().poll_one() > 0;
+    work.task();
+    return true;
+}
+
+void HttpServer::RunInMainThread(const MainThreadTask &task)
+{
+    MainThreadWork work;
+    work.task = task;
+    mainThreadWork_.Push(work);
+}
+
+void HttpServer::CancelMainThreadTasks()
+{
+    MainThreadWork work;
+    while(mainThreadWork_.TryPop(work))
+    {
+        if (work.cancelled)
+            work.cancelled();
     }
 }
 
+void HttpServer::SetIoThreadCount(uint numThreads)
+{
+    if (server_)
+        LogWarning("HttpServer::SetIoThreadCount: the server is already running, the thread count takes effect on next start.");
+    numIoThreads_ = numThreads;
+}
+
+void HttpServer::StoreStreamInCache(const HttpEntityStream &stream, const ReplyBuffer &body)
+{
+    // Only if nothing changed while the list was being written
+    if (stream.CacheKey().isEmpty() || stream.ETag() != sceneCache_->SceneETag(stream.Format()))
+        return;
+
+    HttpCachedReply reply;
+    reply.etag = stream.ETag();
+    reply.contentType = stream.ContentType();
+    reply.body = body;
+    sceneCache_->Insert(stream.CacheKey(), reply);
+}
+
+void HttpServer::SetCacheSize(uint maxEntries)
+{
+    delete sceneCache_;
+    sceneCache_ = new HttpSceneCache(maxEntries);
+}
+
+void HttpServer::SetSubscriptionQueueLimit(uint bytes)
+{
+    subscriptions_->SetMaxQueuedBytes(bytes);
+}
+
+void HttpServer::SetSpatialCellSize(float cellSize)
+{
+    spatialIndex_->SetCellSize(cellSize);
+}
+
+void HttpServer::AddEntityIndex(const QString& componentType, const QString& attribute)
+{
+    entityIndex_->AddAttributeIndex(componentType, attribute);
+}
+
+void HttpServer::SetCompressionMinSize(uint bytes)
+{
+    compressMinSize_ = bytes;
+}
+
+void HttpServer::SetStreamSliceSize(uint numEntities)
+{
+    streamSliceSize_ = std::max(numEntities, 1u);
+}
+
+void HttpServer::SetFrameBudget(float milliseconds)
+{
+    frameBudgetMs_ = milliseconds;
+}
+
+QVariantMap HttpServer::UpdateStatistics() const
+{
+    QVariantMap stats;
+    stats["frameBudgetMs"] = frameBudgetMs_;
+    stats["handlersExecuted"] = handlersExecuted_;
+    stats["totalHandlersExecuted"] = (qulonglong)totalHandlersExecuted_;
+    stats["backloggedFrames"] = backloggedFrames_;
+    stats["budgetOverruns"] = budgetOverruns_;
+    stats["lastDrainMs"] = lastDrainMs_;
+    stats["maxOverrunMs"] = maxOverrunMs_;
+    stats["cacheEntries"] = sceneCache_->NumEntries();
+    stats["cacheHits"] = sceneCache_->Hits();
+    stats["cacheMisses"] = sceneCache_->Misses();
+    stats["notModifiedReplies"] = notModifiedReplies_;
+    stats["compressedReplies"] = compressedReplies_;
+    stats["compressedCacheHits"] = compressedCacheHits_;
+    stats["subscribers"] = subscriptions_->NumClients();
+    stats["subscriptionMessages"] = subscriptions_->MessagesSent();
+    stats["coalescedChanges"] = subscriptions_->CoalescedChanges();
+    stats["heldBackFrames"] = subscriptions_->HeldBackFrames();
+    stats["droppedSubscribers"] = subscriptions_->DroppedClients();
+    stats["spatialEntities"] = spatialIndex_->NumEntities();
+    stats["spatialCells"] = spatialIndex_->NumCells();
+    stats["spatialQueries"] = spatialIndex_->NumQueries();
+    stats["spatialCandidates"] = (qulonglong)spatialIndex_->NumCandidates();
+    stats["indexAttributeIndexes"] = entityIndex_->NumAttributeIndexes();
+    stats["indexMemoryBytes"] = (qulonglong)entityIndex_->MemoryUsage();
+    stats["indexLookups"] = entityIndex_->Lookups();
+    stats["indexHits"] = entityIndex_->IndexHits();
+    stats["indexMisses"] = entityIndex_->IndexMisses();
+    const uint filters = entityIndex_->IndexHits() + entityIndex_->IndexMisses();
+    stats["indexHitRate"] = filters ? (double)entityIndex_->IndexHits() / filters : 0.0;
+    stats["subscriptionJsonBytes"] = subscriptions_->JsonBytesSent();
+    stats["subscriptionBinaryBytes"] = subscriptions_->BinaryBytesSent();
+    stats["unroutedRequests"] = unroutedRequests_;
+    stats["changeSequence"] = (qulonglong)changeFeed_->Sequence();
+    stats["changeRecords"] = changeFeed_->NumRecords();
+    stats["changesCompacted"] = changeFeed_->CompactedChanges();
+    stats["changesDropped"] = changeFeed_->DroppedRecords();
+    stats["changeWaiters"] = (uint)changeWaiters_.size();
+    stats["eventReplies"] = eventReplies_;
+    stats["eventHeartbeats"] = eventHeartbeats_;
+    stats["inFlightRequests"] = (int)queuedRequests_ + (int)parkedReplies_;
+    stats["rateLimitedReads"] = rateLimiter_->Refused(HttpRateLimiter::ReadRequest);
+    stats["rateLimitedWrites"] = rateLimiter_->Refused(HttpRateLimiter::WriteRequest);
+    stats["rateLimitAddresses"] = rateLimiter_->NumAddresses();
+    stats["overloadRefusals"] = (int)overloadRefusals_;
+    stats["refusedSubscribers"] = (int)refusedSubscribers_;
+    stats["fileReplies"] = fileServer_->Replies();
+    stats["fileRangeReplies"] = fileServer_->RangeReplies();
+    stats["fileNotModified"] = fileServer_->NotModifiedReplies();
+    stats["assetUploads"] = assetUploads_->NumUploads();
+    stats["assetUploadBytes"] = (qulonglong)assetUploads_->BytesReceived();
+    stats["assetsUploaded"] = assetsUploaded_;
+    stats["imports"] = (uint)imports_.size();
+    stats["entityIdBlocks"] = idBlocks_->NumBlocks();
+    stats["entityIdBlockEntities"] = idBlockEntities_;
+    stats["pendingDeferredReplies"] = (uint)deferredReplies_.size();
+    stats["deferredTimeouts"] = deferredTimeouts_;
+    stats["routes"] = router_.Statistics();
+    return stats;
+}
+
+bool HttpServer::Start()
+{
+    Reset();
+
+    // The cache directory is resolved here, as the asset API is not used outside the main thread
+    AssetCache *assetCache = framework_->Asset()->GetAssetCache();
+    fileServer_->SetAssetCacheDirectory(serveAssetCache_ && assetCache ? assetCache->CacheDirectory() : QString());
+    
+    try
+    {
+        server_ = ServerPtr(new websocketpp::server<websocketpp::config::asio>());
+
+        // Initialize ASIO transport
+        server_->init_asio();
+
+        // Register handler callbacks
+        server_->set_http_handler(boost::bind(&HttpServer::OnHttpRequest, this, ::_1));
+        server_->set_validate_handler(boost::bind(&HttpServer::OnWebSocketValidate, this, ::_1));
+        server_->set_open_handler(boost::bind(&HttpServer::OnWebSocketOpen, this, ::_1));
+        server_->set_close_handler(boost::bind(&HttpServer::OnWebSocketClose, this, ::_1));
+        server_->set_message_handler(boost::bind(&HttpServer::OnWebSocketMessage, this, ::_1, ::_2));
+
+        // With uploads enabled, an oversized body is refused with 413 while it is read, before it is buffered whole
+        if (assetUploads_->IsEnabled())
+            server_->set_max_http_body_size(assetUploads_->MaxChunkSize());
+
+        // Setup logging
+        server_->get_alog().clear_channels(websocketpp::log::alevel::all);
+        server_->get_elog().clear_channels(websocketpp::log::elevel::all);
+        server_->get_elog().set_channels(websocketpp::log::elevel::rerror);
+        server_->get_elog().set_channels(websocketpp::log::elevel::fatal);
+
+        server_->listen(port_);
+
+        // Start the server accept loop
+        server_->start_accept();
+        subscriptions_->SetServer(server_);
+    } 
+    catch (std::exception &e) 
+    {
+        LogError(QString::fromStdString(e.what()));
+        return false;
+    }
+
+    // Decided before any thread starts, so that no request is dispatched outside the main thread
+    ioThreaded_ = (numIoThreads_ > 0 ? 1 : 0);
+    for(uint i = 0; i < numIoThreads_; ++i)
+    {
+        HttpIoThread *thread = new HttpIoThread(server_);
+        thread->start();
+        ioThreads_.push_back(thread);
+    }
+    
+    if (ioThreads_.empty())
+        LogInfo("HttpServer started on port " + QString::number(port_));
+    else
+        LogInfo("HttpServer started on port " + QString::number(port_) + " with " + QString::number(ioThreads_.size()) + " I/O threads");
+    emit ServerStarted();
+    
+    return true;
+}
+
+void HttpServer::Stop()
+{    
+    try
+    {
+        if (server_)
+        {
+            server_->stop();
+            emit ServerStopped();
+        }
+    }
+    catch (std::exception &e) 
+    {
+        LogError("Error while closing server: " + QString::fromStdString(e.what()));
+        return;
+    }
+
+    
+    LogDebug("Stopped HttpServer"); 
+    
+    Reset();
+}
+
+void HttpServer::Reset()
+{
+    // Compression jobs post their results to the main thread queue, which is emptied below
+    compressionPool_.waitForDone();
+
+    // Pending deferred replies cannot be sent once the server is gone
+    for(std::list<QPointer<HttpDeferredReply> >::iterator i = deferredReplies_.begin(); i != deferredReplies_.end(); ++i)
+        delete i->data();
+    deferredReplies_.clear();
+
+    if (!ioThreads_.empty())
+    {
+        stopping_ = 1;
+        try
+        {
+            server_->get_io_service().stop();
+        }
+        catch (std::exception &e)
+        {
+            LogError("Error while stopping HttpServer I/O: " + QString::fromStdString(e.what()));
+        }
+
+        for(size_t i = 0; i < ioThreads_.size(); ++i)
+        {
+            ioThreads_[i]->wait();
+            delete ioThreads_[i];
+        }
+        ioThreads_.clear();
+    }
+    ioThreaded_ = 0;
+    // Requests queued by the I/O threads and not handled yet are answered with 503
+    CancelMainThreadTasks();
+    stopping_ = 0;
+    queuedRequests_ = 0;
+    parkedReplies_ = 0;
+    subscriberConnections_ = 0;
+    overloadRefusals_ = 0;
+    refusedSubscribers_ = 0;
+    rateLimiter_->ResetStatistics();
+    fileServer_->ResetStatistics();
+    fileServer_->ClearCache();
+    assetUploads_->Clear();
+    assetUploads_->ResetStatistics();
+    assetsUploaded_ = 0;
+
+    entityStreams_.clear();
+    changeWaiters_.clear();
+    subscriptions_->SetServer(HttpServer::ServerPtr());
+
+    server_.reset();
+
+    handlersExecuted_ = 0;
+    totalHandlersExecuted_ = 0;
+    backloggedFrames_ = 0;
+    budgetOverruns_ = 0;
+    lastDrainMs_ = 0.f;
+    maxOverrunMs_ = 0.f;
+    notModifiedReplies_ = 0;
+    compressedReplies_ = 0;
+    compressedCacheHits_ = 0;
+    unroutedRequests_ = 0;
+    deferredTimeouts_ = 0;
+    eventReplies_ = 0;
+    eventHeartbeats_ = 0;
+    imports_.clear();
+    idBlocks_->Clear();
+    idBlockEntities_ = 0;
+    router_.ResetStatistics();
+    metrics_.Reset();
+    pendingMetrics_.clear();
+    sceneCache_->SetScene(0);
+    spatialIndex_->SetScene(0);
+    entityIndex_->SetScene(0);
+    changeFeed_->SetScene(0);
+}
+
+Scene* HttpServer::GetActiveScene()
+{
+    Scene *scene = framework_->Scene()->MainCameraScene();
+    if (scene)
+        return scene;
+    else
+        return framework_->Scene()->SceneByName("TundraServer").get();
+}
+
+void HttpServer::OnHttpRequest(ConnectionHandle connection)
+{
+    const kNet::tick_t received = kNet::Clock::Tick();
+    ConnectionPtr connectionPtr = server_->get_con_from_hdl(connection);
+
+    // Refused requests, files and asset upload chunks are answered right here, without involving the main thread.
+    // Only a completed upload goes on to its route, for registering the asset.
+    if (!AdmitRequest(connectionPtr))
+    {
+        RecordDirectReply(connectionPtr, "(refused)", received);
+        return;
+    }
+    const HttpVerb httpVerb = HttpRouter::ParseVerb(connectionPtr->get_request().get_method());
+    if (fileServer_->Serve(connectionPtr, httpVerb, connectionPtr->get_resource()))
+    {
+        RecordDirectReply(connectionPtr, "(files)", received);
+        return;
+    }
+    if (assetUploads_->WriteChunk(connectionPtr, httpVerb, connectionPtr->get_resource()) == HttpAssetUploads::Replied)
+    {
+        RecordDirectReply(connectionPtr, "(uploads)", received);
+        return;
+    }
+
+    QString path = QString::fromStdString(connectionPtr->get_resource()).toUtf8();
+    QString verb = QString::fromStdString(connectionPtr->get_request().get_method());
+
+    if (!ioThreaded_)
+    {
+        DispatchHttpRequest(connectionPtr, path, verb, received);
+        return;
+    }
+
+    // In an I/O thread: defer the reply and hand the request to the main thread, which sends the reply once
+    // the handler has run. The I/O thread goes on serving other connections meanwhile.
+    if (stopping_)
+    {
+        SetHttpRequestReply(connectionPtr, "Service Unavailable", "text/plain", websocketpp::http::status_code::service_unavailable);
+        return;
+    }
+    websocketpp::lib::error_code ec = connectionPtr->defer_http_response();
+    if (ec)
+    {
+        LogError("HttpServer: could not defer reply to the main thread: " + QString::fromStdString(ec.message()));
+        SetHttpRequestReply(connectionPtr, "Internal Server Error", "text/plain", websocketpp::http::status_code::internal_server_error);
+        return;
+    }
+
+    queuedRequests_.ref();
+    MainThreadWork work;
+    work.task = boost::bind(&HttpServer::RunQueuedRequest, this, connectionPtr, path, verb, received);
+    work.cancelled = boost::bind(&HttpServer::CancelQueuedRequest, this, connectionPtr);
+    mainThreadWork_.Push(work);
+}
+
+void HttpServer::RunQueuedRequest(ConnectionPtr connection, const QString& path, const QString& verb, kNet::tick_t received)
+{
+    queuedRequests_.deref();
+    if (DispatchHttpRequest(connection, path, verb, received))
+        return;
+    try
+    {
+        connection->send_http_response();
+    }
+    catch (std::exception &e)
+    {
+        LogError("HttpServer: failed to send reply: " + QString::fromStdString(e.what()));
+    }
+}
+
+void HttpServer::CancelQueuedRequest(ConnectionPtr connection)
+{
+    queuedRequests_.deref();
+    SetHttpRequestReply(connection, "Service Unavailable", "text/plain", websocketpp::http::status_code::service_unavailable);
+    try
+    {
+        connection->send_http_response();
+    }
+    catch (std::exception &)
+    {
+        // The connection is closed along with the server
+    }
+}
+
+bool HttpServer::OnWebSocketValidate(ConnectionHandle connection)
+{
+    // WebSocket connections are only accepted for the subscription channel
+    ConnectionPtr connectionPtr = server_->get_con_from_hdl(connection);
+    if (connectionPtr->get_resource() != "/subscribe")
+        return false;
+    if (maxSubscribers_ > 0 && (uint)(int)subscriberConnections_ >= maxSubscribers_)
+    {
+        refusedSubscribers_.ref();
+        // websocketpp keeps a status set by the handler for the refusal
+        connectionPtr->set_status(websocketpp::http::status_code::service_unavailable);
+        connectionPtr->replace_header("Retry-After", "5");
+        return false;
+    }
+    return true;
+}
+
+void HttpServer::OnWebSocketOpen(ConnectionHandle connection)
+{
+    subscriberConnections_.ref();
+    if (!ioThreaded_)
+        AddSubscriber(connection);
+    else if (!stopping_)
+        RunInMainThread(boost::bind(&HttpServer::AddSubscriber, this, connection));
+}
+
+void HttpServer::OnWebSocketClose(ConnectionHandle connection)
+{
+    subscriberConnections_.deref();
+    if (!ioThreaded_)
+        subscriptions_->RemoveClient(connection);
+    else if (!stopping_)
+        RunInMainThread(boost::bind(&HttpSubscriptionChannel::RemoveClient, subscriptions_, connection));
+}
+
+void HttpServer::OnWebSocketMessage(ConnectionHandle connection, MessagePtr message)
+{
+    if (!ioThreaded_)
+        subscriptions_->HandleMessage(connection, message->get_payload());
+    else if (!stopping_)
+        RunInMainThread(boost::bind(&HttpSubscriptionChannel::HandleMessage, subscriptions_, connection, message->get_payload()));
+}
+
+void HttpServer::AddSubscriber(ConnectionHandle connection)
+{
+    subscriptions_->SetScene(GetActiveScene());
+    subscriptions_->AddClient(connection);
+}
+
+bool HttpServer::AdmitRequest(ConnectionPtr connection)
+{
+    // Overload protection comes first, so that a flood from many addresses is refused as well
+    if (maxInFlight_ > 0 && (uint)((int)queuedRequests_ + (int)parkedReplies_) >= maxInFlight_)
+    {
+        overloadRefusals_.ref();
+        RefuseRequest(connection, websocketpp::http::status_code::service_unavailable, 1.f);
+        return false;
+    }
+
+    const HttpVerb verb = HttpRouter::ParseVerb(connection->get_request().get_method());
+    const HttpRateLimiter::RequestClass requestClass = (verb == HttpGet || verb == HttpHead || verb == HttpOptions) ?
+        HttpRateLimiter::ReadRequest : HttpRateLimiter::WriteRequest;
+    const float retryAfter = rateLimiter_->Admit(RemoteAddress(connection), requestClass);
+    if (retryAfter > 0.f)
+    {
+        RefuseRequest(connection, websocketpp::http::status_code::too_many_requests, retryAfter);
+        return false;
+    }
+    return true;
+}
+
+void HttpServer::RefuseRequest(ConnectionPtr connection, websocketpp::http::status_code::value status, float retryAfterSeconds)
+{
+    // Retry-After is in whole seconds
+    connection->replace_header("Retry-After", boost::lexical_cast<std::string>(std::max((int)std::ceil(retryAfterSeconds), 1)));
+    SetHttpRequestReply(connection, status == websocketpp::http::status_code::too_many_requests ? "Too Many Requests" : "Service Unavailable",
+        "text/plain", status);
+}
+
+bool HttpServer::DispatchHttpRequest(ConnectionPtr connection, const QString& path, const QString& verb, kNet::tick_t received)
+{
+    PROFILE(HttpServer_DispatchHttpRequest);
+
+    const kNet::tick_t started = kNet::Clock::Tick();
+    HttpRequest request;
+    request.connection = connection;
+    request.verb = HttpRouter::ParseVerb(verb);
+    request.url = QUrl(path);
+    request.path = request.url.path();
+
+    // Run the handler of the matching route, otherwise defer to a signal
+    HttpRouter::Handler handler;
+    QString allowedVerbs;
+    const HttpRouter::MatchResult match = router_.Match(request, handler, allowedVerbs);
+
+    // Unrouted requests are counted together so that arbitrary paths do not each get series of their own
+    PendingMetrics pending;
+    pending.connection = connection;
+    pending.route = metrics_.Route(MetricsVerb(request.verb), match == HttpRouter::RouteMatched ? request.route : QString("(none)"));
+    pending.received = received;
+    // Known before the handler runs, in case the deferred reply is sent before it returns
+    pendingMetrics_[connection.get()] = pending;
+    replyDeferred_ = false;
+
+    switch(match)
+    {
+    case HttpRouter::RouteMatched:
+    {
+        PROFILE(HttpServer_RouteHandler);
+        handler(request);
+        break;
+    }
+    case HttpRouter::VerbNotAllowed:
+        // The signal may still handle verbs that the path has no route for, such as PUT /assets/ with uploads disabled
+        ++unroutedRequests_;
+        emit HttpRequestReceived(connection, path, verb);
+        if (!replyDeferred_ && connection->get_response_code() == websocketpp::http::status_code::uninitialized)
+        {
+            connection->replace_header("Allow", allowedVerbs.toStdString());
+            SetHttpRequestStatus(connection, websocketpp::http::status_code::method_not_allowed);
+        }
+        break;
+    default:
+        ++unroutedRequests_;
+        emit HttpRequestReceived(connection, path, verb);
+        break;
+    }
+
+    const kNet::tick_t finished = kNet::Clock::Tick();
+    metrics_.RecordRequest(pending.route, kNet::Clock::TimespanToSecondsD(received, started), kNet::Clock::TimespanToSecondsD(started, finished),
+        connection->get_request_body().size());
+    const bool deferred = replyDeferred_;
+    if (!deferred)
+    {
+        // The reply is written as soon as the handler returns
+        pendingMetrics_.erase(connection.get());
+        metrics_.RecordReply(pending.route, connection->get_response_code(),
+            QString::fromStdString(connection->get_response_header("Content-Length")).toULongLong(), kNet::Clock::TimespanToSecondsD(received, finished));
+    }
+    replyDeferred_ = false;
+    return deferred;
+}
+
+websocketpp::lib::error_code HttpServer::DeferHttpResponse(ConnectionPtr connection)
+{
+    websocketpp::lib::error_code ec = connection->defer_http_response();
+    if (!ec)
+        replyDeferred_ = true;
+    return ec;
+}
+
+void HttpServer::RecordDirectReply(ConnectionPtr connection, const QString& route, kNet::tick_t received)
+{
+    // The metrics are only touched from the main thread
+    const QString verb = MetricsVerb(HttpRouter::ParseVerb(connection->get_request().get_method()));
+    const int status = connection->get_response_code();
+    const u64 bytesIn = connection->get_request_body().size();
+    const u64 bytesOut = QString::fromStdString(connection->get_response_header("Content-Length")).toULongLong();
+    const double seconds = kNet::Clock::TimespanToSecondsD(received, kNet::Clock::Tick());
+    if (!ioThreaded_)
+        RecordMetrics(verb, route, status, bytesIn, bytesOut, seconds);
+    else if (!stopping_)
+        RunInMainThread(boost::bind(&HttpServer::RecordMetrics, this, verb, route, status, bytesIn, bytesOut, seconds));
+}
+
+void HttpServer::RecordMetrics(const QString& verb, const QString& route, int status, u64 bytesIn, u64 bytesOut, double seconds)
+{
+    HttpMetrics::RouteMetrics *metrics = metrics_.Route(verb, route);
+    metrics_.RecordRequest(metrics, 0.0, seconds, bytesIn);
+    metrics_.RecordReply(metrics, status, bytesOut, seconds);
+}
+
+bool HttpServer::AddRoute(const QString& verb, const QString& pattern, const HttpRouter::Handler& handler)
+{
+    return router_.AddRoute(HttpRouter::ParseVerb(verb), pattern, handler);
+}
+
+namespace
+{
+
+void DispatchToScriptRoute(QPointer<HttpScriptRoute> route, HttpServer* server, const HttpRequest& request)
+{
+    if (!route)
+        server->SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+    else if (!route->IsDeferred())
+        route->Dispatch(request);
+    else
+    {
+        HttpDeferredReply* reply = server->DeferReply(request.connection);
+        if (reply)
+            route->DispatchDeferred(request, reply);
+        else
+            server->SetHttpRequestStatus(request.connection, websocketpp::http::status_code::internal_server_error);
+    }
+}
+
+}
+
+HttpScriptRoute* HttpServer::AddScriptRoute(const QString& verb, const QString& pattern)
+{
+    HttpScriptRoute* route = new HttpScriptRoute(verb.toUpper(), pattern, this);
+    if (!router_.AddRoute(HttpRouter::ParseVerb(verb), pattern, boost::bind(&DispatchToScriptRoute, QPointer<HttpScriptRoute>(route), this, ::_1)))
+    {
+        LogError("HttpServer::AddScriptRoute: invalid or already registered route " + verb + " " + pattern);
+        delete route;
+        return 0;
+    }
+    scriptRoutes_[route->Verb() + ' ' + pattern] = route;
+    return route;
+}
+
+bool HttpServer::RemoveRoute(const QString& verb, const QString& pattern)
+{
+    HttpScriptRoute* route = scriptRoutes_.take(verb.toUpper() + ' ' + pattern);
+    if (route)
+        route->deleteLater();
+    return router_.RemoveRoute(HttpRouter::ParseVerb(verb), pattern);
+}
+
+HttpServer::ReplyBuffer HttpServer::MakeReplyBuffer(const QByteArray& data)
+{
+    return ReplyBuffer(new std::string(data.constData(), data.size()));
+}
+
+void HttpServer::SetReplyBody(ConnectionPtr connection, const std::string& body, const char* contentType, websocketpp::http::status_code::value status)
+{
+    // websocketpp keeps a copy of its own, which is the only copy made of a reply buffer
+    connection->set_status(status);
+    connection->set_body(body);
+    connection->replace_header("Content-Length", boost::lexical_cast<std::string>(body.size()));
+    connection->replace_header("Content-Type", contentType);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, websocketpp::http::status_code::value status)
+{
+    if (body)
+        SetReplyBody(connection, *body, contentType, status);
+    else
+        SetReplyBody(connection, std::string(), contentType, status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QByteArray& replyData, const char* contentType, websocketpp::http::status_code::value status)
+{
+    SetReplyBody(connection, std::string(replyData.constData(), replyData.size()), contentType, status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QString& reply, const char* contentType, websocketpp::http::status_code::value status)
+{
+    const QByteArray replyData = reply.toUtf8();
+    SetReplyBody(connection, std::string(replyData.constData(), replyData.size()), contentType, status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const char* reply, const char* contentType, websocketpp::http::status_code::value status)
+{
+    SetReplyBody(connection, std::string(reply), contentType, status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QByteArray& replyData, const QString& contentType, websocketpp::http::status_code::value status)
+{
+    SetHttpRequestReply(connection, replyData, contentType.toUtf8().constData(), status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const QString& reply, const QString& contentType, websocketpp::http::status_code::value status)
+{
+    SetHttpRequestReply(connection, reply, contentType.toUtf8().constData(), status);
+}
+
+void HttpServer::SetHttpRequestReply(ConnectionPtr connection, const char* reply, const QString& contentType, websocketpp::http::status_code::value status)
+{
+    SetHttpRequestReply(connection, reply, contentType.toUtf8().constData(), status);
+}
+
+void HttpServer::SetHttpRequestStatus(ConnectionPtr connection, websocketpp::http::status_code::value status)
+{
+    connection->set_status(status);
+}
+
+HttpServer::ContentFormat HttpServer::ReplyFormat(ConnectionPtr connection, const QUrl& url) const
+{
+    // Explicit ?format= overrides the Accept header, handy for testing from a browser
+    if (url.hasQueryItem("format"))
+        return url.queryItemValue("format").compare("json", Qt::CaseInsensitive) == 0 ? JsonFormat : XmlFormat;
+
+    // Prefer whichever of JSON and XML is listed first; XML if neither is
+    const std::string accept = connection->get_request_header("Accept");
+    size_t jsonPos = accept.find("application/json");
+    if (jsonPos == std::string::npos)
+        return XmlFormat;
+    size_t xmlPos = accept.find("xml");
+    return (xmlPos == std::string::npos || jsonPos < xmlPos) ? JsonFormat : XmlFormat;
+}
+
+bool HttpServer::WantsBinaryScene(ConnectionPtr connection, const QUrl& url) const
+{
+    if (url.hasQueryItem("format"))
+        return url.queryItemValue("format").compare("binary", Qt::CaseInsensitive) == 0;
+    return connection->get_request_header("Accept").find("application/octet-stream") != std::string::npos;
+}
+
+bool HttpServer::IsJsonBody(ConnectionPtr connection) const
+{
+    const std::string contentType = connection->get_request_header("Content-Type");
+    if (contentType.find("json") != std::string::npos)
+        return true;
+    if (contentType.find("xml") != std::string::npos)
+        return false;
+
+    // No usable Content-Type, look at the first non-whitespace character
+    const std::string &body = connection->get_request_body();
+    size_t pos = body.find_first_not_of(" \t\r\n");
+    return pos != std::string::npos && (body[pos] == '{' || body[pos] == '[');
+}
+
+void HttpServer::ReplyWithScene(ConnectionPtr connection, Scene* scene, ContentFormat format, const QString& cacheKey, const QByteArray& etag)
+{
+    // Root level entities; children are written inside their parents
+    std::vector<entity_id_t> ids;
+    const Scene::EntityMap &entities = scene->Entities();
+    ids.reserve(entities.size());
+    for(Scene::EntityMap::const_iterator i = entities.begin(); i != entities.end(); ++i)
+    {
+        if (!i->second->Parent())
+            ids.push_back(i->first);
+    }
+    ReplyWithEntities(connection, scene, ids, format, SceneJsonWriter::cAllChildren, cacheKey, etag);
+}
+
+void HttpServer::ReplyWithEntities(ConnectionPtr connection, Scene* scene, const std::vector<entity_id_t>& ids, ContentFormat format, uint childDepth,
+    const QString& cacheKey, const QByteArray& etag, const HttpFieldSelection* fields)
+{
+    shared_ptr<HttpEntityStream> stream(new HttpEntityStream(connection, scene->shared_from_this(), ids, format, childDepth));
+    stream->SetCacheKey(cacheKey, etag);
+    if (fields)
+        stream->SetFieldSelection(*fields);
+
+    // Short lists are written right away, long ones over several frames
+    if (ids.size() > streamSliceSize_)
+    {
+        websocketpp::lib::error_code ec = DeferHttpResponse(connection);
+        if (!ec)
+        {
+            stream->Process(streamSliceSize_);
+            entityStreams_.push_back(stream);
+            return;
+        }
+        LogWarning("HttpServer: could not defer reply, serializing " + QString::number(ids.size()) + " entities at once: " + QString::fromStdString(ec.message()));
+    }
+
+    stream->Process((uint)ids.size());
+    const ReplyBuffer body = stream->Body();
+    StoreStreamInCache(*stream, body);
+    SetCompressibleReply(connection, body, stream->ContentType(), false, cacheKey, etag);
+}
+
+bool HttpServer::ReplyWithSpatialQuery(ConnectionPtr connection, Scene* scene, const QUrl& url, ContentFormat format)
+{
+    spatialIndex_->SetScene(scene);
+
+    std::vector<float> values;
+    if (url.hasQueryItem("near"))
+    {
+        bool ok = false;
+        const float radius = url.queryItemValue("radius").toFloat(&ok);
+        if (!ok || !(radius >= 0.f) || radius > 1e30f || !ParseFloats(url.queryItemValue("near"), 3, values))
+            return false;
+        ReplyWithEntityPage(connection, scene, spatialIndex_->QuerySphere(float3(values[0], values[1], values[2]), radius), url, format, false);
+    }
+    else
+    {
+        if (!ParseFloats(url.queryItemValue("aabb"), 6, values))
+            return false;
+        const float3 minPoint(values[0], values[1], values[2]);
+        const float3 maxPoint(values[3], values[4], values[5]);
+        ReplyWithEntityPage(connection, scene, spatialIndex_->QueryBox(minPoint.Min(maxPoint), minPoint.Max(maxPoint)), url, format, true);
+    }
+    return true;
+}
+
+void HttpServer::ReplyWithFilteredEntities(ConnectionPtr connection, Scene* scene, const QUrl& url, ContentFormat format)
+{
+    entityIndex_->SetScene(scene);
+
+    HttpEntityIndex::AttributeFilter attributes;
+    const QList<QPair<QString, QString> > items = url.queryItems();
+    for(int i = 0; i < items.size(); ++i)
+    {
+        if (items[i].first.startsWith("attr."))
+            attributes.push_back(qMakePair(items[i].first.mid(5), items[i].second));
+    }
+
+    ReplyWithEntityPage(connection, scene, entityIndex_->Find(url.queryItemValue("component"), attributes), url, format, true);
+}
+
+void HttpServer::ReplyWithEntityPage(ConnectionPtr connection, Scene* scene, std::vector<entity_id_t> ids, const QUrl& url, ContentFormat format, bool idOrder)
+{
+    connection->replace_header("X-Total-Count", QString::number(ids.size()).toStdString());
+
+    // The cursor is the last id of the previous page, so pages stay stable while entities are added and removed
+    if (idOrder && url.hasQueryItem("cursor"))
+    {
+        const entity_id_t cursor = url.queryItemValue("cursor").toUInt();
+        ids.erase(ids.begin(), std::upper_bound(ids.begin(), ids.end(), cursor));
+    }
+    const uint offset = url.queryItemValue("offset").toUInt();
+    ids.erase(ids.begin(), ids.begin() + std::min((size_t)offset, ids.size()));
+
+    bool ok = false;
+    const uint limit = url.queryItemValue("limit").toUInt(&ok);
+    if (ok && limit < ids.size())
+    {
+        ids.resize(limit);
+        if (idOrder && !ids.empty())
+            connection->replace_header("X-Next-Cursor", QString::number(ids.back()).toStdString());
+    }
+
+    // The depth has been checked by the handler
+    uint childDepth = 0;
+    ParseChildDepth(url, childDepth);
+    const HttpFieldSelection fields = HttpFieldSelection::Parse(url.queryItemValue("fields"));
+    ReplyWithEntities(connection, scene, ids, format, childDepth, QString(), QByteArray(), fields.IsEmpty() ? 0 : &fields);
+}
+
+bool HttpServer::ParseChildDepth(const QUrl& url, uint& childDepth)
+{
+    childDepth = 0;
+    if (!url.hasQueryItem("depth"))
+        return true;
+    const QString depth = url.queryItemValue("depth");
+    if (depth.compare("all", Qt::CaseInsensitive) == 0)
+    {
+        childDepth = SceneJsonWriter::cAllChildren;
+        return true;
+    }
+    bool ok = false;
+    childDepth = depth.toUInt(&ok);
+    return ok && childDepth != SceneJsonWriter::cAllChildren;
+}
+
+const char* HttpServer::ContentTypeOf(ContentFormat format)
+{
+    switch(format)
+    {
+    case JsonFormat: return "application/json";
+    case BinaryFormat: return "application/octet-stream";
+    default: return "application/xml";
+    }
+}
+
+QByteArray HttpServer::SerializeEntity(Entity* entity, ContentFormat format, uint childDepth) const
+{
+    QByteArray entityData;
+    if (format == JsonFormat)
+        SceneJsonWriter(entityData).WriteEntityTree(entity, childDepth);
+    else if (childDepth == 0 || childDepth == SceneJsonWriter::cAllChildren)
+        entityData += entity->SerializeToXMLString(true, true, childDepth > 0);
+    else
+    {
+        QDomDocument doc;
+        HttpEntityStream::AppendXmlEntity(doc, doc, entity, childDepth, 0);
+        entityData += doc.toByteArray();
+    }
+    return entityData;
+}
+
+void HttpServer::ReplyWithChanges(ConnectionPtr connection, u64 since, ContentFormat format, bool deferred)
+{
+    connection->replace_header("X-Scene-Sequence", QString::number(changeFeed_->Sequence()).toStdString());
+    if (changeFeed_->IsAvailable(since))
+    {
+        SetCompressibleReply(connection, MakeReplyBuffer(changeFeed_->Serialize(since, format)), ContentTypeOf(format), deferred);
+        return;
+    }
+
+    SetHttpRequestReply(connection, "Gone: the changes since this sequence number are no longer available, reload the scene",
+        "text/plain", websocketpp::http::status_code::gone);
+    if (deferred)
+        SendDeferredReply(connection);
+}
+
+bool HttpServer::ReplyWithEvents(ConnectionPtr connection, u64& since, const HttpChangeFilter& filter, bool deferred, bool force)
+{
+    // The reply ends the stream after each batch; the retry delay makes EventSource reconnect right away
+    QByteArray body = "retry: 100\n";
+    if (!changeFeed_->IsAvailable(since))
+    {
+        since = changeFeed_->Sequence();
+        body += "event: reset\ndata: {\"sequence\":" + QByteArray::number(since) + "}\nid: " + QByteArray::number(since) + "\n\n";
+        ++eventReplies_;
+    }
+    else
+    {
+        uint numEvents = 0;
+        if (changeFeed_->HasChangesSince(since))
+            body += changeFeed_->SerializeEvents(since, filter, eventStreamMaxBytes_, since, numEvents);
+        if (numEvents > 0)
+            ++eventReplies_;
+        else if (force)
+        {
+            body += ": heartbeat\nid: " + QByteArray::number(since) + "\n\n";
+            ++eventHeartbeats_;
+        }
+        else
+            return false;
+    }
+
+    connection->replace_header("Cache-Control", "no-cache");
+    SetHttpRequestReply(connection, body, "text/event-stream; charset=utf-8", websocketpp::http::status_code::ok);
+    if (deferred)
+        SendDeferredReply(connection);
+    return true;
+}
+
+void HttpServer::SetCompressibleReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, bool deferred,
+    const QString& cacheKey, const QByteArray& etag)
+{
+    const HttpCompression::Encoding encoding = HttpCompression::Negotiate(connection->get_request_header("Accept-Encoding"));
+    if (body->size() >= compressMinSize_)
+        connection->replace_header("Vary", "Accept-Encoding");
+
+    if (encoding == HttpCompression::Identity || body->size() < compressMinSize_)
+    {
+        SetHttpRequestReply(connection, body, contentType, websocketpp::http::status_code::ok);
+        if (deferred)
+            SendDeferredReply(connection);
+        return;
+    }
+
+    shared_ptr<HttpCompressTask> task(new HttpCompressTask);
+    task->connection = connection;
+    task->body = body;
+    task->contentType = contentType;
+    task->encoding = encoding;
+    task->cacheKey = cacheKey;
+    task->etag = etag;
+
+    if (!deferred)
+    {
+        websocketpp::lib::error_code ec = DeferHttpResponse(connection);
+        if (ec)
+        {
+            // The reply has to be complete when the handler returns; compress it here
+            CompressReply(*task);
+            FinishCompressedReply(task, false);
+            return;
+        }
+    }
+    compressionPool_.start(new HttpCompressJob(this, task));
+}
+
+void HttpServer::FinishCompressedReply(shared_ptr<HttpCompressTask> task, bool deferred)
+{
+    if (task->encoding == HttpCompression::Identity)
+    {
+        // Compression failed; send the body as it was
+        SetHttpRequestReply(task->connection, task->body, task->contentType.constData(), websocketpp::http::status_code::ok);
+    }
+    else
+    {
+        ++compressedReplies_;
+        if (!task->cacheKey.isEmpty())
+            sceneCache_->InsertCompressed(task->cacheKey, task->etag, task->encoding, task->body);
+        SetEncodedReply(task->connection, task->body, task->contentType.constData(), task->encoding);
+    }
+    if (deferred)
+        SendDeferredReply(task->connection);
+}
+
+void HttpServer::SetEncodedReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, HttpCompression::Encoding encoding)
+{
+    SetHttpRequestReply(connection, body, contentType, websocketpp::http::status_code::ok);
+    connection->replace_header("Content-Encoding", HttpCompression::EncodingName(encoding));
+    connection->replace_header("Vary", "Accept-Encoding");
+    // The compressed bytes differ from the identity ones, so they get an ETag of their own
+    const std::string etag = connection->get_response_header("ETag");
+    if (!etag.empty())
+        connection->replace_header("ETag", HttpCompression::EncodedETag(QByteArray(etag.c_str()), encoding).constData());
+}
+
+void HttpServer::SendDeferredReply(ConnectionPtr connection)
+{
+    std::map<void*, PendingMetrics>::iterator pending = pendingMetrics_.find(connection.get());
+    if (pending != pendingMetrics_.end())
+    {
+        metrics_.RecordReply(pending->second.route, connection->get_response_code(),
+            QString::fromStdString(connection->get_response_header("Content-Length")).toULongLong(),
+            kNet::Clock::TimespanToSecondsD(pending->second.received, kNet::Clock::Tick()));
+        pendingMetrics_.erase(pending);
+    }
+
+    try
+    {
+        connection->send_http_response();
+    }
+    catch (std::exception &e)
+    {
+        LogError("HttpServer: failed to send deferred reply: " + QString::fromStdString(e.what()));
+    }
+}
+
+void HttpServer::ReplyWithEntity(ConnectionPtr connection, Entity* entity, ContentFormat format, uint childDepth)
+{
+    SetCompressibleReply(connection, MakeReplyBuffer(SerializeEntity(entity, format, childDepth)), ContentTypeOf(format), false);
+}
+
+bool HttpServer::CheckNotModified(ConnectionPtr connection, const QByteArray& etag)
+{
+    // Clients may keep the reply but must revalidate it before use
+    connection->replace_header("ETag", etag.constData());
+    connection->replace_header("Cache-Control", "no-cache");
+
+    const std::string ifNoneMatch = connection->get_request_header("If-None-Match");
+    if (ifNoneMatch.empty())
+        return false;
+    if (ifNoneMatch != "*" && ifNoneMatch.find(etag.constData()) == std::string::npos)
+    {
+        // A client holding the compressed form sends its ETag instead, which is answered with that ETag
+        const HttpCompression::Encoding encoding = HttpCompression::Negotiate(connection->get_request_header("Accept-Encoding"));
+        const QByteArray encodedETag = HttpCompression::EncodedETag(etag, encoding);
+        if (encoding == HttpCompression::Identity || ifNoneMatch.find(encodedETag.constData()) == std::string::npos)
+            return false;
+        connection->replace_header("ETag", encodedETag.constData());
+        connection->replace_header("Vary", "Accept-Encoding");
+    }
+
+    SetHttpRequestStatus(connection, websocketpp::http::status_code::not_modified);
+    ++notModifiedReplies_;
+    return true;
+}
+
+bool HttpServer::ReplyFromCache(ConnectionPtr connection, const QString& key, const QByteArray& etag)
+{
+    HttpCachedReply reply;
+    if (!sceneCache_->Find(key, etag, reply))
+        return false;
+
+    // A compressed variant made for an earlier request saves both serialization and compression
+    const HttpCompression::Encoding encoding = HttpCompression::Negotiate(connection->get_request_header("Accept-Encoding"));
+    if (encoding != HttpCompression::Identity && reply.body->size() >= compressMinSize_ && reply.Encoded(encoding))
+    {
+        ++compressedCacheHits_;
+        SetEncodedReply(connection, reply.Encoded(encoding), reply.contentType.constData(), encoding);
+    }
+    else
+        SetCompressibleReply(connection, reply.body, reply.contentType.constData(), false, key, etag);
+    return true;
+}
+
+void HttpServer::ReplyWithComponent(ConnectionPtr connection, IComponent* component, ContentFormat format)
+{
+    if (format == JsonFormat)
+    {
+        QByteArray componentJson;
+        SceneJsonWriter(componentJson).WriteComponent(component);
+        SetCompressibleReply(connection, MakeReplyBuffer(componentJson), "application/json", false);
+    }
+    else
+    {
+        QDomDocument componentDoc("Component");
+        QDomElement empty;
+        component->SerializeTo(componentDoc, empty, true);
+        SetCompressibleReply(connection, MakeReplyBuffer(componentDoc.toByteArray()), "application/xml", false);
+    }
+}
+
+void HttpServer::ReplyWithAttribute(ConnectionPtr connection, IAttribute* attribute, ContentFormat format)
+{
+    if (format == JsonFormat)
+    {
+        QByteArray attributeJson;
+        SceneJsonWriter(attributeJson).WriteAttribute(attribute);
+        SetHttpRequestReply(connection, attributeJson, "application/json", websocketpp::http::status_code::ok);
+    }
+    else
+        SetHttpRequestReply(connection, attribute->ToString(), "text/plain", websocketpp::http::status_code::ok);
+}
+
+void HttpServer::RegisterSceneRoutes()
+{
+    // The SceneAPI answers under both /scene and /entities
+    const char* prefixes[] = { "/scene", "/entities" };
+    for(size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+    {
+        const QString prefix = prefixes[i];
+        AddSceneRoute(HttpGet, prefix, &HttpServer::HandleGetEntities);
+        AddSceneRoute(HttpGet, prefix + "/:id", &HttpServer::HandleGetEntity);
+        AddSceneRoute(HttpGet, prefix + "/:id/:component", &HttpServer::HandleGetComponent);
+        AddSceneRoute(HttpGet, prefix + "/:id/:component/:attribute", &HttpServer::HandleGetAttribute);
+
+        AddSceneRoute(HttpDelete, prefix, &HttpServer::HandleDeleteEntities);
+        AddSceneRoute(HttpDelete, prefix + "/:id", &HttpServer::HandleDeleteEntity);
+        AddSceneRoute(HttpDelete, prefix + "/:id/:component", &HttpServer::HandleDeleteComponent);
+        AddSceneRoute(HttpDelete, prefix + "/:id/:component/:attribute", &HttpServer::HandleDeleteAttribute);
+
+        AddSceneRoute(HttpPut, prefix + "/:id", &HttpServer::HandlePutEntity);
+        AddSceneRoute(HttpPut, prefix + "/:id/:component", &HttpServer::HandlePutComponent);
+
+        AddSceneRoute(HttpPost, prefix, &HttpServer::HandlePostEntity);
+        AddSceneRoute(HttpPost, prefix + "/:id", &HttpServer::HandlePostEntity);
+        AddSceneRoute(HttpPost, prefix + "/:id/:component", &HttpServer::HandlePostComponent);
+
+        // Anything deeper is not found, rather than being passed on to HttpRequestReceived
+        for(int verb = 0; verb < NumHttpVerbs; ++verb)
+            router_.AddRoute((HttpVerb)verb, prefix + "/*path", boost::bind(&HttpServer::HandleNotFound, this, ::_1));
+    }
+
+    // Transactional batch of operations
+    AddSceneRoute(HttpPost, "/scene/batch", &HttpServer::HandleSceneBatch);
+
+    // Sequence-numbered change feed with long polling
+    AddSceneRoute(HttpGet, "/scene/changes", &HttpServer::HandleGetChanges);
+    AddSceneRoute(HttpGet, "/scene/events", &HttpServer::HandleGetEvents);
+
+    // Bulk import spread over frames
+    AddSceneRoute(HttpPost, "/scene/import", &HttpServer::HandleSceneImport);
+    AddSceneRoute(HttpGet, "/scene/import/:job", &HttpServer::HandleImportProgress);
+
+    // Entity id blocks reserved for clients, and bulk creation from them
+    AddSceneRoute(HttpPost, "/scene/idblocks", &HttpServer::HandlePostIdBlock);
+    AddSceneRoute(HttpGet, "/scene/idblocks/:block", &HttpServer::HandleGetIdBlock);
+    AddSceneRoute(HttpDelete, "/scene/idblocks/:block", &HttpServer::HandleDeleteIdBlock);
+    AddSceneRoute(HttpPost, "/scene/idblocks/:block/entities", &HttpServer::HandlePostIdBlockEntities);
+}
+
+void HttpServer::AddSceneRoute(HttpVerb verb, const QString& pattern, SceneRouteHandler handler)
+{
+    router_.AddRoute(verb, pattern, boost::bind(&HttpServer::HandleSceneRoute, this, handler, ::_1));
+}
+
+void HttpServer::HandleSceneRoute(SceneRouteHandler handler, const HttpRequest& request)
+{
+    Scene* scene = GetActiveScene();
+    if (!scene)
+    {
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+        return;
+    }
+
+    sceneCache_->SetScene(scene);
+    (this->*handler)(request, scene, ReplyFormat(request.connection, request.url));
+}
+
+void HttpServer::HandleNotFound(const HttpRequest& request)
+{
+    SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+}
+
+void HttpServer::HandlePutAsset(const HttpRequest& request)
+{
+    PROFILE(HttpServer_HandlePutAsset);
+
+    const QString name = request.Param("name");
+    const QString filePath = assetUploads_->TakeCompleted(name);
+    if (filePath.isEmpty())
+    {
+        SetHttpRequestReply(request.connection, "Upload not complete", "text/plain", websocketpp::http::status_code::conflict);
+        return;
+    }
+
+    AssetAPI* assetAPI = framework_->Asset();
+    AssetStoragePtr storage = request.url.hasQueryItem("storage") ? assetAPI->GetAssetStorageByName(request.url.queryItemValue("storage")) :
+        assetAPI->GetDefaultAssetStorage();
+    QFile file(filePath);
+    if (!storage)
+        SetHttpRequestReply(request.connection, "No such asset storage", "text/plain", websocketpp::http::status_code::not_found);
+    else if (!storage->Writable())
+        SetHttpRequestReply(request.connection, "Asset storage is not writable", "text/plain", websocketpp::http::status_code::forbidden);
+    else
+    {
+        // The storage gets the mapped file rather than a copy of it in memory
+        uchar* data = file.open(QIODevice::ReadOnly) ? file.map(0, file.size()) : 0;
+        AssetUploadTransferPtr transfer;
+        try
+        {
+            if (data)
+                transfer = assetAPI->UploadAssetFromFileInMemory(data, (size_t)file.size(), storage, name);
+        }
+        catch (std::exception &e)
+        {
+            LogError("HttpServer: failed to upload asset " + name + ": " + QString::fromStdString(e.what()));
+        }
+        if (data)
+            file.unmap(data);
+
+        if (transfer)
+        {
+            const QString assetRef = storage->GetFullAssetURL(name);
+            QByteArray json = "{\"ref\":";
+            SceneJsonWriter(json).WriteString(assetRef);
+            json += '}';
+            request.connection->replace_header("Location", assetRef.toStdString());
+            SetHttpRequestReply(request.connection, json, "application/json", websocketpp::http::status_code::created);
+            ++assetsUploaded_;
+        }
+        else
+            SetHttpRequestReply(request.connection, "Could not upload the asset", "text/plain", websocketpp::http::status_code::internal_server_error);
+    }
+    file.close();
+    QFile::remove(filePath);
+}
+
+void HttpServer::HandleMetrics(const HttpRequest& request)
+{
+    PROFILE(HttpServer_HandleMetrics);
+    request.connection->replace_header("Cache-Control", "no-store");
+    SetHttpRequestReply(request.connection, metrics_.Prometheus(UpdateStatistics()), "text/plain; version=0.0.4", websocketpp::http::status_code::ok);
+}
+
+EntityPtr HttpServer::RequestEntity(const HttpRequest& request, Scene* scene)
+{
+    bool ok = false;
+    entity_id_t entityId = request.Param("id").toUInt(&ok);
+    return ok ? scene->EntityById(entityId) : EntityPtr();
+}
+
+ComponentPtr HttpServer::RequestComponent(const HttpRequest& request, Scene* scene)
+{
+    EntityPtr entity = RequestEntity(request, scene);
+    if (!entity)
+        return ComponentPtr();
+    Entity::ComponentVector comps = entity->ComponentsOfType(request.Param("component"));
+    /// \todo Uses only the first component
+    return comps.size() ? comps[0] : ComponentPtr();
+}
+
+IAttribute* HttpServer::RequestAttribute(IComponent* component, const HttpRequest& request)
+{
+    // Try both name & id
+    return HttpSceneDeserializer::FindAttribute(component, request.Param("attribute"));
+}
+
+void HttpServer::HandleGetEntities(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    const QUrl& url = request.url;
+    const QByteArray etag = sceneCache_->SceneETag(format);
+    uint childDepth = 0;
+    if (!ParseChildDepth(url, childDepth))
+    {
+        SetHttpRequestReply(request.connection, "Bad Request: expected depth=<levels> or depth=all", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    // Entity by name
+    if (url.hasQueryItem("name"))
+    {
+        EntityPtr entity = scene->EntityByName(url.queryItemValue("name"));
+        if (!entity)
+            SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+        else if (!CheckNotModified(request.connection, etag))
+            ReplyWithEntity(request.connection, entity.get(), format, childDepth);
+    }
+    // Entities by id, in the order given, in one reply; ids that do not exist are left out
+    else if (url.hasQueryItem("ids"))
+    {
+        std::vector<entity_id_t> ids;
+        if (!ParseEntityIds(url.queryItemValue("ids"), ids))
+            SetHttpRequestReply(request.connection, "Bad Request: expected ids=id,id,...", "text/plain", websocketpp::http::status_code::bad_request);
+        else if (!CheckNotModified(request.connection, etag))
+            ReplyWithEntityPage(request.connection, scene, ids, url, format, false);
+    }
+    // Entities by component type and attribute values
+    else if (url.hasQueryItem("component"))
+    {
+        if (!CheckNotModified(request.connection, etag))
+            ReplyWithFilteredEntities(request.connection, scene, url, format);
+    }
+    // Entities near a point or inside a box
+    else if (url.hasQueryItem("near") || url.hasQueryItem("aabb"))
+    {
+        if (!CheckNotModified(request.connection, etag) && !ReplyWithSpatialQuery(request.connection, scene, url, format))
+            SetHttpRequestReply(request.connection, "Bad Request: expected near=x,y,z&radius=r or aabb=minX,minY,minZ,maxX,maxY,maxZ",
+                "text/plain", websocketpp::http::status_code::bad_request);
+    }
+    // Whole scene
+    else
+    {
+        if (WantsBinaryScene(request.connection, url))
+            format = BinaryFormat;
+        const QString key = QString("scene") + (format == JsonFormat ? "/json" : (format == BinaryFormat ? "/binary" : "/xml"));
+        const QByteArray sceneETag = sceneCache_->SceneETag(format);
+        if (!CheckNotModified(request.connection, sceneETag) && !ReplyFromCache(request.connection, key, sceneETag))
+            ReplyWithScene(request.connection, scene, format, key, sceneETag);
+    }
+}
+
+void HttpServer::HandleGetEntity(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    EntityPtr entity = RequestEntity(request, scene);
+    if (!entity)
+    {
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+        return;
+    }
+
+    uint childDepth = 0;
+    if (!ParseChildDepth(request.url, childDepth))
+    {
+        SetHttpRequestReply(request.connection, "Bad Request: expected depth=<levels> or depth=all", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    // A subtree changes with its descendants, which only the scene ETag follows
+    const entity_id_t entityId = entity->Id();
+    const QByteArray etag = childDepth > 0 ? sceneCache_->SceneETag(format) : sceneCache_->EntityETag(entityId, format);
+    QString key = "entity/" + QString::number(entityId) + (format == JsonFormat ? "/json" : "/xml");
+    if (childDepth > 0)
+        key += "/depth/" + (childDepth == SceneJsonWriter::cAllChildren ? QString("all") : QString::number(childDepth));
+    if (!CheckNotModified(request.connection, etag) && !ReplyFromCache(request.connection, key, etag))
+    {
+        HttpCachedReply reply;
+        reply.etag = etag;
+        reply.contentType = ContentTypeOf(format);
+        reply.body = MakeReplyBuffer(SerializeEntity(entity.get(), format, childDepth));
+        sceneCache_->Insert(key, reply);
+        SetCompressibleReply(request.connection, reply.body, reply.contentType.constData(), false, key, etag);
+    }
+}
+
+void HttpServer::HandleGetComponent(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    ComponentPtr comp = RequestComponent(request, scene);
+    if (!comp)
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+    else if (!CheckNotModified(request.connection, sceneCache_->EntityETag(comp->ParentEntity()->Id(), format)))
+        ReplyWithComponent(request.connection, comp.get(), format);
+}
+
+void HttpServer::HandleGetAttribute(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    ComponentPtr comp = RequestComponent(request, scene);
+    IAttribute* attr = comp ? RequestAttribute(comp.get(), request) : 0;
+    if (!attr)
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+    else if (!CheckNotModified(request.connection, sceneCache_->EntityETag(comp->ParentEntity()->Id(), format)))
+        ReplyWithAttribute(request.connection, attr, format);
+}
+
+/// \todo Access control
+
+void HttpServer::HandleDeleteEntities(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    // Entity by name
+    EntityPtr entity = request.url.hasQueryItem("name") ? scene->EntityByName(request.url.queryItemValue("name")) : EntityPtr();
+    if (entity)
+    {
+        scene->RemoveEntity(entity->Id());
+        SetHttpRequestReply(request.connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
+    }
+    else
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandleDeleteEntity(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    EntityPtr entity = RequestEntity(request, scene);
+    if (entity && scene->RemoveEntity(entity->Id()))
+        SetHttpRequestReply(request.connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
+    else
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandleDeleteComponent(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    ComponentPtr comp = RequestComponent(request, scene);
+    if (comp)
+    {
+        comp->ParentEntity()->RemoveComponent(comp);
+        SetHttpRequestReply(request.connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
+    }
+    else
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandleDeleteAttribute(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    // Only attributes of a DynamicComponent can be removed
+    ComponentPtr comp = RequestComponent(request, scene);
+    EC_DynamicComponent* dc = dynamic_cast<EC_DynamicComponent*>(comp.get());
+    IAttribute* attr = dc ? RequestAttribute(dc, request) : 0;
+    if (attr)
+    {
+        dc->RemoveAttribute(attr->Id());
+        SetHttpRequestReply(request.connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
+    }
+    else
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandlePutEntity(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    // Injection of whole entity's data (removes existing components and child entities)
+    const QByteArray body = request.Body();
+    EntityPtr entity = RequestEntity(request, scene);
+    if (!entity || !body.length())
+    {
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    HttpEntityData entData;
+    QString error;
+    if (!HttpSceneParser::ParseEntityDocument(body, IsJsonBody(request.connection), entData, error))
+    {
+        SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    entity->RemoveAllComponents();
+    entity->RemoveAllChildren();
+
+    HttpSceneDeserializer deserializer(framework_, scene);
+    deserializer.CreateComponentsToEntity(entity, entData.components);
+    for(int i = 0; i < entData.children.size(); ++i)
+        deserializer.CreateEntity(entity, entData.children[i]);
+
+    // Reply is the new content of the entity
+    ReplyWithEntity(request.connection, entity.get(), format);
+}
+
+void HttpServer::HandlePutComponent(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    // Query items other than the format are attribute values
+    QList<HttpAttributeData> queryAttributes;
+    const QList<QPair<QString, QString> >& queryItems = request.url.queryItems();
+    for (QList<QPair<QString, QString> >::const_iterator i = queryItems.begin(); i != queryItems.end(); ++i)
+    {
+        if (i->first == "format")
+            continue;
+        HttpAttributeData attr;
+        attr.id = i->first;
+        attr.value = i->second;
+        queryAttributes.push_back(attr);
+    }
+
+    const QByteArray body = request.Body();
+    ComponentPtr comp = RequestComponent(request, scene);
+    if (!comp || (queryAttributes.isEmpty() && !body.length()))
+    {
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    // Attribute mod inside component by query, otherwise injection of whole component's data
+    if (queryAttributes.isEmpty())
+    {
+        HttpComponentData compData;
+        QString error;
+        if (!HttpSceneParser::ParseComponentDocument(body, IsJsonBody(request.connection), compData, error))
+        {
+            SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+            return;
+        }
+        queryAttributes = compData.attributes;
+    }
+    HttpSceneDeserializer(framework_, scene).ApplyAttributes(comp.get(), queryAttributes);
+
+    // Reply is the new content of the component
+    ReplyWithComponent(request.connection, comp.get(), format);
+}
+
+void HttpServer::HandlePostEntity(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    // New entity, with or without specifying ID, with or without initial data
+    HttpEntityData entData;
+    QString error;
+    if (!HttpSceneParser::ParseEntityDocument(request.Body(), IsJsonBody(request.connection), entData, error))
+    {
+        SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    entity_id_t id = request.Param("id").toUInt();
+    if (request.url.hasQueryItem("block"))
+    {
+        // An id from a reserved block, looked up with a single check
+        HttpEntityIdBlock* block = idBlocks_->Find(scene, request.url.queryItemValue("block"));
+        id = block ? block->Take(scene) : 0;
+        if (!id)
+        {
+            SetHttpRequestReply(request.connection, block ? "Conflict: the id block is used up" : "Not Found: no such id block", "text/plain",
+                block ? websocketpp::http::status_code::conflict : websocketpp::http::status_code::not_found);
+            return;
+        }
+        ++idBlockEntities_;
+    }
+    else if (id == 0 || scene->HasEntity(id))
+        id = entData.sync ? scene->NextFreeId() : scene->NextFreeIdLocal();
+
+    EntityPtr entity = HttpSceneDeserializer(framework_, scene).CreateEntity(id, entData);
+    if (entity)
+        ReplyWithEntity(request.connection, entity.get(), format);
+    else
+        SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandlePostComponent(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    // New component, with or without initial data
+    HttpComponentData compData;
+    QString error;
+    if (!HttpSceneParser::ParseComponentDocument(request.Body(), IsJsonBody(request.connection), compData, error))
+    {
+        SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    EntityPtr entity = RequestEntity(request, scene);
+    if (entity)
+    {
+        HttpSceneDeserializer deserializer(framework_, scene);
+        ComponentPtr comp = deserializer.GetOrCreateComponent(entity, request.Param("component"));
+        if (comp)
+        {
+            deserializer.ApplyAttributes(comp.get(), compData.attributes);
+
+            // Reply is the new content of the component
+            ReplyWithComponent(request.connection, comp.get(), format);
+            return;
+        }
+    }
+    SetHttpRequestReply(request.connection, "Bad Request", "text/plain", websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandleSceneBatch(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    HttpSceneBatch batch(framework_, scene);
+    QString error;
+    if (!batch.Parse(request.Body(), IsJsonBody(request.connection), error))
+    {
+        SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+    const bool committed = batch.Execute();
+    SetHttpRequestReply(request.connection, batch.SerializeResults(format), ContentTypeOf(format),
+        committed ? websocketpp::http::status_code::ok : websocketpp::http::status_code::bad_request);
+}
+
+void HttpServer::HandleSceneImport(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    const QByteArray body = request.Body();
+    if (body.isEmpty())
+    {
+        SetHttpRequestReply(request.connection, "Bad Request: expected a scene document", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    // Each running import holds a copy of its body, so only a few may run at once
+    const uint maxRunning = 4;
+    uint running = 0;
+    for(std::list<shared_ptr<HttpSceneImport> >::const_iterator i = imports_.begin(); i != imports_.end(); ++i)
+        if ((*i)->ImportState() == HttpSceneImport::Running)
+            ++running;
+    if (running >= maxRunning)
+    {
+        RefuseRequest(request.connection, websocketpp::http::status_code::service_unavailable, 5.f);
+        return;
+    }
+
+    // TBIN has no signature of its own, so it is recognized from the Content-Type or ?format=binary only
+    ContentFormat bodyFormat = IsJsonBody(request.connection) ? JsonFormat : XmlFormat;
+    if (request.connection->get_request_header("Content-Type").find("octet-stream") != std::string::npos ||
+        request.url.queryItemValue("format").compare("binary", Qt::CaseInsensitive) == 0)
+        bodyFormat = BinaryFormat;
+
+    // The import outlives the request, so it needs a copy of the body
+    shared_ptr<HttpSceneImport> import(new HttpSceneImport(nextImportId_++, framework_, scene->shared_from_this(),
+        QByteArray(body.constData(), body.size()), bodyFormat));
+    imports_.push_back(import);
+
+    request.connection->replace_header("Location", "/scene/import/" + boost::lexical_cast<std::string>(import->Id()));
+    SetHttpRequestReply(request.connection, import->Progress(format), ContentTypeOf(format), websocketpp::http::status_code::accepted);
+}
+
+void HttpServer::HandleImportProgress(const HttpRequest& request, Scene* /*scene*/, ContentFormat format)
+{
+    const uint id = request.Param("job").toUInt();
+    for(std::list<shared_ptr<HttpSceneImport> >::const_iterator i = imports_.begin(); i != imports_.end(); ++i)
+    {
+        if ((*i)->Id() == id)
+        {
+            SetHttpRequestReply(request.connection, (*i)->Progress(format), ContentTypeOf(format), websocketpp::http::status_code::ok);
+            return;
+        }
+    }
+    SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+}
+
+void HttpServer::HandlePostIdBlock(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    bool ok = false;
+    const uint count = request.url.queryItemValue("count").toUInt(&ok);
+    if (!ok || count == 0 || count > HttpEntityIdBlocks::cMaxBlockSize)
+    {
+        SetHttpRequestReply(request.connection, "Bad Request: expected count=1.." + QString::number(HttpEntityIdBlocks::cMaxBlockSize),
+            "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+    const QString local = request.url.queryItemValue("local");
+    const HttpEntityIdBlock* block = idBlocks_->Reserve(scene, count, local == "1" || local.compare("true", Qt::CaseInsensitive) == 0);
+    if (!block)
+    {
+        SetHttpRequestReply(request.connection, "Service Unavailable: no free id range of that size", "text/plain", websocketpp::http::status_code::service_unavailable);
+        return;
+    }
+    request.connection->replace_header("Location", "/scene/idblocks/" + block->token.toStdString());
+    SetHttpRequestReply(request.connection, SerializeIdBlock(*block, format), ContentTypeOf(format), websocketpp::http::status_code::created);
+}
+
+void HttpServer::HandleGetIdBlock(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    const HttpEntityIdBlock* block = idBlocks_->Find(scene, request.Param("block"));
+    if (block)
+        SetHttpRequestReply(request.connection, SerializeIdBlock(*block, format), ContentTypeOf(format), websocketpp::http::status_code::ok);
+    else
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+}
+
+void HttpServer::HandleDeleteIdBlock(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    if (idBlocks_->Release(scene, request.Param("block")))
+        SetHttpRequestReply(request.connection, "Deleted", "text/plain", websocketpp::http::status_code::ok);
+    else
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+}
+
+void HttpServer::HandlePostIdBlockEntities(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    HttpEntityIdBlock* block = idBlocks_->Find(scene, request.Param("block"));
+    if (!block)
+    {
+        SetHttpRequestStatus(request.connection, websocketpp::http::status_code::not_found);
+        return;
+    }
+
+    QList<HttpEntityData> entities;
+    QString error;
+    if (!HttpSceneParser::ParseEntityListDocument(request.Body(), IsJsonBody(request.connection), entities, error))
+    {
+        SetHttpRequestReply(request.connection, error, "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+    uint count = 0;
+    for(int i = 0; i < entities.size(); ++i)
+        count += CountEntities(entities[i]);
+    // Ids of the block taken meanwhile by entities created with explicit ids are skipped, so the free ids are
+    // counted; then every entity gets an id and none is left behind by a batch that runs out partway
+    const uint available = block->Available(scene);
+    if (count > available)
+    {
+        SetHttpRequestReply(request.connection, "Conflict: " + QString::number(count) + " entities but " + QString::number(available) +
+            " ids left in the block", "text/plain", websocketpp::http::status_code::conflict);
+        return;
+    }
+
+    // Top-level entities are listed in the reply; their children follow them in the block
+    HttpSceneDeserializer deserializer(framework_, scene);
+    deserializer.SetIdBlock(block);
+    std::vector<entity_id_t> created;
+    created.reserve(entities.size());
+    for(int i = 0; i < entities.size(); ++i)
+    {
+        EntityPtr entity = deserializer.CreateEntity(EntityPtr(), entities[i]);
+        if (entity)
+            created.push_back(entity->Id());
+    }
+    idBlockEntities_ += (uint)deserializer.CreatedEntities().size();
+    SetHttpRequestReply(request.connection, SerializeIdBlock(*block, format, &created), ContentTypeOf(format), websocketpp::http::status_code::created);
+}
+
+void HttpServer::HandleGetChanges(const HttpRequest& request, Scene* scene, ContentFormat format)
+{
+    changeFeed_->SetScene(scene);
+
+    // Without ?since= only the current sequence number is returned, as the starting point for polling
+    const QUrl& url = request.url;
+    if (!url.hasQueryItem("since"))
+    {
+        ReplyWithChanges(request.connection, changeFeed_->Sequence(), format, false);
+        return;
+    }
+
+    bool ok = false;
+    const u64 since = url.queryItemValue("since").toULongLong(&ok);
+    if (!ok)
+    {
+        SetHttpRequestReply(request.connection, "Bad Request: expected since=<sequence number>", "text/plain", websocketpp::http::status_code::bad_request);
+        return;
+    }
+
+    // Long poll: park the request until there are changes or the wait is over
+    const float wait = std::min(url.queryItemValue("wait").toFloat(), maxChangeWait_);
+    if (wait > 0.f && changeFeed_->IsAvailable(since) && !changeFeed_->HasChangesSince(since))
+    {
+        if (!AdmitChangeWaiter(request.connection))
+            return;
+        websocketpp::lib::error_code ec = DeferHttpResponse(request.connection);
+        if (!ec)
+        {
+            ChangeWaiter waiter;
+            waiter.connection = request.connection;
+            waiter.since = since;
+            waiter.format = format;
+            waiter.deadline = kNet::Clock::Tick() + (kNet::tick_t)(wait * kNet::Clock::TicksPerSec());
+            changeWaiters_.push_back(waiter);
+            return;
+        }
+        LogWarning("HttpServer: could not defer reply, answering change request at once: " + QString::fromStdString(ec.message()));
+    }
+
+    ReplyWithChanges(request.connection, since, format, false);
+}
+
+void HttpServer::HandleGetEvents(const HttpRequest& request, Scene* scene, ContentFormat /*format*/)
+{
+    changeFeed_->SetScene(scene);
+
+    const QUrl& url = request.url;
+    shared_ptr<HttpChangeFilter> filter(new HttpChangeFilter);
+    const QStringList entities = url.queryItemValue("entities").split(',', QString::SkipEmptyParts);
+    for(int i = 0; i < entities.size(); ++i)
+        filter->entities.insert(entities[i].toUInt());
+    filter->componentTypes = url.queryItemValue("components").split(',', QString::SkipEmptyParts).toSet();
+    filter->attributes = url.queryItemValue("attributes").split(',', QString::SkipEmptyParts).toSet();
+
+    // EventSource sends the id of the last event it got when it reconnects; a new stream starts from now
+    const std::string lastEventHeader = request.connection->get_request_header("Last-Event-ID");
+    const QString lastEventId = lastEventHeader.empty() ? url.queryItemValue("lastEventId") : QString::fromStdString(lastEventHeader);
+    bool ok = false;
+    u64 since = lastEventId.toULongLong(&ok);
+    if (!ok)
+    {
+        since = changeFeed_->Sequence();
+        ReplyWithEvents(request.connection, since, *filter, false, true);
+        return;
+    }
+
+    if (ReplyWithEvents(request.connection, since, *filter, false, false))
+        return;
+    if (!AdmitChangeWaiter(request.connection))
+        return;
+
+    websocketpp::lib::error_code ec = DeferHttpResponse(request.connection);
+    if (ec)
+    {
+        LogWarning("HttpServer: could not defer reply, answering event stream request at once: " + QString::fromStdString(ec.message()));
+        ReplyWithEvents(request.connection, since, *filter, false, true);
+        return;
+    }
+
+    ChangeWaiter waiter;
+    waiter.connection = request.connection;
+    waiter.since = since;
+    waiter.format = JsonFormat;
+    waiter.deadline = kNet::Clock::Tick() + (kNet::tick_t)(eventHeartbeat_ * kNet::Clock::TicksPerSec());
+    waiter.filter = filter;
+    changeWaiters_.push_back(waiter);
+}
+
+bool HttpServer::AdmitChangeWaiter(ConnectionPtr connection)
+{
+    if (maxChangeWaiters_ == 0 || changeWaiters_.size() < maxChangeWaiters_)
+        return true;
+    overloadRefusals_.ref();
+    RefuseRequest(connection, websocketpp::http::status_code::service_unavailable, 5.f);
+    return false;
+}
+
 void HttpServer::OnScriptEngineCreated(QScriptEngine *engine)
 {
     qScriptRegisterQObjectMetaType<HttpServer*>(engine);
+    qScriptRegisterQObjectMetaType<HttpScriptRoute*>(engine);
+    qScriptRegisterQObjectMetaType<HttpDeferredReply*>(engine);
 }
 
@@ -16,17 +16,53 @@
 #include <QFileInfo>
 #include <QDateTime>
 #include <QMutex>
+#include <QAtomicInt>
+#include <QVariantMap>
+#include <QHash>
+#include <QThreadPool>
+#include <QPointer>
 
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 #include <websocketpp/http/constants.hpp>
 
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+
 #include "kNet/DataSerializer.h"
+#include "kNet/Clock.h"
 #include "boost/weak_ptr.hpp"
+#include "boost/function.hpp"
+
+#include "MpscQueue.h"
+#include "HttpCompression.h"
+#include "HttpRouter.h"
+#include "HttpMetrics.h"
 
-class QDomElement;
+class QUrl;
 class QScriptEngine;
 class Scene;
+class HttpIoThread;
+class HttpEntityStream;
+class HttpSceneCache;
+class HttpSubscriptionChannel;
+class HttpSpatialIndex;
+class HttpEntityIndex;
+class HttpCompressJob;
+class HttpDeferredReply;
+class HttpSceneImport;
+class HttpChangeFeed;
+class HttpRateLimiter;
+class HttpFileServer;
+class HttpAssetUploads;
+class HttpEntityIdBlocks;
+struct HttpEntityIdBlock;
+struct HttpCompressTask;
+struct HttpFieldSelection;
+struct HttpChangeFilter;
+class IAttribute;
 
 class HTTP_SERVER_MODULE_API HttpServer : public QObject, public enable_shared_from_this<HttpServer>
 {
@@ -38,6 +74,18 @@ public:
     typedef boost::weak_ptr<websocketpp::server<websocketpp::config::asio>::connection_type> ConnectionWeakPtr;
     typedef websocketpp::connection_hdl ConnectionHandle;
     typedef websocketpp::server<websocketpp::config::asio>::message_ptr MessagePtr;
+    typedef boost::function<void()> MainThreadTask;
+    /// Immutable reply body, shared by replies and the scene cache without copying
+    typedef shared_ptr<const std::string> ReplyBuffer;
+
+    /// Representations of the SceneAPI REST content
+    enum ContentFormat
+    {
+        XmlFormat,
+        JsonFormat,
+        /// Tundra binary scene format (TBIN), only for whole scene export and import
+        BinaryFormat
+    };
 
     HttpServer(Framework *framework, ushort port);
     ~HttpServer();
@@ -45,6 +93,100 @@ public:
     bool Start();
     void Stop();
     void Update(float frametime);
+
+    /// Sets the time in milliseconds that Update() may spend executing ready network handlers per frame.
+    /** A budget of zero or less executes at most one handler per frame. */
+    void SetFrameBudget(float milliseconds);
+    float FrameBudget() const { return frameBudgetMs_; }
+
+    /// Sets the number of network I/O threads. Must be called before Start().
+    /** With zero threads (the default) the network is polled from Update() in the main thread.
+        Otherwise socket I/O runs in the thread pool and request handling is marshalled to the main thread. */
+    void SetIoThreadCount(uint numThreads);
+    uint IoThreadCount() const { return numIoThreads_; }
+
+    /// Sets how many entities a list reply serializes per frame.
+    /** Lists that fit in one slice are replied to immediately. */
+    void SetStreamSliceSize(uint numEntities);
+    uint StreamSliceSize() const { return streamSliceSize_; }
+
+    /// Sets the maximum number of serialized replies kept in the scene cache. Zero disables caching of reply bodies.
+    void SetCacheSize(uint maxEntries);
+
+    /// Sets the body size in bytes from which SceneAPI replies are compressed for clients that accept gzip or deflate.
+    void SetCompressionMinSize(uint bytes);
+
+    /// Sets the grid cell size in world units of the spatial index used by GET /entities?near= and ?aabb=.
+    void SetSpatialCellSize(float cellSize);
+
+    /// Creates an index on an attribute of a component type for the ?component=&attr.<name>= filters of GET /entities.
+    /** Indexes are otherwise created on demand for the first filtered attributes, up to a limit. */
+    void AddEntityIndex(const QString& componentType, const QString& attribute);
+
+    /// Sets the number of change records kept for GET /scene/changes.
+    void SetChangeFeedSize(uint maxRecords);
+    /// Sets whether a change replaces the previous change record of the same entity, component or attribute.
+    void SetChangeFeedCompaction(bool compact);
+    /// Sets the longest time in seconds a GET /scene/changes request may wait for changes.
+    void SetMaxChangeWait(float seconds);
+    /// Sets the time in seconds after which a GET /scene/events request without events is answered with a heartbeat.
+    void SetEventStreamHeartbeat(float seconds);
+    /// Sets the most bytes of events sent in one GET /scene/events reply; the rest follow in the next one.
+    void SetEventStreamMaxBytes(uint bytes);
+
+    /// Sets the sustained request rates allowed per remote address, for reading and for writing requests. Bursts of twice the rate are allowed.
+    /** A rate of zero or less disables the limit, which is the default. Requests over the limit are refused with 429 Too Many Requests. */
+    void SetRateLimits(float readsPerSecond, float writesPerSecond);
+    /// Sets the number of requests that may wait for the main thread or for a deferred reply, above which new requests are refused with 503 Service Unavailable. Zero disables the limit.
+    void SetMaxInFlightRequests(uint maxRequests);
+    /// Sets the number of WebSocket subscribers above which new ones are refused. Zero disables the limit.
+    void SetMaxSubscribers(uint maxSubscribers);
+    /// Sets the number of long-polling change requests and event streams that may wait for changes at once, above which
+    /// new ones are refused with 503 Service Unavailable. They do not count against the in-flight limit. Zero disables the limit.
+    void SetMaxChangeWaiters(uint maxWaiters);
+
+    /// Sets the time in milliseconds that scene imports may spend creating entities per frame.
+    void SetImportBudget(float milliseconds);
+
+    /// Sets the time in seconds after which deferred replies that have not been completed are answered with 504 Gateway Timeout.
+    void SetDeferredReplyTimeout(float seconds);
+
+    /// Sets the send queue size in bytes above which change notifications to a WebSocket subscriber are held back.
+    void SetSubscriptionQueueLimit(uint bytes);
+
+    /// Sets the directory whose files are served under /files/. An empty directory disables it.
+    void SetDocumentRoot(const QString& directory);
+    /// Sets whether the assets in the asset cache are served under /assets/ by their asset reference. Must be called before Start().
+    void SetServeAssetCache(bool serve);
+    /// Sets whether assets can be uploaded with PUT /assets/<name>. Disabled by default. Must be called before Start().
+    /** While enabled, no request body may be larger than the upload chunk size; websocketpp refuses larger bodies
+        while reading them. Otherwise PUT /assets/ requests go to HttpRequestReceived like any unrouted request. */
+    void SetAssetUploads(bool enabled);
+    /// Sets the largest asset accepted by PUT /assets/<name>, and the largest request body of an upload, in bytes.
+    /** Larger assets are uploaded in chunks with Content-Range headers. */
+    void SetUploadLimits(u64 maxAssetSize, uint maxChunkSize);
+
+    /// Copies data into a new reply buffer.
+    static ReplyBuffer MakeReplyBuffer(const QByteArray& data);
+
+    /// Sets the reply from a shared buffer. The body is not copied other than by websocketpp into the response.
+    void SetHttpRequestReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, websocketpp::http::status_code::value status = websocketpp::http::status_code::ok);
+    /// Variants of the SetHttpRequestReply() slots that set the content type without converting it from a QString.
+    /** String literal arguments resolve to these. */
+    void SetHttpRequestReply(ConnectionPtr connection, const QByteArray& replyData, const char* contentType, websocketpp::http::status_code::value status = websocketpp::http::status_code::ok);
+    void SetHttpRequestReply(ConnectionPtr connection, const QString& reply, const char* contentType, websocketpp::http::status_code::value status = websocketpp::http::status_code::ok);
+    void SetHttpRequestReply(ConnectionPtr connection, const char* reply, const char* contentType, websocketpp::http::status_code::value status = websocketpp::http::status_code::ok);
+
+    /// Adds a route handled by a C++ function, for example a member function bound with boost::bind.
+    /** Routes take precedence over the HttpRequestReceived signal, which only gets requests that match no route.
+        Requests with a verb the path has no route for also go to the signal, and get 405 if nothing replies.
+        Returns false if the pattern is malformed or the verb and path are already routed. Call from the main thread.
+        @param pattern Path such as /assets/:name or /files/\*path; see HttpRouter. */
+    bool AddRoute(const QString& verb, const QString& pattern, const HttpRouter::Handler& handler);
+
+    /// Queues a task to be run in the main thread during Update(). Can be called from any thread.
+    /** Tasks still queued when the server stops are not run. */
+    void RunInMainThread(const MainThreadTask &task);
     
 public slots:
     /// \todo Expose types to scripting
@@ -54,8 +196,23 @@ public slots:
 
     void SetHttpRequestStatus(ConnectionPtr connection, websocketpp::http::status_code::value status);
 
+    /// Defers the reply to a request so that it can be completed in a later frame through the returned handle.
+    /** For handlers of HttpRequestReceived or of routes that cannot reply before returning. The request is
+        answered with 504 Gateway Timeout if it is not completed within timeoutSeconds, or within the default
+        timeout if it is zero or less. Returns null if the reply could not be deferred. */
+    HttpDeferredReply* DeferReply(ConnectionPtr connection, float timeoutSeconds = 0.f);
+
     Scene* GetActiveScene();
 
+    /// Adds a route for a script. Requests to it are emitted by the Requested signal of the returned object.
+    /** Returns null if the pattern is malformed or the verb and path are already routed. */
+    HttpScriptRoute* AddScriptRoute(const QString& verb, const QString& pattern);
+    /// Removes a route added with AddRoute() or AddScriptRoute(), or one of the SceneAPI routes.
+    bool RemoveRoute(const QString& verb, const QString& pattern);
+
+    /// Returns the network handler counters of the last frame and the totals since the server was started.
+    QVariantMap UpdateStatistics() const;
+
 private slots:
     void OnScriptEngineCreated(QScriptEngine *engine);
 
@@ -66,23 +223,303 @@ signals:
     /// The server has been stopped
     void ServerStopped();
     
-    /// A http request that is not internally handled has been received. Use SetRequestReply() to handle it.
+    /// A http request that matches no route has been received. Use SetRequestReply() to handle it.
+    /// Requests to a path routed only for other verbs are answered with 405 Method Not Allowed if no reply is set.
     /// \todo Expose types to scripting
     void HttpRequestReceived(ConnectionPtr connection, const QString& path, const QString& verb);
 
 protected:
     void OnHttpRequest(ConnectionHandle connection);
+    bool OnWebSocketValidate(ConnectionHandle connection);
+    void OnWebSocketOpen(ConnectionHandle connection);
+    void OnWebSocketClose(ConnectionHandle connection);
+    void OnWebSocketMessage(ConnectionHandle connection, MessagePtr message);
     
 private:
-    void HandleSceneHttpRequest(ConnectionPtr connection, const QString& path, const QString& verb);
-    void CreateEntity(EntityPtr parent, const QDomElement& childEnt_elem);
-    void CreateComponentsToEntity(EntityPtr entity, const QDomElement& root);
+    /// Runs the handler of the route matching the request, or emits HttpRequestReceived if there is none.
+    /** @param received Tick when the request was read, for the queueing delay and reply time metrics
+        @return True if the handler deferred the reply, which is then sent by whoever completes it */
+    bool DispatchHttpRequest(ConnectionPtr connection, const QString& path, const QString& verb, kNet::tick_t received);
+    /// Handles a request queued by an I/O thread and sends its reply, unless the handler deferred it.
+    void RunQueuedRequest(ConnectionPtr connection, const QString& path, const QString& verb, kNet::tick_t received);
+    /// Answers a queued request with 503 Service Unavailable when the server stops before handling it.
+    void CancelQueuedRequest(ConnectionPtr connection);
+    /// Defers the reply of a request being handled, so that it is accounted for when it is sent.
+    websocketpp::lib::error_code DeferHttpResponse(ConnectionPtr connection);
+    /// Records the metrics of a request answered before dispatch, such as a refusal, a file or an upload chunk, under the given route name.
+    /** Can be called from any thread. */
+    void RecordDirectReply(ConnectionPtr connection, const QString& route, kNet::tick_t received);
+    void RecordMetrics(const QString& verb, const QString& route, int status, u64 bytesIn, u64 bytesOut, double seconds);
+
+    /// SceneAPI route handler, called with the active scene and the negotiated reply format
+    typedef void (HttpServer::*SceneRouteHandler)(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void RegisterSceneRoutes();
+    void AddSceneRoute(HttpVerb verb, const QString& pattern, SceneRouteHandler handler);
+    /// Replies 404 if there is no active scene, otherwise calls the handler.
+    void HandleSceneRoute(SceneRouteHandler handler, const HttpRequest& request);
+    void HandleNotFound(const HttpRequest& request);
+    /// Replies with the request metrics and server statistics in the Prometheus text format.
+    void HandleMetrics(const HttpRequest& request);
+    /// Registers a completed asset upload with the asset API, in the storage of the ?storage= query item or the default storage.
+    void HandlePutAsset(const HttpRequest& request);
+    void HandleGetEntities(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetEntity(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetComponent(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetAttribute(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleDeleteEntities(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleDeleteEntity(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleDeleteComponent(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleDeleteAttribute(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePutEntity(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePutComponent(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePostEntity(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePostComponent(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleSceneBatch(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleSceneImport(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleImportProgress(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePostIdBlock(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetIdBlock(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleDeleteIdBlock(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandlePostIdBlockEntities(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetChanges(const HttpRequest& request, Scene* scene, ContentFormat format);
+    void HandleGetEvents(const HttpRequest& request, Scene* scene, ContentFormat format);
+
+    /// Returns the entity of the :id path parameter.
+    static EntityPtr RequestEntity(const HttpRequest& request, Scene* scene);
+    /// Returns the first component of the :component type in the entity of the :id path parameter.
+    static ComponentPtr RequestComponent(const HttpRequest& request, Scene* scene);
+    /// Returns the attribute of the component named or identified by the :attribute path parameter.
+    static IAttribute* RequestAttribute(IComponent* component, const HttpRequest& request);
+
+    /// Negotiates the reply format from the ?format= query item or the Accept header.
+    ContentFormat ReplyFormat(ConnectionPtr connection, const QUrl& url) const;
+    /// Returns whether the request body is JSON, based on Content-Type or the body itself.
+    bool IsJsonBody(ConnectionPtr connection) const;
+    /// Returns whether a whole scene is asked for in the binary format, with ?format=binary or an Accept header listing application/octet-stream.
+    bool WantsBinaryScene(ConnectionPtr connection, const QUrl& url) const;
+
+    void ReplyWithScene(ConnectionPtr connection, Scene* scene, ContentFormat format, const QString& cacheKey = QString(), const QByteArray& etag = QByteArray());
+    /// Replies with a list of entities. Long lists are serialized over several frames with a deferred reply.
+    /** childDepth is the number of levels of children written below each entity, SceneJsonWriter::cAllChildren for all.
+        If cacheKey is given, the reply is stored in the scene cache provided the scene still has the given ETag once the list is complete. */
+    void ReplyWithEntities(ConnectionPtr connection, Scene* scene, const std::vector<entity_id_t>& ids, ContentFormat format, uint childDepth,
+        const QString& cacheKey = QString(), const QByteArray& etag = QByteArray(), const HttpFieldSelection* fields = 0);
+    /// Replies with a page of a query result, applying the fields, depth, offset, limit and, for results in id order, cursor query items.
+    /** The total number of results is given in the X-Total-Count header and the cursor of the next page in X-Next-Cursor. */
+    void ReplyWithEntityPage(ConnectionPtr connection, Scene* scene, std::vector<entity_id_t> ids, const QUrl& url, ContentFormat format, bool idOrder);
+    /// Replies with the entities matching the component and attr.<name> query items.
+    void ReplyWithFilteredEntities(ConnectionPtr connection, Scene* scene, const QUrl& url, ContentFormat format);
+    void ReplyWithEntity(ConnectionPtr connection, Entity* entity, ContentFormat format, uint childDepth = 0);
+    /// Replies with the entities matching the near/radius or aabb query items. Returns false if they are malformed.
+    bool ReplyWithSpatialQuery(ConnectionPtr connection, Scene* scene, const QUrl& url, ContentFormat format);
+    /// Serializes an entity with its children down to the given depth.
+    QByteArray SerializeEntity(Entity* entity, ContentFormat format, uint childDepth = 0) const;
+    /// Reads the ?depth= query item: a number of levels of child entities, or "all". Returns false if it is malformed.
+    static bool ParseChildDepth(const QUrl& url, uint& childDepth);
+    static const char* ContentTypeOf(ContentFormat format);
+
+    /// Sets the ETag of the reply and replies 304 Not Modified if it matches the request's If-None-Match header.
+    /** @return True if the reply was set to 304 and nothing more needs to be sent. */
+    bool CheckNotModified(ConnectionPtr connection, const QByteArray& etag);
+    /// Replies with the cached serialization stored under key if it still has the given ETag.
+    bool ReplyFromCache(ConnectionPtr connection, const QString& key, const QByteArray& etag);
+    void ReplyWithComponent(ConnectionPtr connection, IComponent* component, ContentFormat format);
+
+    /// Sets a 200 reply, compressed in the thread pool if the client accepts it and the body is large enough.
+    /** A reply that is compressed is deferred and sent once ready; deferred tells whether it already is.
+        If cacheKey is given, the compressed body is stored with the cached reply of that key and ETag. */
+    void SetCompressibleReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, bool deferred,
+        const QString& cacheKey = QString(), const QByteArray& etag = QByteArray());
+    /// Sets a reply compressed by a compression job, stores it in the cache and sends it if it was deferred.
+    void FinishCompressedReply(shared_ptr<HttpCompressTask> task, bool deferred);
+    void SetEncodedReply(ConnectionPtr connection, const ReplyBuffer& body, const char* contentType, HttpCompression::Encoding encoding);
+    /// Sets the status, body, Content-Length and Content-Type of a reply.
+    void SetReplyBody(ConnectionPtr connection, const std::string& body, const char* contentType, websocketpp::http::status_code::value status);
+    /// Sends a deferred reply and records it in the request metrics.
+    void SendDeferredReply(ConnectionPtr connection);
+    friend class HttpCompressJob;
+    friend class HttpDeferredReply;
+    void ReplyWithAttribute(ConnectionPtr connection, IAttribute* attribute, ContentFormat format);
+    /// Replies with the changes since the given sequence number, or 410 Gone if they are no longer known.
+    void ReplyWithChanges(ConnectionPtr connection, u64 since, ContentFormat format, bool deferred);
+    /// Replies with the Server-Sent Events after the given sequence number that match the filter, and advances it past them.
+    /** If there are no events, replies with a heartbeat when force is set and otherwise returns false without replying. */
+    bool ReplyWithEvents(ConnectionPtr connection, u64& since, const HttpChangeFilter& filter, bool deferred, bool force);
+
+    void AddSubscriber(ConnectionHandle connection);
+
+    /// Applies the in-flight request cap and the rate limits to a new request. Replies and returns false if it is refused.
+    bool AdmitRequest(ConnectionPtr connection);
+    /// Replies with the given status and a Retry-After header.
+    void RefuseRequest(ConnectionPtr connection, websocketpp::http::status_code::value status, float retryAfterSeconds);
+    /// Returns true if another request may wait for changes, otherwise refuses it with 503 Service Unavailable.
+    bool AdmitChangeWaiter(ConnectionPtr connection);
 
     void Reset();
 
+    /// Runs one ready network handler or queued main thread task. Returns false if there was nothing to run.
+    bool RunNextHandler();
+    /// Releases all queued main thread tasks without running them.
+    void CancelMainThreadTasks();
+    /// Answers the waiting change requests that have changes to report or whose wait is over.
+    void ProcessChangeWaiters();
+    /// Continues the running scene imports within the import budget and forgets the oldest finished ones.
+    void ProcessImports();
+    /// Answers the deferred replies that have timed out and forgets the finished ones.
+    void CheckDeferredReplies();
+    /// Writes the next slice of each list reply being serialized and sends the finished ones.
+    void ProcessEntityStreams();
+    /// Stores a finished list reply in the scene cache if it has a cache key and the scene has not changed meanwhile.
+    void StoreStreamInCache(const HttpEntityStream &stream, const ReplyBuffer &body);
+
+    /// Main thread task along with its completion signaling
+    struct MainThreadWork
+    {
+        MainThreadTask task;
+        /// Run instead of the task if it is cancelled, when set
+        MainThreadTask cancelled;
+    };
+
     ushort port_;
     
     Framework *framework_;
     
     ServerPtr server_;
+
+    /// Number of network I/O threads to start
+    uint numIoThreads_;
+    /// Running network I/O threads
+    std::vector<HttpIoThread*> ioThreads_;
+    /// Set before the I/O threads are started and cleared after they have exited. Network handlers tell from
+    /// this whether they run in an I/O thread, as ioThreads_ is only used from the main thread.
+    QAtomicInt ioThreaded_;
+    /// Work posted from the I/O threads to the main thread
+    MpscQueue<MainThreadWork> mainThreadWork_;
+    /// Set while the server is stopping; new requests are refused
+    QAtomicInt stopping_;
+
+    /// Request rate limits per remote address
+    HttpRateLimiter* rateLimiter_;
+    /// Serves the document root and the asset cache in the I/O threads
+    HttpFileServer* fileServer_;
+    bool serveAssetCache_;
+    /// Asset uploads being received in the I/O threads
+    HttpAssetUploads* assetUploads_;
+    /// Uploaded assets registered with the asset API
+    uint assetsUploaded_;
+    /// Requests handed from the I/O threads to the main thread and not yet handled
+    QAtomicInt queuedRequests_;
+    /// Deferred replies and lists being serialized, as of the end of the last frame. Idle change waiters have a limit of their own.
+    QAtomicInt parkedReplies_;
+    /// Open WebSocket subscriber connections
+    QAtomicInt subscriberConnections_;
+    uint maxInFlight_;
+    uint maxSubscribers_;
+    uint maxChangeWaiters_;
+    /// Requests refused because of the in-flight cap, and subscribers refused because of the connection cap
+    QAtomicInt overloadRefusals_;
+    QAtomicInt refusedSubscribers_;
+
+    /// List replies being serialized over several frames
+    std::list<shared_ptr<HttpEntityStream> > entityStreams_;
+    /// Entities serialized per frame for each list reply
+    uint streamSliceSize_;
+
+    /// Versions and cached serializations of the active scene
+    HttpSceneCache* sceneCache_;
+    /// Smallest reply body that is compressed
+    uint compressMinSize_;
+    /// Number of replies compressed, and of compressed replies served from the cache
+    uint compressedReplies_;
+    uint compressedCacheHits_;
+    /// Threads that compress reply bodies
+    QThreadPool compressionPool_;
+    /// Number of 304 Not Modified replies sent
+    uint notModifiedReplies_;
+
+    /// WebSocket clients subscribed to scene changes
+    HttpSubscriptionChannel* subscriptions_;
+    /// Positions of the placeable entities of the active scene
+    HttpSpatialIndex* spatialIndex_;
+    /// Component type and attribute value indexes of the active scene
+    HttpEntityIndex* entityIndex_;
+
+    /// Request to GET /scene/changes or /scene/events waiting for changes
+    struct ChangeWaiter
+    {
+        ConnectionPtr connection;
+        u64 since;
+        ContentFormat format;
+        /// Tick when the request is answered even without changes
+        u64 deadline;
+        /// Filters of an event stream request, null for a change request
+        shared_ptr<HttpChangeFilter> filter;
+    };
+
+    /// Sequence-numbered changes of the active scene
+    HttpChangeFeed* changeFeed_;
+    std::list<ChangeWaiter> changeWaiters_;
+    /// Longest wait for changes in seconds
+    float maxChangeWait_;
+    /// Wait in seconds before an event stream request without events gets a heartbeat
+    float eventHeartbeat_;
+    /// Most bytes of events in one event stream reply
+    uint eventStreamMaxBytes_;
+    /// Event stream replies with events, and heartbeats
+    uint eventReplies_;
+    uint eventHeartbeats_;
+
+    /// Per-frame handler execution budget in milliseconds
+    float frameBudgetMs_;
+
+    /// Handlers executed during the last frame
+    uint handlersExecuted_;
+    /// Handlers executed since the server was started
+    u64 totalHandlersExecuted_;
+    /// Frames where the drain was stopped by the budget while work queued to the main thread was left to the next frame
+    uint backloggedFrames_;
+    /// Frames where handler execution took longer than the budget
+    uint budgetOverruns_;
+    /// Time spent executing handlers during the last frame, in milliseconds
+    float lastDrainMs_;
+    /// Largest amount of time the budget has been exceeded by, in milliseconds
+    float maxOverrunMs_;
+
+    /// Routes of the SceneAPI and of other modules and scripts
+    HttpRouter router_;
+    /// Routes added by scripts, by verb and pattern
+    QHash<QString, HttpScriptRoute*> scriptRoutes_;
+    /// Requests that matched no route, or no route for their verb, and were passed to HttpRequestReceived
+    uint unroutedRequests_;
+
+    /// Request counts, reply statuses and latencies per route, and the time spent per frame
+    HttpMetrics metrics_;
+    /// Request whose reply has not been sent yet, for recording the reply once it is
+    struct PendingMetrics
+    {
+        ConnectionWeakPtr connection;
+        HttpMetrics::RouteMetrics *route;
+        kNet::tick_t received;
+    };
+    /// Requests with deferred replies by connection
+    std::map<void*, PendingMetrics> pendingMetrics_;
+    /// Set when the handler being run defers its reply
+    bool replyDeferred_;
+
+    /// Replies deferred through DeferReply() that have not been completed or have timed out recently
+    std::list<QPointer<HttpDeferredReply> > deferredReplies_;
+    /// Scene imports, running and recently finished, oldest first
+    std::list<shared_ptr<HttpSceneImport> > imports_;
+    uint nextImportId_;
+    /// Time in milliseconds all running imports may spend per frame
+    float importBudgetMs_;
+    /// Entity id blocks reserved by clients in the active scene
+    HttpEntityIdBlocks* idBlocks_;
+    /// Entities created with ids from blocks
+    uint idBlockEntities_;
+
+    /// Default time in seconds a deferred reply may take
+    float deferredTimeout_;
+    /// Number of deferred replies answered with 504 Gateway Timeout
+    uint deferredTimeouts_;
 };
@@ -7,6 +7,61 @@
 #include "CoreDefines.h"
 #include "LoggingFunctions.h"
 
+#include <QDir>
+
+#ifdef HTTP_SERVER_BENCHMARKS
+#include "HttpSceneData.h"
+#include "HttpSceneDeserializer.h"
+#include "ConsoleAPI.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+
+#include "kNet/Clock.h"
+
+#include <QVariantList>
+
+#include <algorithm>
+
+namespace
+{
+
+/// Returns a value for an attribute as a JSON request would carry it: numbers, booleans and strings as such,
+/// vectors and transforms as arrays of numbers, and other types in their string form.
+QVariant BenchmarkValue(const IAttribute *attr, int round)
+{
+    const float f = (float)round + 0.5f;
+    QVariantList list;
+    switch(attr->TypeId())
+    {
+    case cAttributeReal:
+        return f;
+    case cAttributeInt:
+    case cAttributeUInt:
+        return round;
+    case cAttributeBool:
+        return (round % 2) == 0;
+    case cAttributeString:
+        return "value" + QString::number(round);
+    case cAttributeFloat2:
+    case cAttributeFloat3:
+    case cAttributeFloat4:
+    case cAttributeTransform:
+    {
+        const int count = attr->TypeId() == cAttributeFloat2 ? 2 : attr->TypeId() == cAttributeFloat3 ? 3 : attr->TypeId() == cAttributeFloat4 ? 4 : 9;
+        for(int i = 0; i < count; ++i)
+            list << f + i;
+        return list;
+    }
+    default:
+        return attr->ToString();
+    }
+}
+
+}
+#endif
+
 HttpServerModule::HttpServerModule() :
     IModule("HttpServerModule"),
     server_(0)
@@ -24,6 +79,11 @@ void HttpServerModule::Load()
 
 void HttpServerModule::Initialize()
 {
+#ifdef HTTP_SERVER_BENCHMARKS
+    framework_->Console()->RegisterCommand("HttpBenchmarkAttributes", "Times setting attributes through the HTTP server's scene deserializer. "
+        "Usage: HttpBenchmarkAttributes(numAttributes=10000, componentType=Placeable)", this, SLOT(BenchmarkAttributes(const QStringList&)));
+#endif
+
     if (framework_->HasCommandLineParameter("--httpPort"))
         StartServer();
 }
@@ -65,6 +125,240 @@ void HttpServerModule::StartServer()
         return;
     }
     server_ = new HttpServer(framework_, port);
+
+    QStringList budgetParam = framework_->CommandLineParameters("--httpFrameBudgetMs");
+    if (!budgetParam.isEmpty())
+    {
+        bool ok = false;
+        float budget = budgetParam.first().toFloat(&ok);
+        if (ok)
+            server_->SetFrameBudget(budget);
+        else
+            LogWarning("Invalid --httpFrameBudgetMs parameter given; using default of " + QString::number(server_->FrameBudget()) + " ms");
+    }
+
+    QStringList sliceParam = framework_->CommandLineParameters("--httpStreamSliceSize");
+    if (!sliceParam.isEmpty())
+    {
+        bool ok = false;
+        uint sliceSize = sliceParam.first().toUInt(&ok);
+        if (ok && sliceSize > 0)
+            server_->SetStreamSliceSize(sliceSize);
+        else
+            LogWarning("Invalid --httpStreamSliceSize parameter given; using default of " + QString::number(server_->StreamSliceSize()) + " entities");
+    }
+
+    QStringList cacheParam = framework_->CommandLineParameters("--httpCacheEntries");
+    if (!cacheParam.isEmpty())
+    {
+        bool ok = false;
+        uint cacheEntries = cacheParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetCacheSize(cacheEntries);
+        else
+            LogWarning("Invalid --httpCacheEntries parameter given; using the default cache size");
+    }
+
+    QStringList compressParam = framework_->CommandLineParameters("--httpCompressMinBytes");
+    if (!compressParam.isEmpty())
+    {
+        bool ok = false;
+        uint compressMinBytes = compressParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetCompressionMinSize(compressMinBytes);
+        else
+            LogWarning("Invalid --httpCompressMinBytes parameter given; using the default compression threshold");
+    }
+
+    QStringList changeFeedParam = framework_->CommandLineParameters("--httpChangeFeedSize");
+    if (!changeFeedParam.isEmpty())
+    {
+        bool ok = false;
+        uint changeFeedSize = changeFeedParam.first().toUInt(&ok);
+        if (ok && changeFeedSize > 0)
+            server_->SetChangeFeedSize(changeFeedSize);
+        else
+            LogWarning("Invalid --httpChangeFeedSize parameter given; using the default change feed size");
+    }
+    if (framework_->HasCommandLineParameter("--httpChangeFeedNoCompaction"))
+        server_->SetChangeFeedCompaction(false);
+
+    QStringList changeWaitParam = framework_->CommandLineParameters("--httpMaxChangeWait");
+    if (!changeWaitParam.isEmpty())
+    {
+        bool ok = false;
+        float changeWait = changeWaitParam.first().toFloat(&ok);
+        if (ok && changeWait >= 0.f)
+            server_->SetMaxChangeWait(changeWait);
+        else
+            LogWarning("Invalid --httpMaxChangeWait parameter given; using the default maximum wait");
+    }
+
+    QStringList heartbeatParam = framework_->CommandLineParameters("--httpEventHeartbeat");
+    if (!heartbeatParam.isEmpty())
+    {
+        bool ok = false;
+        float heartbeat = heartbeatParam.first().toFloat(&ok);
+        if (ok && heartbeat >= 0.f)
+            server_->SetEventStreamHeartbeat(heartbeat);
+        else
+            LogWarning("Invalid --httpEventHeartbeat parameter given; using the default heartbeat interval");
+    }
+
+    QStringList eventBytesParam = framework_->CommandLineParameters("--httpEventStreamKb");
+    if (!eventBytesParam.isEmpty())
+    {
+        bool ok = false;
+        uint eventKb = eventBytesParam.first().toUInt(&ok);
+        if (ok && eventKb > 0)
+            server_->SetEventStreamMaxBytes(eventKb * 1024);
+        else
+            LogWarning("Invalid --httpEventStreamKb parameter given; using the default event stream limit");
+    }
+
+    QStringList readRateParam = framework_->CommandLineParameters("--httpReadRate");
+    QStringList writeRateParam = framework_->CommandLineParameters("--httpWriteRate");
+    if (!readRateParam.isEmpty() || !writeRateParam.isEmpty())
+    {
+        bool readOk = true, writeOk = true;
+        float readRate = readRateParam.isEmpty() ? 0.f : readRateParam.first().toFloat(&readOk);
+        float writeRate = writeRateParam.isEmpty() ? 0.f : writeRateParam.first().toFloat(&writeOk);
+        if (readOk && writeOk)
+            server_->SetRateLimits(readRate, writeRate);
+        else
+            LogWarning("Invalid --httpReadRate or --httpWriteRate parameter given; requests are not rate limited");
+    }
+
+    QStringList inFlightParam = framework_->CommandLineParameters("--httpMaxInFlight");
+    if (!inFlightParam.isEmpty())
+    {
+        bool ok = false;
+        uint maxInFlight = inFlightParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetMaxInFlightRequests(maxInFlight);
+        else
+            LogWarning("Invalid --httpMaxInFlight parameter given; using the default in-flight request limit");
+    }
+
+    QStringList subscribersParam = framework_->CommandLineParameters("--httpMaxSubscribers");
+    if (!subscribersParam.isEmpty())
+    {
+        bool ok = false;
+        uint maxSubscribers = subscribersParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetMaxSubscribers(maxSubscribers);
+        else
+            LogWarning("Invalid --httpMaxSubscribers parameter given; using the default subscriber limit");
+    }
+
+    QStringList waitersParam = framework_->CommandLineParameters("--httpMaxWaiters");
+    if (!waitersParam.isEmpty())
+    {
+        bool ok = false;
+        uint maxWaiters = waitersParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetMaxChangeWaiters(maxWaiters);
+        else
+            LogWarning("Invalid --httpMaxWaiters parameter given; using the default limit of waiting change requests");
+    }
+
+    QStringList documentRootParam = framework_->CommandLineParameters("--httpDocumentRoot");
+    if (!documentRootParam.isEmpty())
+    {
+        if (QDir(documentRootParam.first()).exists())
+            server_->SetDocumentRoot(documentRootParam.first());
+        else
+            LogWarning("Invalid --httpDocumentRoot parameter given; the directory " + documentRootParam.first() + " does not exist");
+    }
+    if (framework_->HasCommandLineParameter("--httpServeAssetCache"))
+        server_->SetServeAssetCache(true);
+
+    if (framework_->HasCommandLineParameter("--httpAssetUploads"))
+        server_->SetAssetUploads(true);
+    QStringList uploadParam = framework_->CommandLineParameters("--httpMaxUploadMb");
+    QStringList chunkParam = framework_->CommandLineParameters("--httpUploadChunkKb");
+    if (!uploadParam.isEmpty() || !chunkParam.isEmpty())
+    {
+        bool uploadOk = true;
+        bool chunkOk = true;
+        uint maxUploadMb = uploadParam.isEmpty() ? 1024 : uploadParam.first().toUInt(&uploadOk);
+        uint chunkKb = chunkParam.isEmpty() ? 8192 : chunkParam.first().toUInt(&chunkOk);
+        if (uploadOk && chunkOk && maxUploadMb > 0 && chunkKb > 0)
+            server_->SetUploadLimits((u64)maxUploadMb * 1024 * 1024, chunkKb * 1024);
+        else
+            LogWarning("Invalid --httpMaxUploadMb or --httpUploadChunkKb parameter given; using the default upload limits");
+    }
+
+    QStringList importParam = framework_->CommandLineParameters("--httpImportBudgetMs");
+    if (!importParam.isEmpty())
+    {
+        bool ok = false;
+        float importBudget = importParam.first().toFloat(&ok);
+        if (ok && importBudget > 0.f)
+            server_->SetImportBudget(importBudget);
+        else
+            LogWarning("Invalid --httpImportBudgetMs parameter given; using the default import budget");
+    }
+
+    QStringList timeoutParam = framework_->CommandLineParameters("--httpDeferredTimeout");
+    if (!timeoutParam.isEmpty())
+    {
+        bool ok = false;
+        float timeout = timeoutParam.first().toFloat(&ok);
+        if (ok && timeout > 0.f)
+            server_->SetDeferredReplyTimeout(timeout);
+        else
+            LogWarning("Invalid --httpDeferredTimeout parameter given; using the default timeout of deferred replies");
+    }
+
+    QStringList queueParam = framework_->CommandLineParameters("--httpSubscriptionQueueKb");
+    if (!queueParam.isEmpty())
+    {
+        bool ok = false;
+        uint queueKb = queueParam.first().toUInt(&ok);
+        if (ok && queueKb > 0)
+            server_->SetSubscriptionQueueLimit(queueKb * 1024);
+        else
+            LogWarning("Invalid --httpSubscriptionQueueKb parameter given; using the default send queue limit");
+    }
+
+    QStringList cellParam = framework_->CommandLineParameters("--httpSpatialCellSize");
+    if (!cellParam.isEmpty())
+    {
+        bool ok = false;
+        float cellSize = cellParam.first().toFloat(&ok);
+        if (ok && cellSize > 0.f)
+            server_->SetSpatialCellSize(cellSize);
+        else
+            LogWarning("Invalid --httpSpatialCellSize parameter given; using the default cell size");
+    }
+
+    QStringList indexParam = framework_->CommandLineParameters("--httpIndexAttributes");
+    if (!indexParam.isEmpty())
+    {
+        // Comma-separated ComponentType.attribute pairs
+        QStringList indexes = indexParam.first().split(',', QString::SkipEmptyParts);
+        for(int i = 0; i < indexes.size(); ++i)
+        {
+            int dot = indexes[i].indexOf('.');
+            if (dot > 0)
+                server_->AddEntityIndex(indexes[i].left(dot).trimmed(), indexes[i].mid(dot + 1).trimmed());
+            else
+                LogWarning("Invalid --httpIndexAttributes entry " + indexes[i] + "; expected ComponentType.attribute");
+        }
+    }
+
+    QStringList threadsParam = framework_->CommandLineParameters("--httpThreads");
+    if (!threadsParam.isEmpty())
+    {
+        bool ok = false;
+        uint numThreads = threadsParam.first().toUInt(&ok);
+        if (ok)
+            server_->SetIoThreadCount(numThreads);
+        else
+            LogWarning("Invalid --httpThreads parameter given; polling the network from the main thread");
+    }
+
     server_->Start();
 
     framework_->RegisterDynamicObject("httpserver", server_);
@@ -82,6 +376,90 @@ void HttpServerModule::StopServer()
     }
 }
 
+#ifdef HTTP_SERVER_BENCHMARKS
+void HttpServerModule::BenchmarkAttributes(const QStringList &params)
+{
+    const uint numAttributes = params.size() > 0 ? std::max(params[0].toUInt(), 1u) : 10000;
+    const QString typeName = params.size() > 1 ? params[1] : QString("Placeable");
+    const int numRounds = 5;
+
+    // A scene of its own, unknown to the SceneAPI and so to the server
+    ScenePtr scene(new Scene("HttpAttributeBenchmark", framework_, false, true));
+    std::vector<ComponentPtr> components;
+    std::vector<QList<HttpAttributeData> > values;
+    uint total = 0;
+    while(total < numAttributes)
+    {
+        EntityPtr entity = scene->CreateEntity(0, QStringList(typeName), AttributeChange::Disconnected);
+        ComponentPtr comp = entity ? entity->Component(typeName) : ComponentPtr();
+        if (!comp || comp->Attributes().empty())
+        {
+            LogWarning("HttpBenchmarkAttributes: could not create a component of type " + typeName + " with attributes");
+            return;
+        }
+        components.push_back(comp);
+        values.push_back(QList<HttpAttributeData>());
+        const AttributeVector &attributes = comp->Attributes();
+        for(size_t i = 0; i < attributes.size() && total < numAttributes; ++i)
+        {
+            if (!attributes[i])
+                continue;
+            HttpAttributeData data;
+            data.id = attributes[i]->Id();
+            values.back().push_back(data);
+            ++total;
+        }
+    }
+
+    double stringSeconds = 0.0;
+    double typedSeconds = 0.0;
+    std::vector<QStringList> strings(values.size());
+    for(int round = 0; round < numRounds; ++round)
+    {
+        // The string forms are made beforehand, as the earlier requests arrived with values as strings already
+        for(size_t i = 0; i < values.size(); ++i)
+        {
+            strings[i].clear();
+            for(int j = 0; j < values[i].size(); ++j)
+            {
+                values[i][j].value = BenchmarkValue(components[i]->AttributeById(values[i][j].id), round);
+                strings[i].push_back(values[i][j].ValueString());
+            }
+        }
+
+        // As the requests were deserialized before: a linear lookup by id and name, and the value parsed from its string form
+        kNet::tick_t start = kNet::Clock::Tick();
+        for(size_t i = 0; i < values.size(); ++i)
+        {
+            IComponent *comp = components[i].get();
+            for(int j = 0; j < values[i].size(); ++j)
+            {
+                const HttpAttributeData &data = values[i][j];
+                IAttribute *attr = comp->AttributeById(data.id);
+                if (!attr)
+                    attr = comp->AttributeByName(data.id);
+                if (attr)
+                    attr->FromString(strings[i][j], AttributeChange::Disconnected);
+            }
+        }
+        const double seconds = kNet::Clock::TimespanToSecondsD(start, kNet::Clock::Tick());
+        stringSeconds = round ? std::min(stringSeconds, seconds) : seconds;
+
+        start = kNet::Clock::Tick();
+        HttpSceneDeserializer deserializer(framework_, scene.get(), AttributeChange::Disconnected);
+        for(size_t i = 0; i < values.size(); ++i)
+            deserializer.ApplyAttributes(components[i].get(), values[i]);
+        const double typed = kNet::Clock::TimespanToSecondsD(start, kNet::Clock::Tick());
+        typedSeconds = round ? std::min(typedSeconds, typed) : typed;
+    }
+
+    LogInfo(QString("HttpBenchmarkAttributes: %1 attributes of %2 components of type %3, best of %4 rounds: "
+        "string path %5 ms, cached lookup and typed values %6 ms (%7x)").arg(total).arg(components.size()).arg(typeName)
+        .arg(numRounds).arg(stringSeconds * 1000.0, 0, 'f', 2).arg(typedSeconds * 1000.0, 0, 'f', 2)
+        .arg(typedSeconds > 0.0 ? stringSeconds / typedSeconds : 0.0, 0, 'f', 1));
+}
+#endif
+
 extern "C"
 {
     DLLEXPORT void TundraPluginMain(Framework *fw)
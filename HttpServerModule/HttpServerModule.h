@@ -8,6 +8,7 @@
 #include "CoreTypes.h"
 
 #include <QString>
+#include <QStringList>
 
 class HttpServer;
 
@@ -34,6 +35,10 @@ signals:
 private slots:
     void StartServer();
     void StopServer();
+#ifdef HTTP_SERVER_BENCHMARKS
+    /// Times setting attributes through the REST deserializer against the id lookup and string parsing it replaced.
+    void BenchmarkAttributes(const QStringList &params);
+#endif
     
 private:
     HttpServer* server_;
@@ -0,0 +1,346 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSpatialIndex.h"
+
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+#include "EC_Placeable.h"
+#include "Math/MathFunc.h"
+
+#include <algorithm>
+#include <cmath>
+
+uint qHash(const HttpSpatialIndex::Cell &cell)
+{
+    return (uint)cell.x * 73856093u ^ (uint)cell.y * 19349663u ^ (uint)cell.z * 83492791u;
+}
+
+namespace
+{
+
+struct SphereVisitor
+{
+    SphereVisitor(const float3 &center_, float radius) : center(center_), radiusSq(radius * radius) {}
+
+    void operator()(entity_id_t id, const float3 &position)
+    {
+        const float distanceSq = position.DistanceSq(center);
+        if (distanceSq <= radiusSq)
+            found.push_back(std::make_pair(distanceSq, id));
+    }
+
+    float3 center;
+    float radiusSq;
+    std::vector<std::pair<float, entity_id_t> > found;
+};
+
+struct BoxVisitor
+{
+    BoxVisitor(const float3 &minPoint_, const float3 &maxPoint_) : minPoint(minPoint_), maxPoint(maxPoint_) {}
+
+    void operator()(entity_id_t id, const float3 &position)
+    {
+        if (position.x >= minPoint.x && position.y >= minPoint.y && position.z >= minPoint.z &&
+            position.x <= maxPoint.x && position.y <= maxPoint.y && position.z <= maxPoint.z)
+            found.push_back(id);
+    }
+
+    float3 minPoint;
+    float3 maxPoint;
+    std::vector<entity_id_t> found;
+};
+
+}
+
+HttpSpatialIndex::HttpSpatialIndex(float cellSize) :
+    cellSize_(cellSize > 0.f ? cellSize : 1.f),
+    numQueries_(0),
+    numCandidates_(0)
+{
+}
+
+void HttpSpatialIndex::SetScene(Scene *scene)
+{
+    if (scene == scene_)
+        return;
+
+    if (scene_)
+        disconnect(scene_, 0, this, 0);
+
+    scene_ = scene;
+    Rebuild();
+
+    if (scene)
+    {
+        connect(scene, SIGNAL(AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentAdded(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentAdded(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentRemoved(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentRemoved(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityRemoved(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityRemoved(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(SceneCleared(Scene*)), this, SLOT(OnSceneCleared()));
+    }
+}
+
+void HttpSpatialIndex::SetCellSize(float cellSize)
+{
+    if (cellSize <= 0.f || cellSize == cellSize_)
+        return;
+    cellSize_ = cellSize;
+    Rebuild();
+}
+
+namespace
+{
+
+int CellCoordinate(float value, float cellSize)
+{
+    // Keep far-away positions and huge query volumes within int range
+    const float limit = 1073741824.f;
+    return (int)Clamp((float)floor(value / cellSize), -limit, limit);
+}
+
+}
+
+HttpSpatialIndex::Cell HttpSpatialIndex::CellOf(const float3 &position) const
+{
+    return Cell(CellCoordinate(position.x, cellSize_), CellCoordinate(position.y, cellSize_), CellCoordinate(position.z, cellSize_));
+}
+
+void HttpSpatialIndex::Rebuild()
+{
+    entries_.clear();
+    cells_.clear();
+    dirty_.clear();
+    refParents_.clear();
+    refChildren_.clear();
+    if (!scene_)
+        return;
+
+    PROFILE(HttpSpatialIndex_Rebuild);
+    const Scene::EntityMap &entities = scene_->Entities();
+    for(Scene::EntityMap::const_iterator i = entities.begin(); i != entities.end(); ++i)
+    {
+        shared_ptr<EC_Placeable> placeable = i->second->GetComponent<EC_Placeable>();
+        if (placeable)
+            Index(i->first, placeable.get());
+    }
+}
+
+void HttpSpatialIndex::Index(entity_id_t id, EC_Placeable *placeable)
+{
+    Insert(id, placeable->WorldPosition());
+    EntityPtr parent = placeable->parentRef.Get().Lookup(scene_);
+    SetRefParent(id, parent ? parent->Id() : 0);
+}
+
+void HttpSpatialIndex::Insert(entity_id_t id, const float3 &position)
+{
+    const Cell cell = CellOf(position);
+    QHash<entity_id_t, Entry>::iterator i = entries_.find(id);
+    if (i != entries_.end())
+    {
+        i->position = position;
+        if (i->cell == cell)
+            return;
+        Remove(id);
+    }
+
+    Entry entry;
+    entry.position = position;
+    entry.cell = cell;
+    entries_.insert(id, entry);
+    cells_[cell].push_back(id);
+}
+
+void HttpSpatialIndex::Remove(entity_id_t id)
+{
+    QHash<entity_id_t, Entry>::iterator i = entries_.find(id);
+    if (i == entries_.end())
+        return;
+
+    QHash<Cell, std::vector<entity_id_t> >::iterator c = cells_.find(i->cell);
+    if (c != cells_.end())
+    {
+        std::vector<entity_id_t> &ids = c.value();
+        std::vector<entity_id_t>::iterator j = std::find(ids.begin(), ids.end(), id);
+        if (j != ids.end())
+        {
+            *j = ids.back();
+            ids.pop_back();
+        }
+        if (ids.empty())
+            cells_.erase(c);
+    }
+    entries_.erase(i);
+}
+
+void HttpSpatialIndex::SetRefParent(entity_id_t id, entity_id_t parentId)
+{
+    QHash<entity_id_t, entity_id_t>::iterator i = refParents_.find(id);
+    if (i != refParents_.end())
+    {
+        if (i.value() == parentId)
+            return;
+        refChildren_.remove(i.value(), id);
+        refParents_.erase(i);
+    }
+    if (parentId)
+    {
+        refParents_.insert(id, parentId);
+        refChildren_.insert(parentId, id);
+    }
+}
+
+void HttpSpatialIndex::MarkDirty(Entity *entity)
+{
+    QSet<entity_id_t> visited;
+    MarkDirty(entity, visited);
+}
+
+void HttpSpatialIndex::MarkDirty(Entity *entity, QSet<entity_id_t> &visited)
+{
+    // World positions of child entities, and of placeables parented by parentRef, follow their parent.
+    // Parent references may form cycles, so each entity is visited once.
+    if (visited.contains(entity->Id()))
+        return;
+    visited.insert(entity->Id());
+    dirty_.insert(entity->Id());
+    for(size_t i = 0; i < entity->NumChildren(); ++i)
+    {
+        EntityPtr child = entity->Child(i);
+        if (child)
+            MarkDirty(child.get(), visited);
+    }
+    const QList<entity_id_t> refChildren = refChildren_.values(entity->Id());
+    for(int i = 0; i < refChildren.size(); ++i)
+    {
+        EntityPtr child = scene_ ? scene_->EntityById(refChildren[i]) : EntityPtr();
+        if (child)
+            MarkDirty(child.get(), visited);
+    }
+}
+
+void HttpSpatialIndex::Refresh()
+{
+    if (dirty_.isEmpty() || !scene_)
+        return;
+
+    PROFILE(HttpSpatialIndex_Refresh);
+    for(QSet<entity_id_t>::const_iterator i = dirty_.begin(); i != dirty_.end(); ++i)
+    {
+        EntityPtr entity = scene_->EntityById(*i);
+        shared_ptr<EC_Placeable> placeable = entity ? entity->GetComponent<EC_Placeable>() : shared_ptr<EC_Placeable>();
+        if (placeable)
+            Index(*i, placeable.get());
+        else
+        {
+            Remove(*i);
+            SetRefParent(*i, 0);
+        }
+    }
+    dirty_.clear();
+}
+
+template<typename Visitor>
+void HttpSpatialIndex::Visit(const float3 &minPoint, const float3 &maxPoint, Visitor &visitor)
+{
+    Refresh();
+    ++numQueries_;
+
+    const Cell minCell = CellOf(minPoint);
+    const Cell maxCell = CellOf(maxPoint);
+    const double numCells = ((double)maxCell.x - minCell.x + 1) * ((double)maxCell.y - minCell.y + 1) * ((double)maxCell.z - minCell.z + 1);
+
+    // A volume spanning more cells than are occupied is cheaper to scan entry by entry
+    if (numCells > (double)cells_.size())
+    {
+        numCandidates_ += entries_.size();
+        for(QHash<entity_id_t, Entry>::const_iterator i = entries_.begin(); i != entries_.end(); ++i)
+            visitor(i.key(), i->position);
+        return;
+    }
+
+    for(int x = minCell.x; x <= maxCell.x; ++x)
+        for(int y = minCell.y; y <= maxCell.y; ++y)
+            for(int z = minCell.z; z <= maxCell.z; ++z)
+            {
+                QHash<Cell, std::vector<entity_id_t> >::const_iterator c = cells_.find(Cell(x, y, z));
+                if (c == cells_.end())
+                    continue;
+                const std::vector<entity_id_t> &ids = c.value();
+                numCandidates_ += ids.size();
+                for(size_t i = 0; i < ids.size(); ++i)
+                    visitor(ids[i], entries_.value(ids[i]).position);
+            }
+}
+
+std::vector<entity_id_t> HttpSpatialIndex::QuerySphere(const float3 &center, float radius)
+{
+    PROFILE(HttpSpatialIndex_QuerySphere);
+    SphereVisitor visitor(center, radius);
+    Visit(center - float3(radius, radius, radius), center + float3(radius, radius, radius), visitor);
+
+    std::sort(visitor.found.begin(), visitor.found.end());
+    std::vector<entity_id_t> ids;
+    ids.reserve(visitor.found.size());
+    for(size_t i = 0; i < visitor.found.size(); ++i)
+        ids.push_back(visitor.found[i].second);
+    return ids;
+}
+
+std::vector<entity_id_t> HttpSpatialIndex::QueryBox(const float3 &minPoint, const float3 &maxPoint)
+{
+    PROFILE(HttpSpatialIndex_QueryBox);
+    BoxVisitor visitor(minPoint, maxPoint);
+    Visit(minPoint, maxPoint, visitor);
+    std::sort(visitor.found.begin(), visitor.found.end());
+    return visitor.found;
+}
+
+void HttpSpatialIndex::OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    if (comp->TypeId() != EC_Placeable::TypeIdStatic())
+        return;
+    EC_Placeable *placeable = static_cast<EC_Placeable*>(comp);
+    if ((attribute == &placeable->transform || attribute == &placeable->parentRef) && comp->ParentEntity())
+        MarkDirty(comp->ParentEntity());
+}
+
+void HttpSpatialIndex::OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    if (comp->TypeId() == EC_Placeable::TypeIdStatic())
+        MarkDirty(entity);
+}
+
+void HttpSpatialIndex::OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    // The component is still in the entity while the signal is emitted; remove the entry right away
+    if (comp->TypeId() == EC_Placeable::TypeIdStatic())
+    {
+        dirty_.remove(entity->Id());
+        Remove(entity->Id());
+        SetRefParent(entity->Id(), 0);
+    }
+}
+
+void HttpSpatialIndex::OnEntityRemoved(Entity *entity, AttributeChange::Type /*change*/)
+{
+    dirty_.remove(entity->Id());
+    Remove(entity->Id());
+    SetRefParent(entity->Id(), 0);
+}
+
+void HttpSpatialIndex::OnSceneCleared()
+{
+    entries_.clear();
+    cells_.clear();
+    dirty_.clear();
+    refParents_.clear();
+    refChildren_.clear();
+}
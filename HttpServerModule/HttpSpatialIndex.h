@@ -0,0 +1,100 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+#include "Math/float3.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QHash>
+#include <QSet>
+
+#include <vector>
+
+class IAttribute;
+class EC_Placeable;
+
+/// Uniform hash grid of the world positions of the entities that have an EC_Placeable, for the spatial queries of GET /entities.
+/** The grid is built when a scene is first tracked and kept up to date from the scene's signals: placeables
+    whose transform or parent changes are marked dirty and re-indexed, along with their child entities and the
+    placeables parented to them through EC_Placeable::parentRef, before the next query. Only cells that overlap the queried volume are visited. */
+class HTTP_SERVER_MODULE_API HttpSpatialIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// @param cellSize Edge length of a grid cell in world units.
+    explicit HttpSpatialIndex(float cellSize);
+
+    /// Starts tracking the given scene if it is not already tracked, indexing all of its placeables.
+    void SetScene(Scene *scene);
+    /// Sets the cell size. Re-indexes the tracked scene.
+    void SetCellSize(float cellSize);
+    float CellSize() const { return cellSize_; }
+
+    /// Returns the entities within radius of center, nearest first.
+    std::vector<entity_id_t> QuerySphere(const float3 &center, float radius);
+    /// Returns the entities inside the box, in id order.
+    std::vector<entity_id_t> QueryBox(const float3 &minPoint, const float3 &maxPoint);
+
+    int NumEntities() const { return entries_.size(); }
+    int NumCells() const { return cells_.size(); }
+    uint NumQueries() const { return numQueries_; }
+    /// Number of entries examined by queries, to compare against NumQueries() * NumEntities() of a linear scan
+    u64 NumCandidates() const { return numCandidates_; }
+
+private slots:
+    void OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnEntityRemoved(Entity *entity, AttributeChange::Type change);
+    void OnSceneCleared();
+
+private:
+    struct Cell
+    {
+        Cell() : x(0), y(0), z(0) {}
+        Cell(int x_, int y_, int z_) : x(x_), y(y_), z(z_) {}
+        bool operator ==(const Cell &rhs) const { return x == rhs.x && y == rhs.y && z == rhs.z; }
+
+        int x, y, z;
+    };
+    friend uint qHash(const HttpSpatialIndex::Cell &cell);
+
+    struct Entry
+    {
+        float3 position;
+        Cell cell;
+    };
+
+    Cell CellOf(const float3 &position) const;
+    void Rebuild();
+    /// Indexes the world position of a placeable and remembers the entity its parentRef points to.
+    void Index(entity_id_t id, EC_Placeable *placeable);
+    void Insert(entity_id_t id, const float3 &position);
+    void Remove(entity_id_t id);
+    /// Sets the entity that the placeable of an entity is parented to by parentRef, 0 for none.
+    void SetRefParent(entity_id_t id, entity_id_t parentId);
+    /// Marks an entity, its descendants and the placeables parented to any of them for re-indexing.
+    void MarkDirty(Entity *entity);
+    void MarkDirty(Entity *entity, QSet<entity_id_t> &visited);
+    /// Re-indexes the dirty entities.
+    void Refresh();
+    /// Calls visitor for each entry in the cells overlapping the box, or in all entries if that is fewer.
+    template<typename Visitor> void Visit(const float3 &minPoint, const float3 &maxPoint, Visitor &visitor);
+
+    QPointer<Scene> scene_;
+    float cellSize_;
+    QHash<entity_id_t, Entry> entries_;
+    QHash<Cell, std::vector<entity_id_t> > cells_;
+    QSet<entity_id_t> dirty_;
+    /// Entities that placeables are parented to by parentRef, and the placeables parented to each entity
+    QHash<entity_id_t, entity_id_t> refParents_;
+    QMultiHash<entity_id_t, entity_id_t> refChildren_;
+
+    uint numQueries_;
+    u64 numCandidates_;
+};
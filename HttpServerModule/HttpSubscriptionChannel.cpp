@@ -0,0 +1,559 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "HttpSubscriptionChannel.h"
+#include "SceneJsonWriter.h"
+
+#include "CoreJsonUtils.h"
+#include "LoggingFunctions.h"
+#include "Profiler.h"
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+#include "Transform.h"
+#include "Math/float3.h"
+#include "Math/Quat.h"
+#include "Math/MathFunc.h"
+
+#include "kNet/Clock.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/VLEPacker.h"
+#include "kNet/NetException.h"
+
+#include <QVariantList>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+
+const char *EventNames[] =
+{
+    "attributeChanged",
+    "attributeAdded",
+    "attributeRemoved",
+    "componentAdded",
+    "componentRemoved",
+    "entityCreated",
+    "entityRemoved"
+};
+
+/// Message kinds of the binary wire format
+const u8 cBinaryChangesMessage = 1;
+/// Value encodings of the binary wire format
+const u8 cBinaryValueRaw = 0;
+const u8 cBinaryValueQuantized = 1;
+
+void AddFixedPoint(kNet::DataSerializer &ds, int integerBits, int decimalBits, float value)
+{
+    const float limit = (float)(1 << (integerBits - 1)) - 1.f / (float)(1 << decimalBits);
+    ds.AddSignedFixedPoint(integerBits, decimalBits, Clamp(value, -limit, limit));
+}
+
+void AddFixedPoint3(kNet::DataSerializer &ds, int integerBits, int decimalBits, const float3 &value)
+{
+    AddFixedPoint(ds, integerBits, decimalBits, value.x);
+    AddFixedPoint(ds, integerBits, decimalBits, value.y);
+    AddFixedPoint(ds, integerBits, decimalBits, value.z);
+}
+
+void AddAngle(kNet::DataSerializer &ds, float degrees)
+{
+    float angle = fmod(degrees, 360.f);
+    if (angle < 0.f)
+        angle += 360.f;
+    ds.AddQuantizedFloat(0.f, 360.f, 12, angle);
+}
+
+/// Writes a quantized value if the attribute type has a quantized form. Returns false otherwise.
+bool AddQuantized(kNet::DataSerializer &ds, IAttribute *attribute)
+{
+    switch(attribute->TypeId())
+    {
+    case cAttributeFloat3:
+        ds.Add<u8>(cBinaryValueQuantized);
+        AddFixedPoint3(ds, 16, 8, static_cast<Attribute<float3>*>(attribute)->Get());
+        return true;
+    case cAttributeQuat:
+    {
+        const Quat q = static_cast<Attribute<Quat>*>(attribute)->Get();
+        ds.Add<u8>(cBinaryValueQuantized);
+        ds.AddQuantizedFloat(-1.f, 1.f, 12, Clamp(q.x, -1.f, 1.f));
+        ds.AddQuantizedFloat(-1.f, 1.f, 12, Clamp(q.y, -1.f, 1.f));
+        ds.AddQuantizedFloat(-1.f, 1.f, 12, Clamp(q.z, -1.f, 1.f));
+        ds.AddQuantizedFloat(-1.f, 1.f, 12, Clamp(q.w, -1.f, 1.f));
+        return true;
+    }
+    case cAttributeTransform:
+    {
+        const Transform t = static_cast<Attribute<Transform>*>(attribute)->Get();
+        ds.Add<u8>(cBinaryValueQuantized);
+        AddFixedPoint3(ds, 16, 8, t.pos);
+        AddAngle(ds, t.rot.x);
+        AddAngle(ds, t.rot.y);
+        AddAngle(ds, t.rot.z);
+        AddFixedPoint3(ds, 12, 8, t.scale);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+template<typename T>
+bool SequenceLess(const T &a, const T &b)
+{
+    return a.sequence < b.sequence;
+}
+
+}
+
+HttpSubscriptionChannel::HttpSubscriptionChannel(uint maxQueuedBytes) :
+    sequence_(0),
+    maxQueuedBytes_(maxQueuedBytes),
+    maxLagSeconds_(10.f),
+    messagesSent_(0),
+    coalescedChanges_(0),
+    heldBackFrames_(0),
+    droppedClients_(0),
+    binaryBytesSent_(0),
+    jsonBytesSent_(0)
+{
+}
+
+void HttpSubscriptionChannel::SetServer(HttpServer::ServerPtr server)
+{
+    server_ = server;
+    if (!server)
+    {
+        clients_.clear();
+        pending_.clear();
+        SetScene(0);
+    }
+}
+
+void HttpSubscriptionChannel::SetScene(Scene *scene)
+{
+    if (scene == scene_)
+        return;
+
+    if (scene_)
+        disconnect(scene_, 0, this, 0);
+
+    scene_ = scene;
+    pending_.clear();
+
+    if (scene)
+    {
+        connect(scene, SIGNAL(AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeAdded(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeAdded(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(AttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type)),
+            this, SLOT(OnAttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentAdded(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentAdded(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(ComponentRemoved(Entity*, IComponent*, AttributeChange::Type)),
+            this, SLOT(OnComponentRemoved(Entity*, IComponent*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityCreated(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityCreated(Entity*, AttributeChange::Type)));
+        connect(scene, SIGNAL(EntityRemoved(Entity*, AttributeChange::Type)),
+            this, SLOT(OnEntityRemoved(Entity*, AttributeChange::Type)));
+    }
+}
+
+void HttpSubscriptionChannel::AddClient(HttpServer::ConnectionHandle connection)
+{
+    clients_[connection] = Client();
+}
+
+void HttpSubscriptionChannel::RemoveClient(HttpServer::ConnectionHandle connection)
+{
+    clients_.erase(connection);
+}
+
+void HttpSubscriptionChannel::HandleMessage(HttpServer::ConnectionHandle connection, const std::string &payload)
+{
+    ClientMap::iterator i = clients_.find(connection);
+    if (i == clients_.end())
+        return;
+
+    bool ok = false;
+    QVariant message = TundraJson::Parse(QByteArray::fromRawData(payload.data(), (int)payload.size()), &ok);
+    if (!ok || message.type() != QVariant::Map)
+    {
+        LogWarning("HttpSubscriptionChannel: ignoring malformed subscription message");
+        return;
+    }
+
+    const QVariantMap object = message.toMap();
+    if (object.contains("format"))
+    {
+        const QString format = object.value("format").toString();
+        if (format == "binary")
+            i->second.format = object.value("quantize").toBool() ? QuantizedBinaryWire : BinaryWire;
+        else if (format == "json")
+            i->second.format = JsonWire;
+        else
+            LogWarning("HttpSubscriptionChannel: unknown subscription format \"" + format + "\"");
+    }
+    if (object.contains("subscribe"))
+        ApplySubscription(i->second, object.value("subscribe").toMap(), true);
+    if (object.contains("unsubscribe"))
+        ApplySubscription(i->second, object.value("unsubscribe").toMap(), false);
+}
+
+void HttpSubscriptionChannel::ApplySubscription(Client &client, const QVariantMap &filter, bool subscribe)
+{
+    if (filter.contains("all"))
+        client.all = subscribe && filter.value("all").toBool();
+
+    const QVariantList entities = filter.value("entities").toList();
+    for(int i = 0; i < entities.size(); ++i)
+    {
+        if (subscribe)
+            client.entities.insert(entities[i].toUInt());
+        else
+            client.entities.remove(entities[i].toUInt());
+    }
+
+    const QVariantList components = filter.value("components").toList();
+    for(int i = 0; i < components.size(); ++i)
+    {
+        if (subscribe)
+            client.componentTypes.insert(components[i].toString());
+        else
+            client.componentTypes.remove(components[i].toString());
+    }
+
+    const QVariantList attributes = filter.value("attributes").toList();
+    for(int i = 0; i < attributes.size(); ++i)
+    {
+        if (subscribe)
+            client.attributeNames.insert(attributes[i].toString());
+        else
+            client.attributeNames.remove(attributes[i].toString());
+    }
+}
+
+bool HttpSubscriptionChannel::Matches(const Client &client, const SerializedChange &change)
+{
+    if (client.all || client.entities.contains(change.entity))
+        return true;
+    if (!change.componentType.isEmpty() && client.componentTypes.contains(change.componentType))
+        return true;
+    if (!change.attributeId.isEmpty() && (client.attributeNames.contains(change.attributeId) || client.attributeNames.contains(change.attributeName)))
+        return true;
+    return false;
+}
+
+void HttpSubscriptionChannel::AddChange(ChangeEvent event, Entity *entity, IComponent *comp, IAttribute *attribute)
+{
+    // Nothing is recorded while no client is connected
+    if (clients_.empty() || !entity)
+        return;
+
+    PendingChange change;
+    change.sequence = ++sequence_;
+    change.event = event;
+    change.entity = entity->Id();
+    change.componentId = 0;
+    change.componentTypeId = 0;
+    change.attributeIndex = 0;
+    change.attributeTypeId = 0;
+    if (comp)
+    {
+        change.componentType = comp->TypeName();
+        change.componentName = comp->Name();
+        change.component = comp->shared_from_this();
+        change.componentId = comp->Id();
+        change.componentTypeId = comp->TypeId();
+    }
+    if (attribute)
+    {
+        change.attributeId = attribute->Id();
+        change.attributeName = attribute->Name();
+        // IAttribute::Index() is a u8, which dynamic components with more attributes outgrow
+        change.attributeIndex = attribute->Index();
+        if (comp)
+        {
+            const AttributeVector &attributes = comp->Attributes();
+            AttributeVector::const_iterator found = std::find(attributes.begin(), attributes.end(), attribute);
+            if (found != attributes.end())
+                change.attributeIndex = (u32)(found - attributes.begin());
+        }
+        change.attributeTypeId = attribute->TypeId();
+    }
+
+    // Later changes of the same item replace earlier ones, keeping the order of the latest
+    QByteArray key = QByteArray::number(change.entity);
+    if (comp)
+        key += '/' + change.componentType.toUtf8() + '/' + change.componentName.toUtf8();
+    if (attribute)
+        key += '/' + change.attributeId.toUtf8();
+
+    QHash<QByteArray, PendingChange>::iterator i = pending_.find(key);
+    if (i != pending_.end())
+    {
+        ++coalescedChanges_;
+        // A value change after an addition in the same frame is still an addition
+        if (event == AttributeChangedEvent && i->event == AttributeAddedEvent)
+            change.event = AttributeAddedEvent;
+        *i = change;
+    }
+    else
+        pending_.insert(key, change);
+}
+
+QByteArray HttpSubscriptionChannel::Serialize(const PendingChange &change) const
+{
+    QByteArray json;
+    SceneJsonWriter writer(json);
+    json += "{\"event\":\"";
+    json += EventNames[change.event];
+    json += "\",\"entity\":" + QByteArray::number(change.entity);
+    if (!change.componentType.isEmpty())
+    {
+        json += ",\"component\":";
+        writer.WriteString(change.componentType);
+        json += ",\"componentName\":";
+        writer.WriteString(change.componentName);
+    }
+    if (!change.attributeId.isEmpty())
+    {
+        json += ",\"attribute\":";
+        writer.WriteString(change.attributeId);
+        if (change.event != AttributeRemovedEvent)
+        {
+            // The component may have been removed after the change; then only the removal is of interest
+            ComponentPtr comp = change.component.lock();
+            IAttribute *attribute = comp ? comp->AttributeById(change.attributeId) : 0;
+            if (!attribute)
+                return QByteArray();
+            json += ",\"value\":";
+            writer.WriteString(attribute->ToString());
+        }
+    }
+    json += '}';
+    return json;
+}
+
+QByteArray HttpSubscriptionChannel::SerializeBinary(const PendingChange &change, bool quantize) const
+{
+    IAttribute *attribute = 0;
+    const bool hasValue = !change.attributeId.isEmpty() && change.event != AttributeRemovedEvent;
+    if (hasValue)
+    {
+        ComponentPtr comp = change.component.lock();
+        attribute = comp ? comp->AttributeById(change.attributeId) : 0;
+        if (!attribute)
+            return QByteArray();
+    }
+
+    // Long string or buffer values may not fit in the first guess; grow until the record fits
+    for(size_t maxBytes = 256; maxBytes <= 16 * 1024 * 1024; maxBytes *= 4)
+    {
+        try
+        {
+            kNet::DataSerializer ds(maxBytes);
+            ds.Add<u8>((u8)change.event);
+            // Local ids have the high bit set, which a VLE can not hold
+            ds.Add<u32>(change.entity);
+            if (!change.componentType.isEmpty())
+            {
+                ds.Add<u32>(change.componentId);
+                ds.AddVLE<kNet::VLE8_16_32>(change.componentTypeId);
+            }
+            if (!change.attributeId.isEmpty())
+            {
+                ds.AddVLE<kNet::VLE8_16_32>(change.attributeIndex);
+                ds.Add<u8>((u8)change.attributeTypeId);
+            }
+            if (hasValue && !(quantize && AddQuantized(ds, attribute)))
+            {
+                ds.Add<u8>(cBinaryValueRaw);
+                attribute->ToBinary(ds);
+            }
+            return QByteArray(ds.GetData(), (int)ds.BytesFilled());
+        }
+        catch(kNet::NetException &)
+        {
+        }
+    }
+
+    LogWarning("HttpSubscriptionChannel: value of attribute " + change.attributeId + " is too large to send");
+    return QByteArray();
+}
+
+void HttpSubscriptionChannel::Flush()
+{
+    if (clients_.empty())
+    {
+        pending_.clear();
+        return;
+    }
+
+    PROFILE(HttpSubscriptionChannel_Flush);
+
+    // Serialize each coalesced change once per wire format in use, whatever the number of clients
+    bool needJson = false, needBinary = false, needQuantized = false;
+    for(ClientMap::const_iterator i = clients_.begin(); i != clients_.end(); ++i)
+    {
+        needJson |= (i->second.format == JsonWire);
+        needBinary |= (i->second.format == BinaryWire);
+        needQuantized |= (i->second.format == QuantizedBinaryWire);
+    }
+
+    std::vector<std::pair<QByteArray, SerializedChange> > changes;
+    changes.reserve(pending_.size());
+    for(QHash<QByteArray, PendingChange>::const_iterator i = pending_.begin(); i != pending_.end(); ++i)
+    {
+        SerializedChange change;
+        if (needJson)
+            change.json = Serialize(i.value());
+        if (needBinary)
+            change.binary = SerializeBinary(i.value(), false);
+        if (needQuantized)
+            change.quantized = SerializeBinary(i.value(), true);
+        if (change.json.isEmpty() && change.binary.isEmpty() && change.quantized.isEmpty())
+            continue;
+        change.sequence = i->sequence;
+        change.entity = i->entity;
+        change.componentType = i->componentType;
+        change.attributeId = i->attributeId;
+        change.attributeName = i->attributeName;
+        changes.push_back(std::make_pair(i.key(), change));
+    }
+    pending_.clear();
+
+    for(ClientMap::iterator i = clients_.begin(); i != clients_.end();)
+    {
+        Client &client = i->second;
+        for(size_t j = 0; j < changes.size(); ++j)
+        {
+            if (!Matches(client, changes[j].second))
+                continue;
+            if (client.held.contains(changes[j].first))
+                ++coalescedChanges_;
+            client.held.insert(changes[j].first, changes[j].second);
+        }
+
+        if (!client.held.isEmpty() && !SendHeld(i->first, client))
+        {
+            ++droppedClients_;
+            websocketpp::lib::error_code ec;
+            server_->close(i->first, websocketpp::close::status::policy_violation, "Send queue limit exceeded", ec);
+            clients_.erase(i++);
+        }
+        else
+            ++i;
+    }
+}
+
+bool HttpSubscriptionChannel::SendHeld(const HttpServer::ConnectionHandle &connection, Client &client)
+{
+    websocketpp::lib::error_code ec;
+    HttpServer::ConnectionPtr connectionPtr = server_->get_con_from_hdl(connection, ec);
+    if (ec || !connectionPtr)
+        return false;
+
+    // Backpressure: hold the changes back while the client has not read the previous messages
+    const size_t queued = connectionPtr->get_buffered_amount();
+    if (queued > maxQueuedBytes_)
+    {
+        if (!client.lagStart)
+            client.lagStart = kNet::Clock::Tick();
+        ++heldBackFrames_;
+        return queued <= 4 * (size_t)maxQueuedBytes_ &&
+            kNet::Clock::TimespanToSecondsD(client.lagStart, kNet::Clock::Tick()) <= maxLagSeconds_;
+    }
+    client.lagStart = 0;
+
+    std::vector<SerializedChange> changes;
+    changes.reserve(client.held.size());
+    for(QHash<QByteArray, SerializedChange>::const_iterator i = client.held.begin(); i != client.held.end(); ++i)
+        changes.push_back(i.value());
+    client.held.clear();
+    std::sort(changes.begin(), changes.end(), SequenceLess<SerializedChange>);
+
+    std::string message;
+    if (client.format == JsonWire)
+    {
+        message = "{\"changes\":[";
+        bool first = true;
+        for(size_t i = 0; i < changes.size(); ++i)
+        {
+            if (changes[i].json.isEmpty())
+                continue;
+            if (!first)
+                message += ',';
+            first = false;
+            message.append(changes[i].json.constData(), changes[i].json.size());
+        }
+        message += "]}";
+    }
+    else
+    {
+        // Records are byte-aligned, so the ones serialized for all clients are simply concatenated after the header
+        const bool quantized = (client.format == QuantizedBinaryWire);
+        u32 numRecords = 0;
+        for(size_t i = 0; i < changes.size(); ++i)
+            numRecords += (quantized ? changes[i].quantized : changes[i].binary).isEmpty() ? 0 : 1;
+        kNet::DataSerializer header(8);
+        header.Add<u8>(cBinaryChangesMessage);
+        header.AddVLE<kNet::VLE8_16_32>(numRecords);
+        message.append(header.GetData(), header.BytesFilled());
+        for(size_t i = 0; i < changes.size(); ++i)
+        {
+            const QByteArray &record = quantized ? changes[i].quantized : changes[i].binary;
+            message.append(record.constData(), record.size());
+        }
+    }
+
+    server_->send(connection, message, client.format == JsonWire ? websocketpp::frame::opcode::text : websocketpp::frame::opcode::binary, ec);
+    if (ec)
+        return false;
+    ++messagesSent_;
+    if (client.format == JsonWire)
+        jsonBytesSent_ += (uint)message.size();
+    else
+        binaryBytesSent_ += (uint)message.size();
+    return true;
+}
+
+void HttpSubscriptionChannel::OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeChangedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpSubscriptionChannel::OnAttributeAdded(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeAddedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpSubscriptionChannel::OnAttributeRemoved(IComponent *comp, IAttribute *attribute, AttributeChange::Type /*change*/)
+{
+    AddChange(AttributeRemovedEvent, comp->ParentEntity(), comp, attribute);
+}
+
+void HttpSubscriptionChannel::OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    AddChange(ComponentAddedEvent, entity, comp, 0);
+}
+
+void HttpSubscriptionChannel::OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type /*change*/)
+{
+    AddChange(ComponentRemovedEvent, entity, comp, 0);
+}
+
+void HttpSubscriptionChannel::OnEntityCreated(Entity *entity, AttributeChange::Type /*change*/)
+{
+    AddChange(EntityCreatedEvent, entity, 0, 0);
+}
+
+void HttpSubscriptionChannel::OnEntityRemoved(Entity *entity, AttributeChange::Type /*change*/)
+{
+    AddChange(EntityRemovedEvent, entity, 0, 0);
+}
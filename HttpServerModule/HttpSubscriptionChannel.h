@@ -0,0 +1,184 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "HttpServer.h"
+#include "SceneFwd.h"
+#include "AttributeChangeType.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QVariant>
+
+#include <map>
+#include <boost/smart_ptr/owner_less.hpp>
+
+class IAttribute;
+
+/// Pushes scene change notifications to WebSocket clients subscribed at /subscribe.
+/** A client sends text messages of the form
+        {"subscribe": {"entities": [1, 2], "components": ["EC_Placeable"], "attributes": ["transform"]}}
+    and the same with "unsubscribe"; {"subscribe": {"all": true}} subscribes to every change. A change is
+    sent if its entity, component type or attribute id/name is subscribed.
+
+    Changes are collected during the frame and coalesced: however many times an attribute changes, it is
+    serialized once, with its latest value, in Flush(). Each client then gets at most one message per frame:
+        {"changes": [{"event": "attributeChanged", "entity": 1, "component": "EC_Placeable", "componentName": "",
+                      "attribute": "transform", "value": "..."}, {"event": "entityRemoved", "entity": 2}, ...]}
+
+    A client can switch to binary messages with {"format": "binary"}, optionally with "quantize": true, and back
+    with {"format": "json"}. A binary message is a sequence of byte-aligned records written with kNet::DataSerializer:
+        u8 message kind (1 = changes), VLE8_16_32 record count, then for each record
+        u8 event (ChangeEvent order), u32 entity id,
+        for component and attribute events: u32 component id, VLE component type id,
+        for attribute events: VLE attribute index, u8 attribute type id,
+        unless removed: u8 encoding (0 = IAttribute::ToBinary, 1 = quantized) followed by the value.
+    Quantized values are float3 as three 16.8 signed fixed point numbers, Quat as four 12-bit floats in [-1, 1] and
+    Transform as a 16.8 fixed point position, 12-bit Euler angles in [0, 360) and a 12.8 fixed point scale.
+
+    When the bytes still waiting in a client's send queue exceed the queue limit, its messages are held back
+    and further changes are merged into the held message, so a slow client receives fewer, downsampled
+    updates. A client whose queue exceeds four times the limit, or which stays over the limit for longer
+    than the lag limit, is disconnected. */
+class HTTP_SERVER_MODULE_API HttpSubscriptionChannel : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// @param maxQueuedBytes Send queue size above which a client's updates are held back.
+    explicit HttpSubscriptionChannel(uint maxQueuedBytes);
+
+    /// Sets the server used for sending. Null releases all clients.
+    void SetServer(HttpServer::ServerPtr server);
+    /// Starts tracking the given scene if it is not already tracked.
+    void SetScene(Scene *scene);
+
+    /// Sets the send queue limit in bytes.
+    void SetMaxQueuedBytes(uint maxQueuedBytes) { maxQueuedBytes_ = maxQueuedBytes; }
+    uint MaxQueuedBytes() const { return maxQueuedBytes_; }
+    /// Sets how long in seconds a client may stay over the queue limit before it is disconnected.
+    void SetMaxLagSeconds(float seconds) { maxLagSeconds_ = seconds; }
+
+    void AddClient(HttpServer::ConnectionHandle connection);
+    void RemoveClient(HttpServer::ConnectionHandle connection);
+    /// Handles a subscribe or unsubscribe message from a client.
+    void HandleMessage(HttpServer::ConnectionHandle connection, const std::string &payload);
+
+    /// Serializes the changes collected during the frame and sends them to the subscribed clients.
+    void Flush();
+
+    int NumClients() const { return (int)clients_.size(); }
+    uint MessagesSent() const { return messagesSent_; }
+    uint CoalescedChanges() const { return coalescedChanges_; }
+    uint HeldBackFrames() const { return heldBackFrames_; }
+    uint DroppedClients() const { return droppedClients_; }
+    uint BinaryBytesSent() const { return binaryBytesSent_; }
+    uint JsonBytesSent() const { return jsonBytesSent_; }
+
+private slots:
+    void OnAttributeChanged(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnAttributeAdded(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnAttributeRemoved(IComponent *comp, IAttribute *attribute, AttributeChange::Type change);
+    void OnComponentAdded(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnComponentRemoved(Entity *entity, IComponent *comp, AttributeChange::Type change);
+    void OnEntityCreated(Entity *entity, AttributeChange::Type change);
+    void OnEntityRemoved(Entity *entity, AttributeChange::Type change);
+
+private:
+    enum ChangeEvent
+    {
+        AttributeChangedEvent,
+        AttributeAddedEvent,
+        AttributeRemovedEvent,
+        ComponentAddedEvent,
+        ComponentRemovedEvent,
+        EntityCreatedEvent,
+        EntityRemovedEvent
+    };
+
+    /// Change collected during the frame. Attribute values are read only when the frame is flushed.
+    struct PendingChange
+    {
+        u64 sequence;
+        ChangeEvent event;
+        entity_id_t entity;
+        QString componentType;
+        QString componentName;
+        QString attributeId;
+        QString attributeName;
+        ComponentWeakPtr component;
+        component_id_t componentId;
+        u32 componentTypeId;
+        u32 attributeIndex;
+        u32 attributeTypeId;
+    };
+
+    /// Serialized change along with what it can be matched against
+    struct SerializedChange
+    {
+        u64 sequence;
+        entity_id_t entity;
+        QString componentType;
+        QString attributeId;
+        QString attributeName;
+        QByteArray json;
+        QByteArray binary;
+        QByteArray quantized;
+    };
+
+    enum WireFormat
+    {
+        JsonWire,
+        BinaryWire,
+        QuantizedBinaryWire
+    };
+
+    struct Client
+    {
+        Client() : all(false), format(JsonWire), lagStart(0) {}
+
+        bool all;
+        WireFormat format;
+        QSet<entity_id_t> entities;
+        QSet<QString> componentTypes;
+        QSet<QString> attributeNames;
+        /// Changes not sent yet, by coalescing key
+        QHash<QByteArray, SerializedChange> held;
+        /// Tick when the send queue went over the limit, or 0
+        u64 lagStart;
+    };
+
+    typedef std::map<HttpServer::ConnectionHandle, Client, boost::owner_less<HttpServer::ConnectionHandle> > ClientMap;
+
+    void AddChange(ChangeEvent event, Entity *entity, IComponent *comp, IAttribute *attribute);
+    static bool Matches(const Client &client, const SerializedChange &change);
+    static void ApplySubscription(Client &client, const QVariantMap &filter, bool subscribe);
+    QByteArray Serialize(const PendingChange &change) const;
+    /// Writes the binary record of a change. Returns an empty array if the change no longer applies.
+    QByteArray SerializeBinary(const PendingChange &change, bool quantize) const;
+    /// Sends the held changes of a client unless its send queue is over the limit. Returns false if the client should be dropped.
+    bool SendHeld(const HttpServer::ConnectionHandle &connection, Client &client);
+
+    HttpServer::ServerPtr server_;
+    QPointer<Scene> scene_;
+    ClientMap clients_;
+
+    /// Changes of the current frame by coalescing key
+    QHash<QByteArray, PendingChange> pending_;
+    u64 sequence_;
+
+    uint maxQueuedBytes_;
+    float maxLagSeconds_;
+
+    uint messagesSent_;
+    uint coalescedChanges_;
+    uint heldBackFrames_;
+    uint droppedClients_;
+    uint binaryBytesSent_;
+    uint jsonBytesSent_;
+};
@@ -0,0 +1,84 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include <QAtomicPointer>
+
+/// Unbounded lock-free queue for any number of producer threads and a single consumer thread.
+/** Producers never block each other: Push() is one atomic exchange and one pointer store.
+    TryPop() may only be called from the consumer thread. A producer that has been preempted between
+    the exchange and the store makes the queue look empty until it resumes, which is harmless for work
+    queues that are drained periodically. */
+template<typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+    {
+        Node *stub = new Node();
+        head_ = stub;
+        tail_ = stub;
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while(TryPop(value))
+            ;
+        delete tail_;
+    }
+
+    /// Appends a value to the queue. Can be called from any thread.
+    void Push(const T &value)
+    {
+        Node *node = new Node(value);
+        Node *prev = head_.fetchAndStoreOrdered(node);
+        prev->next.fetchAndStoreRelease(node);
+    }
+
+    /// Removes the oldest value from the queue. Can only be called from the consumer thread.
+    /** @return False if the queue was empty. */
+    bool TryPop(T &value)
+    {
+        // The acquire pairs with the release in Push(): once the node is seen, so is its value
+        Node *tail = tail_;
+        Node *next = LoadAcquire(tail->next);
+        if (!next)
+            return false;
+        value = next->value;
+        next->value = T(); // The node becomes the new stub, release what it holds.
+        tail_ = next;
+        delete tail;
+        return true;
+    }
+
+    /// Returns whether the queue is empty. Only reliable from the consumer thread.
+    bool IsEmpty() const
+    {
+        return LoadAcquire(tail_->next) == 0;
+    }
+
+private:
+    struct Node;
+
+    /// Reads a pointer with acquire ordering. QAtomicPointer has no plain acquire load in Qt 4; adding zero stands in for one.
+    static Node *LoadAcquire(QAtomicPointer<Node> &pointer)
+    {
+        return pointer.fetchAndAddAcquire(0);
+    }
+
+    struct Node
+    {
+        Node() : next(0) {}
+        explicit Node(const T &v) : next(0), value(v) {}
+
+        QAtomicPointer<Node> next;
+        T value;
+    };
+
+    QAtomicPointer<Node> head_; ///< Last pushed node, shared by the producers.
+    Node *tail_; ///< Stub node preceding the oldest value, owned by the consumer.
+
+    MpscQueue(const MpscQueue &);
+    void operator =(const MpscQueue &);
+};
@@ -0,0 +1,163 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#include "SceneJsonWriter.h"
+#include "HttpSceneData.h"
+
+#include "Scene.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+
+SceneJsonWriter::SceneJsonWriter(QByteArray &output, bool serializeTemporary, bool serializeLocal) :
+    out_(output),
+    serializeTemporary_(serializeTemporary),
+    serializeLocal_(serializeLocal),
+    fields_(0)
+{
+}
+
+bool SceneJsonWriter::ShouldWrite(const Entity *entity) const
+{
+    return (serializeTemporary_ || !entity->IsTemporary()) && (serializeLocal_ || !entity->IsLocal());
+}
+
+bool SceneJsonWriter::ShouldWrite(const IComponent *component) const
+{
+    return (serializeTemporary_ || !component->IsTemporary()) && (serializeLocal_ || component->IsReplicated());
+}
+
+void SceneJsonWriter::WriteScene(const Scene *scene)
+{
+    out_ += "{\"entities\":[";
+    bool first = true;
+    const Scene::EntityMap &entities = scene->Entities();
+    for(Scene::EntityMap::const_iterator i = entities.begin(); i != entities.end(); ++i)
+    {
+        const Entity *entity = i->second.get();
+        if (entity->Parent() || !ShouldWrite(entity))
+            continue;
+        if (!first)
+            out_ += ',';
+        first = false;
+        WriteEntity(entity, true);
+    }
+    out_ += "]}";
+}
+
+void SceneJsonWriter::WriteEntityTree(const Entity *entity, uint depth)
+{
+    out_ += "{\"id\":";
+    out_ += QByteArray::number(entity->Id());
+    out_ += entity->IsReplicated() ? ",\"sync\":true" : ",\"sync\":false";
+    out_ += entity->IsTemporary() ? ",\"temporary\":true" : ",\"temporary\":false";
+
+    out_ += ",\"components\":[";
+    bool first = true;
+    const Entity::ComponentMap &components = entity->Components();
+    for(Entity::ComponentMap::const_iterator i = components.begin(); i != components.end(); ++i)
+    {
+        if (!ShouldWrite(i->second.get()) || (fields_ && !fields_->SelectsComponent(i->second->TypeName())))
+            continue;
+        if (!first)
+            out_ += ',';
+        first = false;
+        WriteComponent(i->second.get());
+    }
+    out_ += ']';
+
+    if (depth > 0)
+    {
+        out_ += ",\"children\":[";
+        first = true;
+        for(size_t i = 0; i < entity->NumChildren(); ++i)
+        {
+            EntityPtr child = entity->Child(i);
+            if (!child || !ShouldWrite(child.get()))
+                continue;
+            if (!first)
+                out_ += ',';
+            first = false;
+            WriteEntityTree(child.get(), depth == cAllChildren ? depth : depth - 1);
+        }
+        out_ += ']';
+    }
+    out_ += '}';
+}
+
+void SceneJsonWriter::WriteComponent(const IComponent *component)
+{
+    out_ += "{\"type\":";
+    WriteString(component->TypeName());
+    out_ += ",\"typeId\":";
+    out_ += QByteArray::number(component->TypeId());
+    out_ += ",\"name\":";
+    WriteString(component->Name());
+    out_ += component->IsReplicated() ? ",\"sync\":true" : ",\"sync\":false";
+    out_ += component->IsTemporary() ? ",\"temporary\":true" : ",\"temporary\":false";
+
+    out_ += ",\"attributes\":[";
+    bool first = true;
+    const AttributeVector &attributes = component->Attributes();
+    for(size_t i = 0; i < attributes.size(); ++i)
+    {
+        // Dynamic components may leave holes in the attribute vector
+        if (!attributes[i])
+            continue;
+        if (fields_ && !fields_->SelectsAttribute(component->TypeName(), attributes[i]->Id(), attributes[i]->Name()))
+            continue;
+        if (!first)
+            out_ += ',';
+        first = false;
+        WriteAttribute(attributes[i]);
+    }
+    out_ += "]}";
+}
+
+void SceneJsonWriter::WriteAttribute(const IAttribute *attribute)
+{
+    out_ += "{\"id\":";
+    WriteString(attribute->Id());
+    out_ += ",\"name\":";
+    WriteString(attribute->Name());
+    out_ += ",\"type\":";
+    WriteString(attribute->TypeName());
+    out_ += ",\"value\":";
+    WriteString(attribute->ToString());
+    out_ += '}';
+}
+
+void SceneJsonWriter::WriteString(const QString &str)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    out_ += '"';
+    const QByteArray utf8 = str.toUtf8();
+    const char *data = utf8.constData();
+    const int length = utf8.size();
+    int runStart = 0;
+    for(int i = 0; i < length; ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // Flush the unescaped run preceding the character
+        out_.append(data + runStart, i - runStart);
+        runStart = i + 1;
+        switch(c)
+        {
+        case '"': out_ += "\\\""; break;
+        case '\\': out_ += "\\\\"; break;
+        case '\n': out_ += "\\n"; break;
+        case '\r': out_ += "\\r"; break;
+        case '\t': out_ += "\\t"; break;
+        default:
+            out_ += "\\u00";
+            out_ += hexDigits[c >> 4];
+            out_ += hexDigits[c & 0xf];
+            break;
+        }
+    }
+    out_.append(data + runStart, length - runStart);
+    out_ += '"';
+}
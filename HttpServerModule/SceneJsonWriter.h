@@ -0,0 +1,56 @@
+// For conditions of distribution and use, see copyright notice in LICENSE
+
+#pragma once
+
+#include "HttpServerModuleApi.h"
+#include "SceneFwd.h"
+#include "CoreTypes.h"
+
+#include <QByteArray>
+#include <QString>
+
+class IAttribute;
+struct HttpFieldSelection;
+
+/// Writes scene content as JSON directly into an output buffer, without building an intermediate document.
+/** Layout:
+    scene:     { "entities" : [ entity, ... ] }
+    entity:    { "id" : 1, "sync" : true, "temporary" : false, "components" : [ component, ... ], "children" : [ entity, ... ] }
+    component: { "type" : "EC_Name", "typeId" : 26, "name" : "", "sync" : true, "temporary" : false, "attributes" : [ attribute, ... ] }
+    attribute: { "id" : "name", "name" : "Name", "type" : "string", "value" : "..." }
+    Attribute values are written in their IAttribute::ToString() form. */
+class HTTP_SERVER_MODULE_API SceneJsonWriter
+{
+public:
+    /// Appends all output to the given buffer.
+    explicit SceneJsonWriter(QByteArray &output, bool serializeTemporary = true, bool serializeLocal = true);
+
+    /// Writes all root level entities of the scene and their children.
+    void WriteScene(const Scene *scene);
+    /// Writes an entity. Children are written only if serializeChildren is true.
+    void WriteEntity(const Entity *entity, bool serializeChildren) { WriteEntityTree(entity, serializeChildren ? cAllChildren : 0); }
+    /// Writes an entity and its descendants down to depth levels below it. At depth zero the "children" array is left out.
+    void WriteEntityTree(const Entity *entity, uint depth);
+    void WriteComponent(const IComponent *component);
+    void WriteAttribute(const IAttribute *attribute);
+
+    /// Writes a JSON string literal with escaping.
+    void WriteString(const QString &str);
+
+    /// Limits the components and attributes written by WriteEntity() and WriteComponent(). Null writes everything.
+    void SetFieldSelection(const HttpFieldSelection *fields) { fields_ = fields; }
+
+    QByteArray &Output() { return out_; }
+
+    /// Depth of WriteEntityTree() that writes all descendants
+    static const uint cAllChildren = 0xffffffff;
+
+private:
+    bool ShouldWrite(const Entity *entity) const;
+    bool ShouldWrite(const IComponent *component) const;
+
+    QByteArray &out_;
+    bool serializeTemporary_;
+    bool serializeLocal_;
+    const HttpFieldSelection *fields_;
+};